@@ -60,9 +60,12 @@
 #include "gstomx_filereadersrc.h"
 #endif /* EXPERIMENTAL */
 #include "gstomx_volume.h"
+#include "gstomx_shard.h"
 
 GST_DEBUG_CATEGORY (gstomx_debug);
 
+#define DEFAULT_POOL_IDLE 10000
+
 static const GstStructure *element_table;
 static GQuark element_name_quark;
 
@@ -99,7 +102,7 @@ static GType (*get_type[]) (void) = {
 #ifdef EXPERIMENTAL
       gst_omx_videosink_get_type, gst_omx_filereadersrc_get_type,
 #endif /* EXPERIMENTAL */
-gst_omx_volume_get_type,};
+gst_omx_volume_get_type, gst_omx_shard_get_type,};
 
 static gchar *
 get_config_path (void)
@@ -251,7 +254,9 @@ plugin_init (GstPlugin * plugin)
     component_role = gst_structure_get_string (element, "component-role");
     library_name = gst_structure_get_string (element, "library-name");
 
-    if (!type_name || !component_name || !library_name) {
+    /* sharded elements use the component of another entry */
+    if (!type_name || ((!component_name || !library_name) &&
+            !gst_structure_has_field (element, "shard-element"))) {
       g_warning ("malformed config file: missing required fields for %s",
           element_name);
       return FALSE;
@@ -292,6 +297,22 @@ plugin_init (GstPlugin * plugin)
   return TRUE;
 }
 
+/**
+ * Returns a copy of the configuration entry of the element @type was
+ * registered for, or NULL; free it with gst_structure_free().
+ */
+GstStructure *
+gstomx_get_element_config (GType type)
+{
+  const gchar *element_name;
+
+  element_name = g_type_get_qdata (type, element_name_quark);
+  if (!element_name)
+    return NULL;
+
+  return get_element_entry (element_name);
+}
+
 gboolean
 gstomx_get_component_info (void *core, GType type)
 {
@@ -315,6 +336,33 @@ gstomx_get_component_info (void *core, GType type)
   str = gst_structure_get_string (element, "component-role");
   rcore->component_role = g_strdup (str);
 
+  {
+    gint value;
+
+    if (gst_structure_get_int (element, "buffer-pool-size", &value))
+      rcore->pool_size = value;
+
+    rcore->pool_idle = DEFAULT_POOL_IDLE;
+    if (gst_structure_get_int (element, "buffer-pool-idle", &value))
+      rcore->pool_idle = value;
+
+    if (gst_structure_get_int (element, "handle-pool", &value))
+      rcore->handle_pool = value;
+
+    gst_structure_get_boolean (element, "parallel-allocation",
+        &rcore->parallel_allocation);
+  }
+
+  {
+    gboolean value;
+
+    if (gst_structure_get_boolean (element, "huge-pages", &value) && value)
+      rcore->mem_flags |= MEM_HUGE_PAGES;
+
+    if (gst_structure_get_boolean (element, "lock-buffers", &value) && value)
+      rcore->mem_flags |= MEM_LOCKED;
+  }
+
   return TRUE;
 }
 
@@ -345,6 +393,12 @@ gstomx_install_property_helper (GObjectClass * gobject_class)
       g_param_spec_string ("library-name", "Library name",
           "Name of the OpenMAX IL implementation library to use",
           NULL, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, ARG_TIMEOUT,
+      g_param_spec_uint ("timeout", "Timeout",
+          "Maximum time in milliseconds to block on the OpenMAX IL component "
+          "(0 = forever)",
+          0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 gboolean
@@ -361,6 +415,22 @@ gstomx_get_property_helper (void *core, guint prop_id, GValue * value)
     case ARG_LIBRARY_NAME:
       g_value_set_string (value, gomx->library_name);
       return TRUE;
+    case ARG_TIMEOUT:
+      g_value_set_uint (value, gomx->timeout);
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+gboolean
+gstomx_set_property_helper (void *core, guint prop_id, const GValue * value)
+{
+  GOmxCore *gomx = core;
+  switch (prop_id) {
+    case ARG_TIMEOUT:
+      gomx->timeout = g_value_get_uint (value);
+      return TRUE;
     default:
       return FALSE;
   }
@@ -34,14 +34,18 @@ enum
   ARG_COMPONENT_NAME,
   ARG_COMPONENT_ROLE,
   ARG_LIBRARY_NAME,
+  ARG_TIMEOUT,
   GSTOMX_NUM_COMMON_PROP
 };
 
 gboolean gstomx_get_component_info (void *core, GType type);
+GstStructure *gstomx_get_element_config (GType type);
 
 void *gstomx_core_new (void *object, GType type);
 void gstomx_install_property_helper (GObjectClass * gobject_class);
 gboolean gstomx_get_property_helper (void *core, guint prop_id, GValue * value);
+gboolean gstomx_set_property_helper (void *core, guint prop_id,
+    const GValue * value);
 
 G_END_DECLS
 #endif /* GSTOMX_H */
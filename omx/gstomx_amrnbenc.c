@@ -201,6 +201,9 @@ sink_setcaps (GstPad * pad, GstCaps * caps)
   gst_structure_get_int (structure, "rate", &rate);
   gst_structure_get_int (structure, "channels", &channels);
 
+  /* 20 ms frames of 16-bit samples */
+  omx_base->input_frame_size = rate / 50 * channels * 2;
+
   /* Input port configuration. */
   {
     OMX_AUDIO_PARAM_PCMMODETYPE param;
@@ -20,22 +20,74 @@
  */
 
 #include "gstomx_base_filter.h"
+#include "gstomx_base_sink.h"
 #include "gstomx.h"
 #include "gstomx_interface.h"
+#include "gstomx_buffer.h"
 
 #include <string.h>             /* for memcpy */
 
+#define DEFAULT_COALESCE_LATENCY 40
+#define AUTO_PROBE_BUFFERS 30
+#define ADAPT_WINDOW 64
+#define ADAPT_STALL 2000
+#define ADAPT_MAX_BUFFERS 24
+
+/* The latency is posted again when it moved by more than 1/LATENCY_SLACK,
+ * and by a millisecond at least, so jitter doesn't keep the pipeline busy. */
+#define LATENCY_SLACK 8
+#define META_TABLE_SIZE 64
+
 enum
 {
   ARG_USE_TIMESTAMPS = GSTOMX_NUM_COMMON_PROP,
   ARG_NUM_INPUT_BUFFERS,
   ARG_NUM_OUTPUT_BUFFERS,
+  ARG_ZERO_COPY_INPUT,
+  ARG_ZERO_COPY_OUTPUT,
+  ARG_COALESCE_SIZE,
+  ARG_COALESCE_LATENCY,
+  ARG_EAGER_START,
+  ARG_TUNNEL,
+  ARG_BUFFER_STRATEGY,
+  ARG_ADAPTIVE_BUFFERS,
 };
 
+#define GST_TYPE_OMX_BUFFER_STRATEGY (gst_omx_buffer_strategy_get_type ())
+static GType
+gst_omx_buffer_strategy_get_type (void)
+{
+  static GType gst_omx_buffer_strategy_type = 0;
+
+  if (!gst_omx_buffer_strategy_type) {
+    static GEnumValue gst_omx_buffer_strategy[] = {
+      {GSTOMX_BUFFER_STRATEGY_DEFAULT, "As the zero-copy properties say",
+          "default"},
+      {GSTOMX_BUFFER_STRATEGY_COPY, "Copy in and out of the port's own memory",
+          "copy"},
+      {GSTOMX_BUFFER_STRATEGY_SHARE, "Share the memory with the neighbours",
+          "share"},
+      {GSTOMX_BUFFER_STRATEGY_ALLOCATE, "Let the component allocate, and copy",
+          "allocate"},
+      {GSTOMX_BUFFER_STRATEGY_AUTO,
+          "Share the output memory, unless copying turns out cheaper", "auto"},
+      {0, NULL, NULL},
+    };
+
+    gst_omx_buffer_strategy_type =
+        g_enum_register_static ("GstOmxBufferStrategy",
+        gst_omx_buffer_strategy);
+  }
+
+  return gst_omx_buffer_strategy_type;
+}
+
 static void init_interfaces (GType type);
 GSTOMX_BOILERPLATE_FULL (GstOmxBaseFilter, gst_omx_base_filter, GstElement,
     GST_TYPE_ELEMENT, init_interfaces);
 
+static void eager_start (GstOmxBaseFilter * self);
+
 static inline void
 log_buffer (GstOmxBaseFilter * self, OMX_BUFFERHEADERTYPE * omx_buffer)
 {
@@ -49,40 +101,576 @@ log_buffer (GstOmxBaseFilter * self, OMX_BUFFERHEADERTYPE * omx_buffer)
       omx_buffer->nOffset, omx_buffer->nTimeStamp);
 }
 
+/* How many bytes a coalesced input buffer should hold before it's sent. */
+static inline guint
+coalesce_limit (GstOmxBaseFilter * self, OMX_BUFFERHEADERTYPE * omx_buffer)
+{
+  guint limit;
+
+  limit = MIN (self->coalesce_size,
+      omx_buffer->nAllocLen - omx_buffer->nOffset);
+
+  if (self->input_frame_size && limit >= self->input_frame_size)
+    limit -= limit % self->input_frame_size;
+
+  return limit;
+}
+
+/* Takes the partially filled input buffer back from the flusher. */
+static inline OMX_BUFFERHEADERTYPE *
+take_pending (GstOmxBaseFilter * self)
+{
+  OMX_BUFFERHEADERTYPE *omx_buffer;
+
+  g_mutex_lock (self->pending_lock);
+  omx_buffer = self->pending_buffer;
+  self->pending_buffer = NULL;
+  g_mutex_unlock (self->pending_lock);
+
+  return omx_buffer;
+}
+
+/* Gives the partially filled input buffer back, unsent. */
+static inline void
+drop_pending (GstOmxBaseFilter * self)
+{
+  OMX_BUFFERHEADERTYPE *omx_buffer;
+
+  omx_buffer = take_pending (self);
+  if (!omx_buffer)
+    return;
+
+  omx_buffer->nFilledLen = 0;
+  g_omx_port_push_buffer (self->in_port, omx_buffer);
+}
+
+static void
+meta_reset (GstOmxBaseFilter * self)
+{
+  g_mutex_lock (self->meta_lock);
+  self->meta_head = 0;
+  self->meta_count = 0;
+  self->last_dts = GST_CLOCK_TIME_NONE;
+  self->latency_depth = 0;
+  self->latency_delay = 0;
+  self->latency_min = 0;
+  self->latency_max = GST_CLOCK_TIME_NONE;
+  g_mutex_unlock (self->meta_lock);
+}
+
+/* Caches the buffer counts of the ports for the latency query, which
+ * must not look at ports being resized or freed. */
+static void
+meta_set_buffers (GstOmxBaseFilter * self)
+{
+  g_mutex_lock (self->meta_lock);
+  self->latency_buffers = self->in_port->num_buffers +
+      self->out_port->num_buffers;
+  g_mutex_unlock (self->meta_lock);
+}
+
+/* Remembers what @buf carried for the header going in with @ticks. A
+ * header holding only part of @buf gets its share of the duration. */
+static void
+meta_push (GstOmxBaseFilter * self, GstBuffer * buf, OMX_TICKS ticks,
+    GstClockTime timestamp, guint len)
+{
+  GstOmxBufferMeta *meta;
+
+  g_mutex_lock (self->meta_lock);
+
+  if (self->meta_count == META_TABLE_SIZE) {
+    /* the component must have dropped some */
+    GST_DEBUG_OBJECT (self, "timestamp table full, forgetting %"
+        GST_TIME_FORMAT, GST_TIME_ARGS (self->meta[self->meta_head].timestamp));
+    self->meta_head = (self->meta_head + 1) % META_TABLE_SIZE;
+    self->meta_count--;
+  }
+
+  meta = &self->meta[(self->meta_head + self->meta_count) % META_TABLE_SIZE];
+  meta->ticks = ticks;
+  meta->timestamp = timestamp;
+  meta->duration = GST_BUFFER_DURATION (buf);
+  if (len < GST_BUFFER_SIZE (buf) && GST_CLOCK_TIME_IS_VALID (meta->duration))
+    meta->duration = gst_util_uint64_scale_int (len, meta->duration,
+        GST_BUFFER_SIZE (buf));
+  meta->offset = GST_BUFFER_OFFSET (buf);
+  meta->offset_end = GST_BUFFER_OFFSET_END (buf);
+  meta->used = FALSE;
+  meta->decoded = FALSE;
+  meta->sent = g_get_monotonic_time ();
+  self->meta_count++;
+
+  g_mutex_unlock (self->meta_lock);
+}
+
+/* Coalesced input lasts as long as everything that went in. */
+static void
+meta_set_duration (GstOmxBaseFilter * self, GstClockTime duration)
+{
+  g_mutex_lock (self->meta_lock);
+  if (self->meta_count) {
+    self->meta[(self->meta_head + self->meta_count - 1) %
+        META_TABLE_SIZE].duration = duration;
+  }
+  g_mutex_unlock (self->meta_lock);
+}
+
+/* Sends the coalesced input as it is; pending_lock is held. */
+static void
+send_pending_locked (GstOmxBaseFilter * self)
+{
+  OMX_BUFFERHEADERTYPE *omx_buffer;
+
+  omx_buffer = self->pending_buffer;
+  self->pending_buffer = NULL;
+
+  if (self->use_timestamps)
+    meta_set_duration (self, self->pending_duration);
+
+  GST_LOG_OBJECT (self, "release_buffer");
+  g_omx_port_release_buffer (self->in_port, omx_buffer);
+}
+
+/*
+ * Sends coalesced input once it has been held for coalesce-latency, so a
+ * stalled source (or DTX) doesn't keep it back until the next buffer.
+ */
+static gpointer
+pending_flusher (gpointer data)
+{
+  GstOmxBaseFilter *self = data;
+
+  g_mutex_lock (self->pending_lock);
+
+  while (!self->pending_quit) {
+    if (!self->pending_buffer) {
+      g_cond_wait (self->pending_cond, self->pending_lock);
+      continue;
+    }
+
+    if (g_sem_cond_wait_until (self->pending_cond, self->pending_lock,
+            self->pending_deadline))
+      continue;
+
+    if (self->pending_buffer && self->in_port->enabled &&
+        self->last_pad_push_return == GST_FLOW_OK &&
+        self->gomx->omx_state == OMX_StateExecuting) {
+      GST_LOG_OBJECT (self, "coalesce latency reached, sending %lu bytes",
+          self->pending_buffer->nFilledLen);
+      send_pending_locked (self);
+    }
+  }
+
+  g_mutex_unlock (self->pending_lock);
+
+  return NULL;
+}
+
+/* Holds @omx_buffer back for more input, until coalesce-latency passed. */
+static void
+hold_pending (GstOmxBaseFilter * self, OMX_BUFFERHEADERTYPE * omx_buffer)
+{
+  g_mutex_lock (self->pending_lock);
+
+  self->pending_buffer = omx_buffer;
+
+  if (self->coalesce_latency) {
+    if (!self->pending_flusher)
+      self->pending_flusher = g_thread_create (pending_flusher, self, TRUE,
+          NULL);
+    g_cond_signal (self->pending_cond);
+  }
+
+  g_mutex_unlock (self->pending_lock);
+}
+
+static void
+pending_stop (GstOmxBaseFilter * self)
+{
+  GThread *flusher;
+
+  g_mutex_lock (self->pending_lock);
+  flusher = self->pending_flusher;
+  self->pending_flusher = NULL;
+  self->pending_quit = TRUE;
+  g_cond_signal (self->pending_cond);
+  g_mutex_unlock (self->pending_lock);
+
+  if (flusher)
+    g_thread_join (flusher);
+
+  self->pending_quit = FALSE;
+}
+
+/* Stamps an input header and keeps what @buf carried for its output. */
+static void
+set_input_meta (GstOmxBaseFilter * self, OMX_BUFFERHEADERTYPE * omx_buffer,
+    GstBuffer * buf, GstClockTime timestamp, guint len)
+{
+  if (!self->use_timestamps)
+    return;
+
+  omx_buffer->nTimeStamp = gst_util_uint64_scale_int (timestamp,
+      OMX_TICKS_PER_SECOND, GST_SECOND);
+
+  if (GST_BUFFER_TIMESTAMP_IS_VALID (buf))
+    meta_push (self, buf, omx_buffer->nTimeStamp, timestamp, len);
+}
+
+/* What the component adds to the latency upstream reports; meta_lock is
+ * held. */
+static void
+compute_latency (GstOmxBaseFilter * self, GstClockTime * min,
+    GstClockTime * max)
+{
+  *min = self->latency_delay;
+  *max = GST_CLOCK_TIME_NONE;
+  if (GST_CLOCK_TIME_IS_VALID (self->latency_duration)) {
+    *min = MAX (*min, self->latency_depth * self->latency_duration);
+    /* at worst every buffer of both ports holds a frame */
+    *max = MAX (*min, self->latency_buffers * self->latency_duration);
+  }
+}
+
+static inline gboolean
+latency_moved (GstClockTime reported, GstClockTime now)
+{
+  GstClockTime diff;
+
+  if (!GST_CLOCK_TIME_IS_VALID (reported) || !GST_CLOCK_TIME_IS_VALID (now))
+    return reported != now;
+
+  diff = reported > now ? reported - now : now - reported;
+
+  return diff > MAX (reported / LATENCY_SLACK, GST_MSECOND);
+}
+
+/*
+ * Keeps track of how deep the component is, from the input buffers in
+ * flight when @meta came out; meta_lock is held. Returns whether the
+ * latency moved away from the one last reported and should be queried
+ * again.
+ */
+static gboolean
+measure_latency (GstOmxBaseFilter * self, GstOmxBufferMeta * meta)
+{
+  GstClockTime delay;
+  GstClockTime min, max;
+  guint depth = 0;
+  guint i;
+
+  for (i = 0; i < self->meta_count; i++) {
+    if (!self->meta[(self->meta_head + i) % META_TABLE_SIZE].used)
+      depth++;
+  }
+
+  delay = (g_get_monotonic_time () - meta->sent) * GST_USECOND;
+  if (self->latency_delay)
+    self->latency_delay = (self->latency_delay * 7 + delay) / 8;
+  else
+    self->latency_delay = delay;
+
+  if (GST_CLOCK_TIME_IS_VALID (meta->duration))
+    self->latency_duration = meta->duration;
+
+  if (depth > self->latency_depth) {
+    GST_INFO_OBJECT (self, "%u buffers in flight, %" GST_TIME_FORMAT
+        " on average", depth, GST_TIME_ARGS (self->latency_delay));
+    self->latency_depth = depth;
+  }
+
+  compute_latency (self, &min, &max);
+
+  if (!latency_moved (self->latency_min, min) &&
+      !latency_moved (self->latency_max, max))
+    return FALSE;
+
+  GST_DEBUG_OBJECT (self, "latency now min %" GST_TIME_FORMAT ", max %"
+      GST_TIME_FORMAT, GST_TIME_ARGS (min), GST_TIME_ARGS (max));
+  self->latency_min = min;
+  self->latency_max = max;
+
+  return TRUE;
+}
+
+/*
+ * Gives @buf back the metadata of the input it came from. The component
+ * may reorder frames, so the entry is found by the timestamp it kept;
+ * the decode time is the one of the oldest input not yet accounted for,
+ * which never goes backwards. GStreamer buffers have no field for it, so
+ * it only stands in for timestamps the component didn't keep.
+ */
+static void
+set_output_meta (GstOmxBaseFilter * self, OMX_BUFFERHEADERTYPE * omx_buffer,
+    GstBuffer * buf)
+{
+  gboolean changed = FALSE;
+
+  if (self->keyframe_flags) {
+    if (omx_buffer->nFlags & OMX_BUFFERFLAG_SYNCFRAME)
+      GST_BUFFER_FLAG_UNSET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
+    else
+      GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
+  }
+
+  if (!self->use_timestamps)
+    return;
+
+  GST_BUFFER_TIMESTAMP (buf) =
+      gst_util_uint64_scale_int (omx_buffer->nTimeStamp, GST_SECOND,
+      OMX_TICKS_PER_SECOND);
+
+  g_mutex_lock (self->meta_lock);
+  {
+    GstOmxBufferMeta *meta = NULL;
+    GstOmxBufferMeta *decoded = NULL;
+    GstClockTime dts = GST_CLOCK_TIME_NONE;
+    guint i;
+
+    for (i = 0; i < self->meta_count; i++) {
+      GstOmxBufferMeta *cur;
+
+      cur = &self->meta[(self->meta_head + i) % META_TABLE_SIZE];
+      if (!decoded && !cur->decoded)
+        decoded = cur;
+      if (!meta && !cur->used && cur->ticks == omx_buffer->nTimeStamp)
+        meta = cur;
+      if (meta && decoded)
+        break;
+    }
+
+    if (decoded) {
+      decoded->decoded = TRUE;
+      dts = decoded->timestamp;
+      if (meta && meta->timestamp < dts)
+        dts = meta->timestamp;
+      if (GST_CLOCK_TIME_IS_VALID (self->last_dts) && dts < self->last_dts)
+        dts = self->last_dts;
+      self->last_dts = dts;
+    }
+
+    if (meta) {
+      changed = measure_latency (self, meta);
+      meta->used = TRUE;
+      GST_BUFFER_TIMESTAMP (buf) = meta->timestamp;
+      GST_BUFFER_DURATION (buf) = meta->duration;
+      if (self->keyframe_flags) {
+        /* frame counts; bitstream offsets of the input mean nothing here */
+        GST_BUFFER_OFFSET (buf) = GST_BUFFER_OFFSET_NONE;
+        GST_BUFFER_OFFSET_END (buf) = GST_BUFFER_OFFSET_NONE;
+      } else {
+        GST_BUFFER_OFFSET (buf) = meta->offset;
+        GST_BUFFER_OFFSET_END (buf) = meta->offset_end;
+      }
+    } else if (self->keyframe_flags && GST_CLOCK_TIME_IS_VALID (dts)) {
+      GST_LOG_OBJECT (self, "unknown timestamp, using decode time %"
+          GST_TIME_FORMAT, GST_TIME_ARGS (dts));
+      GST_BUFFER_TIMESTAMP (buf) = dts;
+    }
+
+    while (self->meta_count && self->meta[self->meta_head].used &&
+        self->meta[self->meta_head].decoded) {
+      self->meta_head = (self->meta_head + 1) % META_TABLE_SIZE;
+      self->meta_count--;
+    }
+  }
+  g_mutex_unlock (self->meta_lock);
+
+  if (G_UNLIKELY (changed)) {
+    gst_element_post_message (GST_ELEMENT (self),
+        gst_message_new_latency (GST_OBJECT (self)));
+  }
+}
+
 static void
 setup_ports (GstOmxBaseFilter * self)
 {
+  /* whatever the last run chose is chosen again */
+  self->in_port->omx_allocate = FALSE;
+  self->out_port->omx_allocate = FALSE;
+  self->share_input = self->zero_copy_input;
+  self->share_output = self->share_output_buffer;
+  self->probe_left = 0;
+
   /* Input port configuration. */
   g_omx_port_setup (self->in_port);
   gst_pad_set_element_private (self->sinkpad, self->in_port);
 
   /* Output port configuration. */
+  /* what the stream needs isn't held to ADAPT_MAX_BUFFERS, which is only
+   * for growing */
+  if (self->adaptive_buffers && self->wanted_output_buffers) {
+    g_omx_port_set_buffer_count (self->out_port,
+        self->wanted_output_buffers);
+  }
+
   g_omx_port_setup (self->out_port);
   gst_pad_set_element_private (self->srcpad, self->out_port);
 
-  /* @todo: read from config file: */
-  if (g_getenv ("OMX_ALLOCATE_ON")) {
-    GST_DEBUG_OBJECT (self, "OMX_ALLOCATE_ON");
-    self->in_port->omx_allocate = TRUE;
-    self->out_port->omx_allocate = TRUE;
-    self->share_input_buffer = FALSE;
-    self->share_output_buffer = FALSE;
-  } else if (g_getenv ("OMX_SHARE_HACK_ON")) {
-    GST_DEBUG_OBJECT (self, "OMX_SHARE_HACK_ON");
-    self->share_input_buffer = TRUE;
-    self->share_output_buffer = TRUE;
-  } else if (g_getenv ("OMX_SHARE_HACK_OFF")) {
-    GST_DEBUG_OBJECT (self, "OMX_SHARE_HACK_OFF");
-    self->share_input_buffer = FALSE;
-    self->share_output_buffer = FALSE;
-  } else {
-    GST_DEBUG_OBJECT (self, "default sharing and allocation");
+  switch (self->buffer_strategy) {
+    case GSTOMX_BUFFER_STRATEGY_ALLOCATE:
+      self->in_port->omx_allocate = TRUE;
+      self->out_port->omx_allocate = TRUE;
+      self->share_input = FALSE;
+      self->share_output = FALSE;
+      break;
+    case GSTOMX_BUFFER_STRATEGY_SHARE:
+      self->share_input = TRUE;
+      self->share_output = TRUE;
+      break;
+    case GSTOMX_BUFFER_STRATEGY_COPY:
+      self->share_input = FALSE;
+      self->share_output = FALSE;
+      break;
+    case GSTOMX_BUFFER_STRATEGY_AUTO:
+      /* see probe_output() */
+      self->share_output = TRUE;
+      self->probe_left = AUTO_PROBE_BUFFERS;
+      self->probe_copies = self->probe_shares = 0;
+      self->probe_copy_time = self->probe_share_time = 0;
+      break;
+    default:
+      break;
   }
 
+  if (self->adaptive_buffers &&
+      (self->zero_copy_output || self->share_output))
+    GST_INFO_OBJECT (self, "output buffers go downstream; not adding any");
+
+  GST_DEBUG_OBJECT (self, "buffer strategy: %d", self->buffer_strategy);
   GST_DEBUG_OBJECT (self, "omx_allocate: in: %d, out: %d",
       self->in_port->omx_allocate, self->out_port->omx_allocate);
   GST_DEBUG_OBJECT (self, "share_buffer: in: %d, out: %d",
-      self->share_input_buffer, self->share_output_buffer);
+      self->share_input, self->share_output);
+
+  meta_set_buffers (self);
+}
+
+/* Only sinks for now; a filter downstream would have to drive its own
+ * peers along. */
+static void
+setup_tunnel (GstOmxBaseFilter * self)
+{
+  GstPad *peer;
+  GstElement *element;
+
+  if (!self->tunnel)
+    return;
+
+  peer = gst_pad_get_peer (self->srcpad);
+  if (!peer)
+    return;
+
+  element = gst_pad_get_parent_element (peer);
+  gst_object_unref (peer);
+
+  if (!element)
+    return;
+
+  if (G_TYPE_CHECK_INSTANCE_TYPE (element, GST_OMX_BASE_SINK_TYPE)) {
+    GstOmxBaseSink *sink;
+
+    sink = GST_OMX_BASE_SINK (element);
+
+    if (g_omx_port_setup_tunnel (self->out_port, sink->in_port)) {
+      self->tunnel_peer = element;
+      self->tunnel_preroll = TRUE;
+      return;
+    }
+  }
+
+  GST_INFO_OBJECT (self, "not tunneled to %s", GST_ELEMENT_NAME (element));
+  gst_object_unref (element);
+}
+
+/* A gst-openmax filter downstream can use the memory of our output buffers
+ * for its input, so have the component allocate it and hand the headers
+ * out instead of copying. Only when zero-copy output was asked for. */
+static void
+setup_output_sharing (GstOmxBaseFilter * self)
+{
+  GstPad *peer;
+  GstElement *element;
+
+  if (self->tunnel_peer)
+    return;
+
+  if (self->buffer_strategy != GSTOMX_BUFFER_STRATEGY_DEFAULT ||
+      !self->zero_copy_output || self->share_output)
+    return;
+
+  peer = gst_pad_get_peer (self->srcpad);
+  if (!peer)
+    return;
+
+  element = gst_pad_get_parent_element (peer);
+  gst_object_unref (peer);
+
+  if (!element)
+    return;
+
+  if (G_TYPE_CHECK_INSTANCE_TYPE (element, GST_OMX_BASE_FILTER_TYPE)) {
+    GST_INFO_OBJECT (self, "sharing output buffers with %s",
+        GST_ELEMENT_NAME (element));
+    self->out_port->omx_allocate = TRUE;
+  }
+
+  gst_object_unref (element);
+}
+
+/* The other end of setup_output_sharing(); upstream has allocated its
+ * buffers by the time we get caps or data from it. */
+static void
+setup_input_sharing (GstOmxBaseFilter * self)
+{
+  GstPad *peer;
+  GstElement *element;
+
+  peer = gst_pad_get_peer (self->sinkpad);
+  if (!peer)
+    return;
+
+  element = gst_pad_get_parent_element (peer);
+
+  if (element &&
+      G_TYPE_CHECK_INSTANCE_TYPE (element, GST_OMX_BASE_FILTER_TYPE)) {
+    GOmxPort *peer_port;
+
+    peer_port = gst_pad_get_element_private (peer);
+    if (peer_port)
+      g_omx_port_share_peer (self->in_port, peer_port);
+  }
+
+  if (element)
+    gst_object_unref (element);
+  gst_object_unref (peer);
+}
+
+static inline GOmxCore *
+tunnel_core (GstOmxBaseFilter * self)
+{
+  GstOmxBaseSink *sink;
+
+  sink = GST_OMX_BASE_SINK (self->tunnel_peer);
+
+  return sink->gomx;
+}
+
+/* The peer has to change state along with us, so it does in the
+ * background while we do. */
+static inline void
+tunnel_set_state (GstOmxBaseFilter * self, OMX_STATETYPE state)
+{
+  if (self->tunnel_peer)
+    g_omx_core_set_state_async (tunnel_core (self), state, NULL, NULL);
+}
+
+static inline void
+tunnel_wait (GstOmxBaseFilter * self)
+{
+  if (self->tunnel_peer)
+    g_omx_core_wait_async (tunnel_core (self));
 }
 
 static GstStateChangeReturn
@@ -103,12 +691,25 @@ change_state (GstElement * element, GstStateChange transition)
 
   switch (transition) {
     case GST_STATE_CHANGE_NULL_TO_READY:
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      /* a previous teardown might still be running */
+      g_omx_core_wait_async (core);
       if (core->omx_state != OMX_StateLoaded) {
         ret = GST_STATE_CHANGE_FAILURE;
         goto leave;
       }
       break;
 
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      /* an eager start must not start the task behind our back */
+      g_omx_core_wait_async (core);
+      tunnel_wait (self);
+      g_mutex_lock (self->ready_lock);
+      self->starting = FALSE;
+      g_mutex_unlock (self->ready_lock);
+      pending_stop (self);
+      break;
+
     default:
       break;
   }
@@ -119,23 +720,33 @@ change_state (GstElement * element, GstStateChange transition)
     goto leave;
 
   switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      if (self->eager_start)
+        eager_start (self);
+      break;
+
     case GST_STATE_CHANGE_PAUSED_TO_READY:
       g_mutex_lock (self->ready_lock);
-      if (self->ready) {
+      /* an eager start may have gone without any buffer */
+      if (self->ready || core->omx_state != OMX_StateLoaded) {
+        drop_pending (self);
+        meta_reset (self);
+        g_atomic_int_set (&self->headers_pending, FALSE);
+
         /* unlock */
         g_omx_port_finish (self->in_port);
         g_omx_port_finish (self->out_port);
 
-        g_omx_core_stop (core);
-        g_omx_core_unload (core);
+        /* the component goes back to Loaded in the background */
+        g_omx_core_set_state_async (core, OMX_StateLoaded, NULL, NULL);
         self->ready = FALSE;
       }
-      g_mutex_unlock (self->ready_lock);
-      if (core->omx_state != OMX_StateLoaded &&
-          core->omx_state != OMX_StateInvalid) {
-        ret = GST_STATE_CHANGE_FAILURE;
-        goto leave;
+      if (self->tunnel_peer) {
+        tunnel_set_state (self, OMX_StateLoaded);
+        gst_object_unref (self->tunnel_peer);
+        self->tunnel_peer = NULL;
       }
+      g_mutex_unlock (self->ready_lock);
       break;
 
     default:
@@ -160,9 +771,19 @@ finalize (GObject * obj)
     self->codec_data = NULL;
   }
 
-  g_omx_core_free (self->gomx);
+  gst_buffer_replace (&self->out_headers, NULL);
+
+  pending_stop (self);
 
+  /* the ports go along with the core, in the background */
+  self->in_port = self->out_port = NULL;
+  g_omx_core_free_async (self->gomx);
+
+  g_mutex_free (self->pending_lock);
+  g_cond_free (self->pending_cond);
   g_mutex_free (self->ready_lock);
+  g_mutex_free (self->meta_lock);
+  g_free (self->meta);
 
   G_OBJECT_CLASS (parent_class)->finalize (obj);
 }
@@ -175,10 +796,37 @@ set_property (GObject * obj,
 
   self = GST_OMX_BASE_FILTER (obj);
 
+  if (gstomx_set_property_helper (self->gomx, prop_id, value))
+    return;
+
   switch (prop_id) {
     case ARG_USE_TIMESTAMPS:
       self->use_timestamps = g_value_get_boolean (value);
       break;
+    case ARG_ZERO_COPY_INPUT:
+      self->zero_copy_input = g_value_get_boolean (value);
+      break;
+    case ARG_ZERO_COPY_OUTPUT:
+      self->zero_copy_output = g_value_get_boolean (value);
+      break;
+    case ARG_COALESCE_SIZE:
+      self->coalesce_size = g_value_get_uint (value);
+      break;
+    case ARG_COALESCE_LATENCY:
+      self->coalesce_latency = g_value_get_uint (value) * GST_MSECOND;
+      break;
+    case ARG_EAGER_START:
+      self->eager_start = g_value_get_boolean (value);
+      break;
+    case ARG_TUNNEL:
+      self->tunnel = g_value_get_boolean (value);
+      break;
+    case ARG_BUFFER_STRATEGY:
+      self->buffer_strategy = g_value_get_enum (value);
+      break;
+    case ARG_ADAPTIVE_BUFFERS:
+      self->adaptive_buffers = g_value_get_boolean (value);
+      break;
     case ARG_NUM_INPUT_BUFFERS:
     case ARG_NUM_OUTPUT_BUFFERS:
     {
@@ -231,6 +879,30 @@ get_property (GObject * obj, guint prop_id, GValue * value, GParamSpec * pspec)
     case ARG_USE_TIMESTAMPS:
       g_value_set_boolean (value, self->use_timestamps);
       break;
+    case ARG_ZERO_COPY_INPUT:
+      g_value_set_boolean (value, self->zero_copy_input);
+      break;
+    case ARG_ZERO_COPY_OUTPUT:
+      g_value_set_boolean (value, self->zero_copy_output);
+      break;
+    case ARG_COALESCE_SIZE:
+      g_value_set_uint (value, self->coalesce_size);
+      break;
+    case ARG_COALESCE_LATENCY:
+      g_value_set_uint (value, self->coalesce_latency / GST_MSECOND);
+      break;
+    case ARG_EAGER_START:
+      g_value_set_boolean (value, self->eager_start);
+      break;
+    case ARG_TUNNEL:
+      g_value_set_boolean (value, self->tunnel);
+      break;
+    case ARG_BUFFER_STRATEGY:
+      g_value_set_enum (value, self->buffer_strategy);
+      break;
+    case ARG_ADAPTIVE_BUFFERS:
+      g_value_set_boolean (value, self->adaptive_buffers);
+      break;
     case ARG_NUM_INPUT_BUFFERS:
     case ARG_NUM_OUTPUT_BUFFERS:
     {
@@ -264,50 +936,428 @@ type_base_init (gpointer g_class)
 {
 }
 
-static void
-type_class_init (gpointer g_class, gpointer class_data)
+static void
+type_class_init (gpointer g_class, gpointer class_data)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+
+  gobject_class = G_OBJECT_CLASS (g_class);
+  gstelement_class = GST_ELEMENT_CLASS (g_class);
+
+  gobject_class->finalize = finalize;
+  gstelement_class->change_state = change_state;
+
+  /* Properties stuff */
+  {
+    gobject_class->set_property = set_property;
+    gobject_class->get_property = get_property;
+
+    gstomx_install_property_helper (gobject_class);
+
+    g_object_class_install_property (gobject_class, ARG_USE_TIMESTAMPS,
+        g_param_spec_boolean ("use-timestamps", "Use timestamps",
+            "Whether or not to use timestamps",
+            TRUE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_NUM_INPUT_BUFFERS,
+        g_param_spec_uint ("input-buffers", "Input buffers",
+            "The number of OMX input buffers",
+            1, 10, 4, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, ARG_NUM_OUTPUT_BUFFERS,
+        g_param_spec_uint ("output-buffers", "Output buffers",
+            "The number of OMX output buffers",
+            1, 10, 4, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_ZERO_COPY_INPUT,
+        g_param_spec_boolean ("zero-copy-input", "Zero-copy input",
+            "Hand the data of incoming buffers to the component instead of "
+            "copying; they are kept alive until it's done with them",
+            FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_ZERO_COPY_OUTPUT,
+        g_param_spec_boolean ("zero-copy-output", "Zero-copy output",
+            "Push buffers pointing into the OMX output buffers instead of "
+            "copying; they are given back to the component once released",
+            FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_COALESCE_SIZE,
+        g_param_spec_uint ("coalesce-size", "Coalesce size",
+            "Pack small input buffers into one OMX buffer until it holds "
+            "this many bytes (0 = disabled)",
+            0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_COALESCE_LATENCY,
+        g_param_spec_uint ("coalesce-latency", "Coalesce latency",
+            "Maximum duration in milliseconds of coalesced input held back "
+            "(0 = unbounded)",
+            0, G_MAXUINT, DEFAULT_COALESCE_LATENCY,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_EAGER_START,
+        g_param_spec_boolean ("eager-start", "Eager start",
+            "Set up and start the component in the background when going "
+            "to PAUSED, instead of on the first buffer; the buffers are "
+            "still allocated once the input caps are known",
+            FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_TUNNEL,
+        g_param_spec_boolean ("tunnel", "Tunnel",
+            "Pass the output straight to a downstream sink of the same "
+            "OpenMAX IL implementation, if it accepts an OMX tunnel",
+            FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_BUFFER_STRATEGY,
+        g_param_spec_enum ("buffer-strategy", "Buffer strategy",
+            "How the port buffers get their memory; takes effect when the "
+            "component is set up",
+            GST_TYPE_OMX_BUFFER_STRATEGY, GSTOMX_BUFFER_STRATEGY_DEFAULT,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_ADAPTIVE_BUFFERS,
+        g_param_spec_boolean ("adaptive-buffers", "Adaptive buffers",
+            "Size the buffer counts from the stream (the output ones from "
+            "the H.264 DPB), and add buffers, up to 24, to ports that keep "
+            "running dry; the output port only while its buffers aren't shared",
+            FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  }
+}
+
+/* Whether the port ran dry in more than a quarter of the requests of the
+ * window that just ended, and can still get more buffers. */
+static gboolean
+adapt_check (GstOmxBaseFilter * self, GOmxPort * port, guint * requests,
+    guint * stalls, gint64 * wait)
+{
+  gboolean starving;
+
+  if (++*requests < ADAPT_WINDOW)
+    return FALSE;
+
+  starving = *stalls * 4 > *requests && port->num_buffers < ADAPT_MAX_BUFFERS;
+
+  GST_DEBUG_OBJECT (self, "port %u: starved on %u of %u requests, "
+      "%" G_GINT64_FORMAT " us waiting", port->port_index, *stalls, *requests,
+      *wait);
+
+  *requests = 0;
+  *stalls = 0;
+  *wait = 0;
+
+  return starving;
+}
+
+/* pad_chain blocked @elapsed us for a free input header */
+static inline void
+adapt_input (GstOmxBaseFilter * self, gint64 elapsed)
+{
+  self->adapt_in_wait += elapsed;
+  if (elapsed > ADAPT_STALL)
+    self->adapt_in_stalls++;
+
+  if (adapt_check (self, self->in_port, &self->adapt_in_requests,
+          &self->adapt_in_stalls, &self->adapt_in_wait))
+    self->adapt_grow_input = TRUE;
+}
+
+/* The component ran out of output headers if it gave all of them back. */
+static inline gboolean
+adapt_output (GstOmxBaseFilter * self, guint count, gint64 elapsed)
+{
+  GOmxPort *out_port;
+
+  out_port = self->out_port;
+
+  self->adapt_out_wait += elapsed;
+  if (count + out_port->lent >= out_port->num_buffers)
+    self->adapt_out_stalls++;
+
+  return adapt_check (self, out_port, &self->adapt_out_requests,
+      &self->adapt_out_stalls, &self->adapt_out_wait);
+}
+
+static inline GstFlowReturn
+push_buffer (GstOmxBaseFilter * self, GstBuffer * buf)
+{
+  GstFlowReturn ret;
+
+  /* the stream can be started over at this keyframe, headers first */
+  if (G_UNLIKELY (g_atomic_int_get (&self->headers_pending)) &&
+      !GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT)) {
+    g_atomic_int_set (&self->headers_pending, FALSE);
+
+    if (self->out_headers) {
+      GstBuffer *headers;
+
+      headers = gst_buffer_create_sub (self->out_headers, 0,
+          GST_BUFFER_SIZE (self->out_headers));
+      GST_BUFFER_FLAG_SET (headers, GST_BUFFER_FLAG_IN_CAPS);
+      GST_BUFFER_TIMESTAMP (headers) = GST_BUFFER_TIMESTAMP (buf);
+      gst_buffer_set_caps (headers, GST_BUFFER_CAPS (buf));
+
+      GST_DEBUG_OBJECT (self, "headers before keyframe");
+      ret = gst_pad_push (self->srcpad, headers);
+      if (ret != GST_FLOW_OK) {
+        gst_buffer_unref (buf);
+        return ret;
+      }
+    }
+  }
+
+    /** @todo check if tainted */
+  GST_LOG_OBJECT (self, "begin");
+  ret = gst_pad_push (self->srcpad, buf);
+  GST_LOG_OBJECT (self, "end");
+
+  return ret;
+}
+
+/* In auto mode the first output buffers tell whether sharing them with
+ * downstream pays off, or just costs failed allocations. The very first
+ * ones are copied anyway, as they have the port's own memory. elapsed is
+ * what getting the data into a downstream buffer took: the allocation and
+ * memcpy for a copy, the allocation handed to the port for a share;
+ * pushing is the same either way and left out. */
+static void
+probe_output (GstOmxBaseFilter * self, gboolean copied, gint64 elapsed)
+{
+  guint failures;
+
+  if (copied) {
+    self->probe_copies++;
+    self->probe_copy_time += elapsed;
+  } else {
+    self->probe_shares++;
+    self->probe_share_time += elapsed;
+  }
+
+  if (--self->probe_left > 0)
+    return;
+
+  failures = self->probe_copies > self->out_port->num_buffers ?
+      self->probe_copies - self->out_port->num_buffers : 0;
+
+  if (self->probe_shares == 0 || failures * 4 > AUTO_PROBE_BUFFERS ||
+      (self->probe_copies && self->probe_copy_time / self->probe_copies <
+          self->probe_share_time / self->probe_shares))
+    self->share_output = FALSE;
+
+  GST_INFO_OBJECT (self, "auto: %s output buffers; "
+      "copied %u in %" G_GINT64_FORMAT " us, shared %u in %" G_GINT64_FORMAT
+      " us, %u failures", self->share_output ? "sharing" : "copying",
+      self->probe_copies, self->probe_copy_time, self->probe_shares,
+      self->probe_share_time, failures);
+}
+
+static GstFlowReturn
+handle_output_buffer (GstOmxBaseFilter * self,
+    OMX_BUFFERHEADERTYPE * omx_buffer)
+{
+  GOmxCore *gomx;
+  GOmxPort *out_port;
+  GstFlowReturn ret = GST_FLOW_OK;
+  gboolean eos;
+  gboolean lent = FALSE;
+  gboolean copied = FALSE;
+  gint64 start;
+  gint64 spent = 0;
+
+  gomx = self->gomx;
+  out_port = self->out_port;
+
+  log_buffer (self, omx_buffer);
+
+  /* a lent header may be back in the component once pushed */
+  eos = (omx_buffer->nFlags & OMX_BUFFERFLAG_EOS) != 0;
+
+  if (G_LIKELY (omx_buffer->nFilledLen > 0)) {
+    GstBuffer *buf;
+
+    /* the caps are fixed once per change of the settings */
+    if (G_LIKELY (out_port->enabled) &&
+        G_UNLIKELY (g_omx_port_settings_changed (out_port))) {
+      GST_INFO_OBJECT (self, "output settings changed");
+      if (gomx->settings_changed_cb)
+        gomx->settings_changed_cb (gomx);
+    }
+
+    /* buf is always null when the output buffer pointer isn't shared. */
+    buf = omx_buffer->pAppPrivate;
+
+          /** @todo we need to move all the caps handling to one single
+           * place, in the output loop probably. */
+    if (G_UNLIKELY (omx_buffer->nFlags & 0x80)) {
+      GstCaps *caps = NULL;
+      GstStructure *structure;
+      GValue value = { 0, {{0}
+          }
+      };
+
+      caps = gst_pad_get_negotiated_caps (self->srcpad);
+      caps = gst_caps_make_writable (caps);
+      structure = gst_caps_get_structure (caps, 0);
+
+      g_value_init (&value, GST_TYPE_BUFFER);
+      buf = gst_buffer_new_and_alloc (omx_buffer->nFilledLen);
+      memcpy (GST_BUFFER_DATA (buf),
+          omx_buffer->pBuffer + omx_buffer->nOffset, omx_buffer->nFilledLen);
+      gst_value_set_buffer (&value, buf);
+      gst_buffer_replace (&self->out_headers, buf);
+      gst_buffer_unref (buf);
+      gst_structure_set_value (structure, "codec_data", &value);
+      g_value_unset (&value);
+
+      gst_pad_set_caps (self->srcpad, caps);
+    } else if (buf && !(omx_buffer->nFlags & OMX_BUFFERFLAG_EOS)) {
+      GST_BUFFER_SIZE (buf) = omx_buffer->nFilledLen;
+      set_output_meta (self, omx_buffer, buf);
+
+      omx_buffer->pAppPrivate = NULL;
+      omx_buffer->pBuffer = NULL;
+
+      ret = push_buffer (self, buf);
+
+      gst_buffer_unref (buf);
+    } else if (self->zero_copy_output && !self->share_output) {
+      buf = gst_omx_buffer_new (out_port, omx_buffer);
+      gst_buffer_set_caps (buf, GST_PAD_CAPS (self->srcpad));
+      set_output_meta (self, omx_buffer, buf);
+
+      omx_buffer->nFlags &= ~OMX_BUFFERFLAG_EOS;
+      lent = TRUE;
+
+      ret = push_buffer (self, buf);
+    } else {
+      /* This is only meant for the first OpenMAX buffers,
+       * which need to be pre-allocated. */
+      /* Also for the very last one. */
+      start = g_get_monotonic_time ();
+      ret = gst_pad_alloc_buffer_and_set_caps (self->srcpad,
+          GST_BUFFER_OFFSET_NONE,
+          omx_buffer->nFilledLen, GST_PAD_CAPS (self->srcpad), &buf);
+
+      if (G_LIKELY (buf)) {
+        memcpy (GST_BUFFER_DATA (buf),
+            omx_buffer->pBuffer + omx_buffer->nOffset, omx_buffer->nFilledLen);
+        spent = g_get_monotonic_time () - start;
+        set_output_meta (self, omx_buffer, buf);
+
+        copied = TRUE;
+
+        if (self->share_output) {
+          GST_WARNING_OBJECT (self, "couldn't zero-copy");
+          /* If pAppPrivate is NULL, it's the port's own memory;
+           * leave it to the port and try to share a new one. */
+          if (!omx_buffer->pAppPrivate)
+            omx_buffer->pBuffer = NULL;
+        }
+
+        ret = push_buffer (self, buf);
+      } else {
+        GST_WARNING_OBJECT (self, "couldn't allocate buffer of size %lu",
+            omx_buffer->nFilledLen);
+      }
+    }
+  } else {
+    GST_WARNING_OBJECT (self, "empty buffer");
+  }
+
+  if (lent)
+    goto done;
+
+  if (self->share_output &&
+      !omx_buffer->pBuffer && omx_buffer->nOffset == 0) {
+    GstBuffer *buf;
+    GstFlowReturn result;
+
+    GST_LOG_OBJECT (self, "allocate buffer");
+    start = g_get_monotonic_time ();
+    result = gst_pad_alloc_buffer_and_set_caps (self->srcpad,
+        GST_BUFFER_OFFSET_NONE,
+        omx_buffer->nAllocLen, GST_PAD_CAPS (self->srcpad), &buf);
+    if (!copied)
+      spent = g_get_monotonic_time () - start;
+
+    if (G_LIKELY (result == GST_FLOW_OK)) {
+      gst_buffer_ref (buf);
+      omx_buffer->pAppPrivate = buf;
+
+      omx_buffer->pBuffer = GST_BUFFER_DATA (buf);
+      omx_buffer->nAllocLen = GST_BUFFER_SIZE (buf);
+    } else {
+      GST_WARNING_OBJECT (self, "could not pad allocate buffer, using own");
+      omx_buffer->pBuffer = g_omx_port_get_buffer_data (out_port, omx_buffer);
+      omx_buffer->nAllocLen = out_port->buffer_size;
+    }
+  }
+
+  if (self->share_output && !omx_buffer->pBuffer) {
+    GST_ERROR_OBJECT (self, "no input buffer to share");
+  }
+
+  /* sharing might have been given up on */
+  if (!self->share_output && !omx_buffer->pBuffer) {
+    omx_buffer->pBuffer = g_omx_port_get_buffer_data (out_port, omx_buffer);
+    omx_buffer->nAllocLen = out_port->buffer_size;
+  }
+
+  if (G_UNLIKELY (self->probe_left) && self->share_output)
+    probe_output (self, copied, spent);
+
+  omx_buffer->nFlags &= ~OMX_BUFFERFLAG_EOS;
+  omx_buffer->nFilledLen = 0;
+  GST_LOG_OBJECT (self, "release_buffer");
+  g_omx_port_release_buffer (out_port, omx_buffer);
+
+done:
+  if (G_UNLIKELY (eos)) {
+    GST_DEBUG_OBJECT (self, "got eos");
+    gst_pad_push_event (self->srcpad, gst_event_new_eos ());
+    ret = GST_FLOW_UNEXPECTED;
+  }
+
+  return ret;
+}
+
+/* The component changed the output settings beyond what the buffers fit;
+ * what came out before still goes downstream, then the port gets new
+ * buffers and the caps are renegotiated. */
+static GstFlowReturn
+reconfigure_output (GstOmxBaseFilter * self)
 {
-  GObjectClass *gobject_class;
-  GstElementClass *gstelement_class;
-
-  gobject_class = G_OBJECT_CLASS (g_class);
-  gstelement_class = GST_ELEMENT_CLASS (g_class);
+  GOmxCore *gomx;
+  GOmxPort *out_port;
+  OMX_BUFFERHEADERTYPE *omx_buffer;
+  GstFlowReturn ret = GST_FLOW_OK;
 
-  gobject_class->finalize = finalize;
-  gstelement_class->change_state = change_state;
+  gomx = self->gomx;
+  out_port = self->out_port;
 
-  /* Properties stuff */
-  {
-    gobject_class->set_property = set_property;
-    gobject_class->get_property = get_property;
+  GST_INFO_OBJECT (self, "output settings changed");
 
-    gstomx_install_property_helper (gobject_class);
+  while ((omx_buffer = async_queue_pop_forced (out_port->queue))) {
+    /* lent ones come back empty while we wait for the rest */
+    if (ret == GST_FLOW_OK && (omx_buffer->nFilledLen > 0 ||
+            (omx_buffer->nFlags & OMX_BUFFERFLAG_EOS))) {
+      ret = handle_output_buffer (self, omx_buffer);
+    } else {
+      omx_buffer->nFilledLen = 0;
+      g_omx_port_release_buffer (out_port, omx_buffer);
+    }
+  }
 
-    g_object_class_install_property (gobject_class, ARG_USE_TIMESTAMPS,
-        g_param_spec_boolean ("use-timestamps", "Use timestamps",
-            "Whether or not to use timestamps",
-            TRUE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  if (ret != GST_FLOW_OK)
+    return ret;
 
-    g_object_class_install_property (gobject_class, ARG_NUM_INPUT_BUFFERS,
-        g_param_spec_uint ("input-buffers", "Input buffers",
-            "The number of OMX input buffers",
-            1, 10, 4, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
-    g_object_class_install_property (gobject_class, ARG_NUM_OUTPUT_BUFFERS,
-        g_param_spec_uint ("output-buffers", "Output buffers",
-            "The number of OMX output buffers",
-            1, 10, 4, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  /* buffers still downstream keep the old memory; the caps follow along
+   * with the next buffer */
+  if (!g_omx_port_reconfigure (out_port)) {
+    GST_ELEMENT_ERROR (self, STREAM, FAILED, (NULL),
+        ("could not reconfigure the output port"));
+    return GST_FLOW_ERROR;
   }
-}
-
-static inline GstFlowReturn
-push_buffer (GstOmxBaseFilter * self, GstBuffer * buf)
-{
-  GstFlowReturn ret;
 
-    /** @todo check if tainted */
-  GST_LOG_OBJECT (self, "begin");
-  ret = gst_pad_push (self->srcpad, buf);
-  GST_LOG_OBJECT (self, "end");
+  meta_set_buffers (self);
 
   return ret;
 }
@@ -338,176 +1388,270 @@ output_loop (gpointer data)
 
   out_port = self->out_port;
 
+  if (G_UNLIKELY (g_atomic_int_get (&out_port->reconfigure))) {
+    ret = reconfigure_output (self);
+    goto leave;
+  }
+
   if (G_LIKELY (out_port->enabled)) {
-    OMX_BUFFERHEADERTYPE *omx_buffer = NULL;
+    OMX_BUFFERHEADERTYPE **omx_buffers;
+    guint count, i;
+    gboolean timed_out;
+    gboolean grow = FALSE;
+    gint64 start = 0;
 
-    GST_LOG_OBJECT (self, "request buffer");
-    omx_buffer = g_omx_port_request_buffer (out_port);
+    omx_buffers = g_newa (OMX_BUFFERHEADERTYPE *, out_port->num_buffers);
 
-    GST_LOG_OBJECT (self, "omx_buffer: %p", omx_buffer);
+    if (self->adaptive_buffers)
+      start = g_get_monotonic_time ();
+
+    GST_LOG_OBJECT (self, "request buffers");
+    count = g_omx_port_request_buffers_until (out_port, omx_buffers,
+        out_port->num_buffers, g_omx_core_get_deadline (gomx), &timed_out);
+
+    GST_LOG_OBJECT (self, "got %u buffers", count);
+
+    /* lent memory might be in use beyond the buffers, e.g. by a peer */
+    if (self->adaptive_buffers && count && !self->zero_copy_output)
+      grow = adapt_output (self, count, g_get_monotonic_time () - start);
+
+    if (G_UNLIKELY (timed_out)) {
+      /* nothing decoded yet; try again on the next iteration */
+      GST_DEBUG_OBJECT (self, "timed out waiting for output");
+      goto leave;
+    }
+
+    if (G_UNLIKELY (count == 0)) {
+      /* woken up for a reconfiguration */
+      if (g_atomic_int_get (&out_port->reconfigure))
+        goto leave;
 
-    if (G_UNLIKELY (!omx_buffer)) {
       GST_WARNING_OBJECT (self, "null buffer: leaving");
       ret = GST_FLOW_WRONG_STATE;
       goto leave;
     }
 
-    log_buffer (self, omx_buffer);
+    for (i = 0; i < count; i++) {
+      if (G_LIKELY (ret == GST_FLOW_OK)) {
+        ret = handle_output_buffer (self, omx_buffers[i]);
+      } else {
+        /* streaming stopped; give the rest back like a flush would */
+        omx_buffers[i]->nFilledLen = 0;
+        g_omx_port_release_buffer (out_port, omx_buffers[i]);
+      }
+    }
 
-    if (G_LIKELY (omx_buffer->nFilledLen > 0)) {
-      GstBuffer *buf;
+    /* the headers carrying downstream buffers can't be taken back, and
+     * the port refuses while any is lent */
+    if (G_UNLIKELY (grow) && ret == GST_FLOW_OK && !self->share_output &&
+        g_omx_port_resize (out_port, out_port->num_buffers + 1))
+      meta_set_buffers (self);
+  }
 
-#if 1
-            /** @todo remove this check */
-      if (G_LIKELY (self->in_port->enabled)) {
-        GstCaps *caps = NULL;
+leave:
 
-        caps = gst_pad_get_negotiated_caps (self->srcpad);
+  self->last_pad_push_return = ret;
 
-        if (!caps) {
-                    /** @todo We shouldn't be doing this. */
-          GST_WARNING_OBJECT (self, "faking settings changed notification");
-          if (gomx->settings_changed_cb)
-            gomx->settings_changed_cb (gomx);
-        } else {
-          GST_LOG_OBJECT (self, "caps already fixed: %" GST_PTR_FORMAT, caps);
-          gst_caps_unref (caps);
-        }
-      }
-#endif
+  if (gomx->omx_error != OMX_ErrorNone)
+    ret = GST_FLOW_ERROR;
 
-      /* buf is always null when the output buffer pointer isn't shared. */
-      buf = omx_buffer->pAppPrivate;
+  if (ret != GST_FLOW_OK) {
+    GST_INFO_OBJECT (self, "pause task, reason:  %s", gst_flow_get_name (ret));
+    gst_pad_pause_task (self->srcpad);
+  }
 
-            /** @todo we need to move all the caps handling to one single
-             * place, in the output loop probably. */
-      if (G_UNLIKELY (omx_buffer->nFlags & 0x80)) {
-        GstCaps *caps = NULL;
-        GstStructure *structure;
-        GValue value = { 0, {{0}
-            }
-        };
+  GST_LOG_OBJECT (self, "end");
 
-        caps = gst_pad_get_negotiated_caps (self->srcpad);
-        caps = gst_caps_make_writable (caps);
-        structure = gst_caps_get_structure (caps, 0);
+  gst_object_unref (self);
+}
 
-        g_value_init (&value, GST_TYPE_BUFFER);
-        buf = gst_buffer_new_and_alloc (omx_buffer->nFilledLen);
-        memcpy (GST_BUFFER_DATA (buf),
-            omx_buffer->pBuffer + omx_buffer->nOffset, omx_buffer->nFilledLen);
-        gst_value_set_buffer (&value, buf);
-        gst_buffer_unref (buf);
-        gst_structure_set_value (structure, "codec_data", &value);
-        g_value_unset (&value);
-
-        gst_pad_set_caps (self->srcpad, caps);
-      } else if (buf && !(omx_buffer->nFlags & OMX_BUFFERFLAG_EOS)) {
-        GST_BUFFER_SIZE (buf) = omx_buffer->nFilledLen;
-        if (self->use_timestamps) {
-          GST_BUFFER_TIMESTAMP (buf) =
-              gst_util_uint64_scale_int (omx_buffer->nTimeStamp, GST_SECOND,
-              OMX_TICKS_PER_SECOND);
-        }
+/* The data goes through the tunnel, but the sink has to preroll; it gets
+ * an empty buffer standing in for the output of @buf. */
+static GstFlowReturn
+push_tunnel_preroll (GstOmxBaseFilter * self, GstBuffer * buf)
+{
+  GOmxCore *gomx;
+  GstBuffer *preroll;
 
-        omx_buffer->pAppPrivate = NULL;
-        omx_buffer->pBuffer = NULL;
+  gomx = self->gomx;
 
-        ret = push_buffer (self, buf);
+  /* nothing comes out that would have set them */
+  if (!GST_PAD_CAPS (self->srcpad) && gomx->settings_changed_cb)
+    gomx->settings_changed_cb (gomx);
 
-        gst_buffer_unref (buf);
-      } else {
-        /* This is only meant for the first OpenMAX buffers,
-         * which need to be pre-allocated. */
-        /* Also for the very last one. */
-        ret = gst_pad_alloc_buffer_and_set_caps (self->srcpad,
-            GST_BUFFER_OFFSET_NONE,
-            omx_buffer->nFilledLen, GST_PAD_CAPS (self->srcpad), &buf);
-
-        if (G_LIKELY (buf)) {
-          memcpy (GST_BUFFER_DATA (buf),
-              omx_buffer->pBuffer + omx_buffer->nOffset,
-              omx_buffer->nFilledLen);
-          if (self->use_timestamps) {
-            GST_BUFFER_TIMESTAMP (buf) =
-                gst_util_uint64_scale_int (omx_buffer->nTimeStamp, GST_SECOND,
-                OMX_TICKS_PER_SECOND);
-          }
+  preroll = gst_buffer_new ();
+  gst_buffer_set_caps (preroll, GST_PAD_CAPS (self->srcpad));
+  GST_BUFFER_TIMESTAMP (preroll) = GST_BUFFER_TIMESTAMP (buf);
+  GST_BUFFER_DURATION (preroll) = GST_BUFFER_DURATION (buf);
+  GST_BUFFER_FLAG_SET (preroll, GST_BUFFER_FLAG_PREROLL);
 
-          if (self->share_output_buffer) {
-            GST_WARNING_OBJECT (self, "couldn't zero-copy");
-            /* If pAppPrivate is NULL, it means it was a dummy
-             * allocation, free it. */
-            if (!omx_buffer->pAppPrivate) {
-              g_free (omx_buffer->pBuffer);
-              omx_buffer->pBuffer = NULL;
-            }
-          }
+  GST_DEBUG_OBJECT (self, "prerolling the sink at %" GST_TIME_FORMAT,
+      GST_TIME_ARGS (GST_BUFFER_TIMESTAMP (preroll)));
 
-          ret = push_buffer (self, buf);
-        } else {
-          GST_WARNING_OBJECT (self, "couldn't allocate buffer of size %lu",
-              omx_buffer->nFilledLen);
-        }
-      }
-    } else {
-      GST_WARNING_OBJECT (self, "empty buffer");
-    }
+  return gst_pad_push (self->srcpad, preroll);
+}
 
-    if (self->share_output_buffer &&
-        !omx_buffer->pBuffer && omx_buffer->nOffset == 0) {
-      GstBuffer *buf;
-      GstFlowReturn result;
+static inline void
+start_output (GstOmxBaseFilter * self)
+{
+  /* nothing comes out of a tunneled port */
+  if (!self->tunnel_peer)
+    gst_pad_start_task (self->srcpad, output_loop, self->srcpad);
+}
 
-      GST_LOG_OBJECT (self, "allocate buffer");
-      result = gst_pad_alloc_buffer_and_set_caps (self->srcpad,
-          GST_BUFFER_OFFSET_NONE,
-          omx_buffer->nAllocLen, GST_PAD_CAPS (self->srcpad), &buf);
+/* send buffer with codec data flag */
+static void
+send_codec_data (GstOmxBaseFilter * self)
+{
+  OMX_BUFFERHEADERTYPE *omx_buffer;
+  GOmxPort *in_port;
+  gboolean timed_out = FALSE;
 
-      if (G_LIKELY (result == GST_FLOW_OK)) {
-        gst_buffer_ref (buf);
-        omx_buffer->pAppPrivate = buf;
+    /** @todo move to util */
+  if (!self->codec_data)
+    return;
 
-        omx_buffer->pBuffer = GST_BUFFER_DATA (buf);
-        omx_buffer->nAllocLen = GST_BUFFER_SIZE (buf);
-      } else {
-        GST_WARNING_OBJECT (self,
-            "could not pad allocate buffer, using malloc");
-        omx_buffer->pBuffer = g_malloc (omx_buffer->nAllocLen);
-      }
-    }
+  in_port = self->in_port;
 
-    if (self->share_output_buffer && !omx_buffer->pBuffer) {
-      GST_ERROR_OBJECT (self, "no input buffer to share");
-    }
+  /* this may run on the core's worker, which must not block for good */
+  GST_LOG_OBJECT (self, "request buffer");
+  omx_buffer = g_omx_port_request_buffer_until (in_port,
+      g_omx_core_get_deadline (self->gomx), &timed_out);
 
-    if (G_UNLIKELY (omx_buffer->nFlags & OMX_BUFFERFLAG_EOS)) {
-      GST_DEBUG_OBJECT (self, "got eos");
-      gst_pad_push_event (self->srcpad, gst_event_new_eos ());
-      omx_buffer->nFlags &= ~OMX_BUFFERFLAG_EOS;
-      ret = GST_FLOW_UNEXPECTED;
-    }
+  if (G_UNLIKELY (timed_out)) {
+    GST_ELEMENT_ERROR (self, STREAM, FAILED, (NULL),
+        ("timed out waiting for a buffer for the codec data"));
+    return;
+  }
+
+  if (G_LIKELY (omx_buffer)) {
+    omx_buffer->nFlags |= 0x00000080;   /* codec data flag */
+
+    omx_buffer->nFilledLen = GST_BUFFER_SIZE (self->codec_data);
+    memcpy (omx_buffer->pBuffer + omx_buffer->nOffset,
+        GST_BUFFER_DATA (self->codec_data), omx_buffer->nFilledLen);
 
-    omx_buffer->nFilledLen = 0;
     GST_LOG_OBJECT (self, "release_buffer");
-    g_omx_port_release_buffer (out_port, omx_buffer);
+    g_omx_port_release_buffer (in_port, omx_buffer);
   }
+}
 
-leave:
+/* Called from the core's worker once the eager start is over. */
+static void
+eager_start_done (GOmxCore * core, OMX_STATETYPE state, gpointer user_data)
+{
+  GstOmxBaseFilter *self = user_data;
 
-  self->last_pad_push_return = ret;
+  GST_INFO_OBJECT (self, "omx: eager start done, state: %d", state);
+}
 
-  if (gomx->omx_error != OMX_ErrorNone)
-    ret = GST_FLOW_ERROR;
+/* Gives a port left disabled by eager_start() its buffers, for the
+ * settings it has now; in Loaded it's only enabled again. */
+static gboolean
+enable_port (GOmxPort * port)
+{
+  if (port->enabled)
+    return TRUE;
 
-  if (ret != GST_FLOW_OK) {
-    GST_INFO_OBJECT (self, "pause task, reason:  %s", gst_flow_get_name (ret));
-    gst_pad_pause_task (self->srcpad);
+  g_omx_port_setup (port);
+  if (g_omx_port_enable (port))
+    return TRUE;
+
+  if (!port->core->omx_error)
+    port->core->omx_error = OMX_ErrorTimeout;
+
+  return FALSE;
+}
+
+/* Only ports with buffers of their own can wait for the caps. */
+static inline void
+defer_port (GOmxPort * port)
+{
+  if (!port->tunnel && !port->peer && !port->shared)
+    g_omx_port_disable (port);
+}
+
+/* Sets the component up and starts it in the background when going to
+ * PAUSED, with what the properties configure. The caps only come with
+ * the first buffer and may change the buffers, so the ports are left
+ * disabled meanwhile, and pad_chain() enables them. */
+static void
+eager_start (GstOmxBaseFilter * self)
+{
+  GOmxCore *gomx = self->gomx;
+
+  g_mutex_lock (self->ready_lock);
+
+  if (self->starting || self->ready || gomx->omx_state != OMX_StateLoaded) {
+    g_mutex_unlock (self->ready_lock);
+    return;
   }
 
-  GST_LOG_OBJECT (self, "end");
+  GST_INFO_OBJECT (self, "omx: eager start");
 
-  gst_object_unref (self);
+  enable_port (self->in_port);
+  enable_port (self->out_port);
+
+  if (self->omx_setup)
+    self->omx_setup (self);
+
+  setup_ports (self);
+  setup_tunnel (self);
+  setup_output_sharing (self);
+  setup_input_sharing (self);
+
+  defer_port (self->in_port);
+  defer_port (self->out_port);
+
+  self->starting = TRUE;
+
+  g_mutex_unlock (self->ready_lock);
+
+  tunnel_set_state (self, OMX_StateExecuting);
+  g_omx_core_set_state_async (gomx, OMX_StateExecuting, eager_start_done,
+      self);
+}
+
+/* A buffer of the upstream element we share the memory of goes in as is;
+ * it takes over the reference to @buf. */
+static gboolean
+send_peer_buffer (GstOmxBaseFilter * self, GstBuffer * buf)
+{
+  GOmxPort *in_port;
+  GstOmxBuffer *peer_buf;
+  OMX_BUFFERHEADERTYPE *omx_buffer;
+
+  in_port = self->in_port;
+
+  if (!in_port->peer || !GST_IS_OMX_BUFFER (buf))
+    return FALSE;
+
+  peer_buf = GST_OMX_BUFFER (buf);
+  if (peer_buf->port != in_port->peer)
+    return FALSE;
+
+  omx_buffer = g_omx_port_take_peer_buffer (in_port, peer_buf->omx_buffer,
+      (GDestroyNotify) gst_buffer_unref, buf);
+  if (!omx_buffer)
+    return FALSE;
+
+  /* whatever was coalesced goes first, with its own duration */
+  g_mutex_lock (self->pending_lock);
+  if (self->pending_buffer)
+    send_pending_locked (self);
+  g_mutex_unlock (self->pending_lock);
+
+  omx_buffer->nOffset = GST_BUFFER_DATA (buf) - omx_buffer->pBuffer;
+  omx_buffer->nFilledLen = GST_BUFFER_SIZE (buf);
+  set_input_meta (self, omx_buffer, buf, GST_BUFFER_TIMESTAMP (buf),
+      omx_buffer->nFilledLen);
+
+  log_buffer (self, omx_buffer);
+
+  GST_LOG_OBJECT (self, "release_buffer");
+  g_omx_port_release_buffer (in_port, omx_buffer);
+
+  return TRUE;
 }
 
 static GstFlowReturn
@@ -517,6 +1661,7 @@ pad_chain (GstPad * pad, GstBuffer * buf)
   GOmxPort *in_port;
   GstOmxBaseFilter *self;
   GstFlowReturn ret = GST_FLOW_OK;
+  gboolean starting;
 
   self = GST_OMX_BASE_FILTER (GST_OBJECT_PARENT (pad));
 
@@ -527,23 +1672,63 @@ pad_chain (GstPad * pad, GstBuffer * buf)
 
   GST_LOG_OBJECT (self, "state: %d", gomx->omx_state);
 
+  g_mutex_lock (self->ready_lock);
+  starting = self->starting;
+  g_mutex_unlock (self->ready_lock);
+
+  if (G_UNLIKELY (starting)) {
+    gboolean started;
+
+    GST_INFO_OBJECT (self, "omx: waiting for eager start");
+    g_omx_core_wait_async (gomx);
+    tunnel_wait (self);
+
+    g_mutex_lock (self->ready_lock);
+    self->starting = FALSE;
+
+    /* the caps are in by now */
+    started = gomx->omx_state == OMX_StateExecuting &&
+        enable_port (self->in_port) && enable_port (self->out_port);
+    if (started) {
+      meta_set_buffers (self);
+      self->ready = TRUE;
+      start_output (self);
+    }
+
+    g_mutex_unlock (self->ready_lock);
+
+    if (!started)
+      goto out_flushing;
+
+    send_codec_data (self);
+  }
+
   if (G_UNLIKELY (gomx->omx_state == OMX_StateLoaded)) {
     g_mutex_lock (self->ready_lock);
 
     GST_INFO_OBJECT (self, "omx: prepare");
 
+    /* an eager start that never got a buffer left them disabled */
+    enable_port (self->in_port);
+    enable_port (self->out_port);
+
         /** @todo this should probably go after doing preparations. */
     if (self->omx_setup) {
       self->omx_setup (self);
     }
 
     setup_ports (self);
+    setup_tunnel (self);
+    setup_output_sharing (self);
+    setup_input_sharing (self);
 
+    tunnel_set_state (self, OMX_StateIdle);
     g_omx_core_prepare (self->gomx);
+    tunnel_wait (self);
 
     if (gomx->omx_state == OMX_StateIdle) {
       self->ready = TRUE;
-      gst_pad_start_task (self->srcpad, output_loop, self->srcpad);
+      start_output (self);
     }
 
     g_mutex_unlock (self->ready_lock);
@@ -556,41 +1741,46 @@ pad_chain (GstPad * pad, GstBuffer * buf)
 
   if (G_LIKELY (in_port->enabled)) {
     guint buffer_offset = 0;
+    gboolean attach;
+    gboolean coalesce;
 
     if (G_UNLIKELY (gomx->omx_state == OMX_StateIdle)) {
       GST_INFO_OBJECT (self, "omx: play");
+      tunnel_set_state (self, OMX_StateExecuting);
       g_omx_core_start (gomx);
+      tunnel_wait (self);
 
       if (gomx->omx_state != OMX_StateExecuting)
         goto out_flushing;
 
-      /* send buffer with codec data flag */
-            /** @todo move to util */
-      if (self->codec_data) {
-        OMX_BUFFERHEADERTYPE *omx_buffer;
+      send_codec_data (self);
+    }
 
-        GST_LOG_OBJECT (self, "request buffer");
-        omx_buffer = g_omx_port_request_buffer (in_port);
+    if (G_UNLIKELY (gomx->omx_state != OMX_StateExecuting)) {
+      GST_ERROR_OBJECT (self, "Whoa! very wrong");
+    }
 
-        if (G_LIKELY (omx_buffer)) {
-          omx_buffer->nFlags |= 0x00000080;     /* codec data flag */
+    if (G_UNLIKELY (self->tunnel_preroll)) {
+      self->tunnel_preroll = FALSE;
+      self->last_pad_push_return = push_tunnel_preroll (self, buf);
+    }
 
-          omx_buffer->nFilledLen = GST_BUFFER_SIZE (self->codec_data);
-          memcpy (omx_buffer->pBuffer + omx_buffer->nOffset,
-              GST_BUFFER_DATA (self->codec_data), omx_buffer->nFilledLen);
+    if (send_peer_buffer (self, buf))
+      goto leave;
 
-          GST_LOG_OBJECT (self, "release_buffer");
-          g_omx_port_release_buffer (in_port, omx_buffer);
-        }
-      }
+    if (G_UNLIKELY (self->adapt_grow_input) && !self->pending_buffer) {
+      self->adapt_grow_input = FALSE;
+      if (g_omx_port_resize (in_port, in_port->num_buffers + 1))
+        meta_set_buffers (self);
     }
 
-    if (G_UNLIKELY (gomx->omx_state != OMX_StateExecuting)) {
-      GST_ERROR_OBJECT (self, "Whoa! very wrong");
-    }
+    attach = self->share_input && !in_port->omx_allocate;
+    coalesce = self->coalesce_size && !attach;
 
     while (G_LIKELY (buffer_offset < GST_BUFFER_SIZE (buf))) {
       OMX_BUFFERHEADERTYPE *omx_buffer;
+      gboolean timed_out = FALSE;
+      gboolean fresh;
 
       if (self->last_pad_push_return != GST_FLOW_OK ||
           !(gomx->omx_state == OMX_StateExecuting ||
@@ -598,38 +1788,68 @@ pad_chain (GstPad * pad, GstBuffer * buf)
         goto out_flushing;
       }
 
-      GST_LOG_OBJECT (self, "request buffer");
-      omx_buffer = g_omx_port_request_buffer (in_port);
+      omx_buffer = take_pending (self);
+      if (omx_buffer) {
+        fresh = FALSE;
+      } else {
+        gint64 start = 0;
+
+        if (self->adaptive_buffers && !in_port->peer)
+          start = g_get_monotonic_time ();
+
+        GST_LOG_OBJECT (self, "request buffer");
+        omx_buffer = g_omx_port_request_buffer_until (in_port,
+            g_omx_core_get_deadline (gomx), &timed_out);
+        fresh = TRUE;
+
+        if (start)
+          adapt_input (self, g_get_monotonic_time () - start);
+      }
 
       GST_LOG_OBJECT (self, "omx_buffer: %p", omx_buffer);
 
       if (G_LIKELY (omx_buffer)) {
-        log_buffer (self, omx_buffer);
+        guint len;
 
-        if (omx_buffer->nOffset == 0 && self->share_input_buffer) {
-          {
-            GstBuffer *old_buf;
-            old_buf = omx_buffer->pAppPrivate;
+        log_buffer (self, omx_buffer);
 
-            if (old_buf) {
-              gst_buffer_unref (old_buf);
-            } else if (omx_buffer->pBuffer) {
-              g_free (omx_buffer->pBuffer);
-            }
+        if (attach) {
+          /* each header keeps its own ref until the component is done */
+          g_omx_port_attach_data (in_port, omx_buffer,
+              GST_BUFFER_DATA (buf) + buffer_offset,
+              MIN (GST_BUFFER_SIZE (buf) - buffer_offset,
+                  in_port->buffer_size),
+              (GDestroyNotify) gst_buffer_unref, gst_buffer_ref (buf));
+          len = omx_buffer->nFilledLen;
+        } else if (coalesce) {
+          if (fresh) {
+            omx_buffer->nFilledLen = 0;
+            self->pending_duration = 0;
+            self->pending_deadline = g_get_monotonic_time () +
+                self->coalesce_latency / GST_USECOND;
           }
 
-          omx_buffer->pBuffer = GST_BUFFER_DATA (buf);
-          omx_buffer->nAllocLen = GST_BUFFER_SIZE (buf);
-          omx_buffer->nFilledLen = GST_BUFFER_SIZE (buf);
-          omx_buffer->pAppPrivate = buf;
+          len = MIN (GST_BUFFER_SIZE (buf) - buffer_offset,
+              coalesce_limit (self, omx_buffer) - omx_buffer->nFilledLen);
+          memcpy (omx_buffer->pBuffer + omx_buffer->nOffset +
+              omx_buffer->nFilledLen, GST_BUFFER_DATA (buf) + buffer_offset,
+              len);
+          omx_buffer->nFilledLen += len;
+
+          if (GST_BUFFER_DURATION (buf) != GST_CLOCK_TIME_NONE) {
+            self->pending_duration += gst_util_uint64_scale_int (len,
+                GST_BUFFER_DURATION (buf), GST_BUFFER_SIZE (buf));
+          }
         } else {
           omx_buffer->nFilledLen = MIN (GST_BUFFER_SIZE (buf) - buffer_offset,
               omx_buffer->nAllocLen - omx_buffer->nOffset);
           memcpy (omx_buffer->pBuffer + omx_buffer->nOffset,
               GST_BUFFER_DATA (buf) + buffer_offset, omx_buffer->nFilledLen);
+          len = omx_buffer->nFilledLen;
         }
 
-        if (self->use_timestamps) {
+        /* the timestamp is the one of the first byte */
+        if (fresh) {
           GstClockTime timestamp_offset = 0;
 
           if (buffer_offset && GST_BUFFER_DURATION (buf) != GST_CLOCK_TIME_NONE) {
@@ -637,16 +1857,31 @@ pad_chain (GstPad * pad, GstBuffer * buf)
                 GST_BUFFER_DURATION (buf), GST_BUFFER_SIZE (buf));
           }
 
-          omx_buffer->nTimeStamp =
-              gst_util_uint64_scale_int (GST_BUFFER_TIMESTAMP (buf) +
-              timestamp_offset, OMX_TICKS_PER_SECOND, GST_SECOND);
+          set_input_meta (self, omx_buffer, buf,
+              GST_BUFFER_TIMESTAMP (buf) + timestamp_offset, len);
+        }
+
+        buffer_offset += len;
+
+        if (coalesce && omx_buffer->nFilledLen < coalesce_limit (self, omx_buffer) &&
+            (!self->coalesce_latency ||
+                self->pending_duration < self->coalesce_latency)) {
+          GST_LOG_OBJECT (self, "holding %lu bytes", omx_buffer->nFilledLen);
+          hold_pending (self, omx_buffer);
+          continue;
         }
 
-        buffer_offset += omx_buffer->nFilledLen;
+        if (coalesce && self->use_timestamps)
+          meta_set_duration (self, self->pending_duration);
 
         GST_LOG_OBJECT (self, "release_buffer");
                 /** @todo untaint buffer */
         g_omx_port_release_buffer (in_port, omx_buffer);
+      } else if (timed_out) {
+        GST_ELEMENT_ERROR (self, STREAM, FAILED, (NULL),
+            ("timed out waiting for an input buffer"));
+        ret = GST_FLOW_ERROR;
+        goto out_flushing;
       } else {
         GST_WARNING_OBJECT (self, "null buffer");
         ret = GST_FLOW_WRONG_STATE;
@@ -658,9 +1893,7 @@ pad_chain (GstPad * pad, GstBuffer * buf)
     ret = GST_FLOW_UNEXPECTED;
   }
 
-  if (!self->share_input_buffer) {
-    gst_buffer_unref (buf);
-  }
+  gst_buffer_unref (buf);
 
 leave:
 
@@ -718,8 +1951,16 @@ pad_event (GstPad * pad, GstEvent * event)
         {
           OMX_BUFFERHEADERTYPE *omx_buffer;
 
-          GST_LOG_OBJECT (self, "request buffer");
-          omx_buffer = g_omx_port_request_buffer (in_port);
+          /* coalesced data goes out along with the flag */
+          omx_buffer = take_pending (self);
+          if (omx_buffer) {
+            if (self->use_timestamps)
+              meta_set_duration (self, self->pending_duration);
+          } else {
+            GST_LOG_OBJECT (self, "request buffer");
+            omx_buffer = g_omx_port_request_buffer_until (in_port,
+                g_omx_core_get_deadline (self->gomx), NULL);
+          }
 
           if (G_LIKELY (omx_buffer)) {
             omx_buffer->nFlags |= OMX_BUFFERFLAG_EOS;
@@ -727,6 +1968,20 @@ pad_event (GstPad * pad, GstEvent * event)
             GST_LOG_OBJECT (self, "release_buffer");
             /* foo_buffer_untaint (omx_buffer); */
             g_omx_port_release_buffer (in_port, omx_buffer);
+
+            if (self->tunnel_peer) {
+              GOmxCore *peer_core;
+
+              /* there's no loop; wait until the sink rendered it all */
+              peer_core = tunnel_core (self);
+              if (!g_sem_down_until (peer_core->done_sem,
+                      g_omx_core_get_deadline (peer_core)))
+                GST_WARNING_OBJECT (self, "timed out waiting for the sink");
+
+              ret = gst_pad_push_event (self->srcpad, event);
+              break;
+            }
+
             /* loop handles EOS, eat it here */
             gst_event_unref (event);
             break;
@@ -753,10 +2008,12 @@ pad_event (GstPad * pad, GstEvent * event)
       gst_pad_push_event (self->srcpad, event);
       self->last_pad_push_return = GST_FLOW_OK;
 
+      drop_pending (self);
+      meta_reset (self);
       g_omx_core_flush_stop (gomx);
 
       if (self->ready)
-        gst_pad_start_task (self->srcpad, output_loop, self->srcpad);
+        start_output (self);
 
       ret = TRUE;
       break;
@@ -775,6 +2032,69 @@ pad_event (GstPad * pad, GstEvent * event)
   return ret;
 }
 
+static void
+get_latency (GstOmxBaseFilter * self, GstClockTime * min, GstClockTime * max)
+{
+  g_mutex_lock (self->meta_lock);
+  compute_latency (self, min, max);
+  self->latency_min = *min;
+  self->latency_max = *max;
+  g_mutex_unlock (self->meta_lock);
+}
+
+static gboolean
+src_query (GstPad * pad, GstQuery * query)
+{
+  GstOmxBaseFilter *self;
+  gboolean ret;
+
+  self = GST_OMX_BASE_FILTER (gst_pad_get_parent (pad));
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_LATENCY:
+    {
+      GstPad *peer;
+      gboolean live;
+      GstClockTime min, max;
+      GstClockTime our_min, our_max;
+
+      peer = gst_pad_get_peer (self->sinkpad);
+      if (!peer) {
+        ret = FALSE;
+        break;
+      }
+
+      ret = gst_pad_query (peer, query);
+      gst_object_unref (peer);
+      if (!ret)
+        break;
+
+      gst_query_parse_latency (query, &live, &min, &max);
+      get_latency (self, &our_min, &our_max);
+
+      GST_DEBUG_OBJECT (self, "latency: min %" GST_TIME_FORMAT ", max %"
+          GST_TIME_FORMAT, GST_TIME_ARGS (our_min), GST_TIME_ARGS (our_max));
+
+      min += our_min;
+      if (GST_CLOCK_TIME_IS_VALID (max) && GST_CLOCK_TIME_IS_VALID (our_max))
+        max += our_max;
+      else
+        max = GST_CLOCK_TIME_NONE;
+
+      gst_query_set_latency (query, live, min, max);
+      break;
+    }
+
+    default:
+      ret = gst_pad_query_default (pad, query);
+      break;
+  }
+
+  gst_object_unref (self);
+
+  return ret;
+}
+
 static gboolean
 activate_push (GstPad * pad, gboolean active)
 {
@@ -795,7 +2115,8 @@ activate_push (GstPad * pad, gboolean active)
         g_omx_port_resume (self->in_port);
         g_omx_port_resume (self->out_port);
 
-        result = gst_pad_start_task (pad, output_loop, pad);
+        if (!self->tunnel_peer)
+          result = gst_pad_start_task (pad, output_loop, pad);
       }
     }
   } else {
@@ -838,12 +2159,50 @@ type_instance_init (GTypeInstance * instance, gpointer g_class)
   GST_LOG_OBJECT (self, "begin");
 
   self->use_timestamps = TRUE;
+  self->coalesce_latency = DEFAULT_COALESCE_LATENCY * GST_MSECOND;
+
+  {
+    GstStructure *config;
+    const gchar *str = NULL;
+
+    config = gstomx_get_element_config (G_TYPE_FROM_CLASS (g_class));
+    if (config) {
+      str = gst_structure_get_string (config, "buffer-strategy");
+      gst_structure_get_boolean (config, "adaptive-buffers",
+          &self->adaptive_buffers);
+    }
+
+    if (str) {
+      GEnumClass *enum_class;
+      GEnumValue *value;
+
+      enum_class = g_type_class_ref (GST_TYPE_OMX_BUFFER_STRATEGY);
+      value = g_enum_get_value_by_nick (enum_class, str);
+      if (value)
+        self->buffer_strategy = value->value;
+      else
+        GST_WARNING_OBJECT (self, "unknown buffer strategy: %s", str);
+      g_type_class_unref (enum_class);
+    }
+
+    if (config)
+      gst_structure_free (config);
+  }
 
   self->gomx = gstomx_core_new (self, G_TYPE_FROM_CLASS (g_class));
   self->in_port = g_omx_core_new_port (self->gomx, 0);
   self->out_port = g_omx_core_new_port (self->gomx, 1);
+  self->out_port->reconfigurable = TRUE;
+  self->out_port->poll_settings = TRUE;
 
   self->ready_lock = g_mutex_new ();
+  self->meta = g_new0 (GstOmxBufferMeta, META_TABLE_SIZE);
+  self->meta_lock = g_mutex_new ();
+  self->pending_lock = g_mutex_new ();
+  self->pending_cond = g_cond_new ();
+  self->last_dts = GST_CLOCK_TIME_NONE;
+  self->latency_duration = GST_CLOCK_TIME_NONE;
+  self->latency_max = GST_CLOCK_TIME_NONE;
 
   self->sinkpad =
       gst_pad_new_from_template (gst_element_class_get_pad_template
@@ -857,6 +2216,7 @@ type_instance_init (GTypeInstance * instance, gpointer g_class)
       (element_class, "src"), "src");
 
   gst_pad_set_activatepush_function (self->srcpad, activate_push);
+  gst_pad_set_query_function (self->srcpad, src_query);
 
   gst_pad_use_fixed_caps (self->srcpad);
 
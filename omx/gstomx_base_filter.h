@@ -32,9 +32,38 @@ typedef struct GstOmxBaseFilter GstOmxBaseFilter;
 typedef struct GstOmxBaseFilterClass GstOmxBaseFilterClass;
 typedef void (*GstOmxBaseFilterCb) (GstOmxBaseFilter * self);
 
+/**
+ * How the buffers of the ports get their memory, and whether it's shared
+ * with the neighbouring elements.
+ */
+typedef enum
+{
+  GSTOMX_BUFFER_STRATEGY_DEFAULT,   /**< As the zero-copy properties say. */
+  GSTOMX_BUFFER_STRATEGY_COPY,
+  GSTOMX_BUFFER_STRATEGY_SHARE,
+  GSTOMX_BUFFER_STRATEGY_ALLOCATE,   /**< The component allocates, we copy. */
+  GSTOMX_BUFFER_STRATEGY_AUTO,   /**< Shares, unless it turns out not to pay. */
+} GstOmxBufferStrategy;
+
 #include "gstomx_util.h"
 #include <async_queue.h>
 
+/**
+ * What an input buffer carried besides its data, kept until the output
+ * buffer with the same timestamp comes out of the component.
+ */
+typedef struct
+{
+  OMX_TICKS ticks;   /**< The timestamp the component saw. */
+  GstClockTime timestamp;
+  GstClockTime duration;
+  guint64 offset;
+  guint64 offset_end;
+  gboolean used;   /**< An output buffer took it. */
+  gboolean decoded;   /**< An output buffer took its decode time. */
+  gint64 sent;   /**< When it went to the component, in us. */
+} GstOmxBufferMeta;
+
 struct GstOmxBaseFilter
 {
   GstElement element;
@@ -47,16 +76,67 @@ struct GstOmxBaseFilter
   GOmxPort *out_port;
 
   gboolean use_timestamps;   /** @todo remove; timestamps should always be used */
+  gboolean zero_copy_input;
+  gboolean zero_copy_output;
+
+  guint coalesce_size;
+  GstClockTime coalesce_latency;
+  guint input_frame_size;   /**< Coalesced input is cut at multiples of this. */
+  OMX_BUFFERHEADERTYPE *pending_buffer;   /**< Coalesced input held back. */
+  GstClockTime pending_duration;
+  gint64 pending_deadline;   /**< When it must go, in monotonic us. */
+  GMutex *pending_lock;   /**< Guards pending_buffer against the flusher. */
+  GCond *pending_cond;
+  GThread *pending_flusher;
+  gboolean pending_quit;
   gboolean ready;
   GMutex *ready_lock;
+  gboolean eager_start;
+  gboolean starting;   /**< An eager start is in progress; ready_lock. */
+  gboolean tunnel;
+  GstElement *tunnel_peer;   /**< Sink our output port is tunneled to. */
+  gboolean tunnel_preroll;
 
   GstOmxBaseFilterCb omx_setup;
   GstFlowReturn last_pad_push_return;
   GstBuffer *codec_data;
+  GstBuffer *out_headers;   /**< The codec config the component gave. */
+  gint headers_pending;   /**< out_headers go before the next keyframe. */
 
     /** @todo these are hacks, OpenMAX IL spec should be revised. */
-  gboolean share_input_buffer;
   gboolean share_output_buffer;
+  gboolean share_input;   /**< zero_copy_input as the strategy has it. */
+  gboolean share_output;   /**< share_output_buffer as the strategy has it. */
+
+  GstOmxBufferStrategy buffer_strategy;
+  guint probe_left;   /**< Output buffers to go before auto mode settles. */
+  guint probe_copies;
+  guint probe_shares;
+  gint64 probe_copy_time;   /**< In us, like probe_share_time. */
+  gint64 probe_share_time;
+
+  gboolean adaptive_buffers;
+  guint wanted_output_buffers;   /**< Set by subclasses from the stream. */
+  guint adapt_in_requests;
+  guint adapt_in_stalls;
+  gint64 adapt_in_wait;   /**< In us, over the current window. */
+  gboolean adapt_grow_input;
+  guint adapt_out_requests;
+  guint adapt_out_stalls;
+  gint64 adapt_out_wait;
+
+  GstOmxBufferMeta *meta;   /**< Ring of the input buffers in flight. */
+  guint meta_head;
+  guint meta_count;
+  GMutex *meta_lock;
+  GstClockTime last_dts;
+  gboolean keyframe_flags;   /**< The output marks its sync frames. */
+  guint latency_depth;   /**< Most input buffers seen in flight. */
+  GstClockTime latency_delay;   /**< Average time in the component. */
+  GstClockTime latency_duration;   /**< Of the last input buffer. */
+  guint latency_buffers;   /**< Of both ports, as last set up. */
+  GstClockTime latency_min;   /**< As last reported upstream. */
+  GstClockTime latency_max;
 };
 
 struct GstOmxBaseFilterClass
@@ -23,6 +23,7 @@
  */
 
 #include "gstomx_base_sink.h"
+#include "gstomx_base_filter.h"
 #include "gstomx.h"
 #include "gstomx_interface.h"
 
@@ -31,10 +32,9 @@
 enum
 {
   ARG_NUM_INPUT_BUFFERS = GSTOMX_NUM_COMMON_PROP,
+  ARG_ZERO_COPY_INPUT,
 };
 
-static gboolean share_input_buffer;
-
 static inline gboolean omx_init (GstOmxBaseSink * self);
 
 static void init_interfaces (GType type);
@@ -49,6 +49,61 @@ setup_ports (GstOmxBaseSink * self)
   gst_pad_set_element_private (self->sinkpad, self->in_port);
 }
 
+/* Whether upstream is going to tunnel to us, and drive the component. If
+ * it ends up not doing so, the component is started on the first buffer. */
+static gboolean
+tunnel_expected (GstOmxBaseSink * self)
+{
+  GstPad *peer;
+  GstElement *element;
+  gboolean result = FALSE;
+
+  peer = gst_pad_get_peer (self->sinkpad);
+  if (!peer)
+    return FALSE;
+
+  element = gst_pad_get_parent_element (peer);
+  gst_object_unref (peer);
+
+  if (!element)
+    return FALSE;
+
+  if (G_TYPE_CHECK_INSTANCE_TYPE (element, GST_OMX_BASE_FILTER_TYPE)) {
+    GstOmxBaseFilter *filter;
+
+    filter = GST_OMX_BASE_FILTER (element);
+    result = filter->tunnel &&
+        g_strcmp0 (filter->gomx->library_name, self->gomx->library_name) == 0;
+  }
+
+  gst_object_unref (element);
+
+  return result;
+}
+
+/* Sets the port up again whenever the component is back in Loaded, be it
+ * from our own unload or from upstream tearing a tunnel down; then gets
+ * the component ready, unless upstream is going to drive it. */
+static void
+prepare (GstOmxBaseSink * self)
+{
+  GOmxCore *gomx;
+
+  gomx = self->gomx;
+
+  /* a previous tunnel might still be tearing down */
+  g_omx_core_wait_async (gomx);
+
+  if (gomx->omx_state != OMX_StateLoaded)
+    return;
+
+  setup_ports (self);
+
+  self->tunnel_pending = tunnel_expected (self);
+  if (!self->tunnel_pending)
+    g_omx_core_prepare (gomx);
+}
+
 static GstStateChangeReturn
 change_state (GstElement * element, GstStateChange transition)
 {
@@ -67,19 +122,31 @@ change_state (GstElement * element, GstStateChange transition)
     case GST_STATE_CHANGE_NULL_TO_READY:
       if (!self->initialized) {
         if (!omx_init (self))
-          return GST_PAD_LINK_REFUSED;
+          return GST_STATE_CHANGE_FAILURE;
 
         self->initialized = TRUE;
       }
 
-      g_omx_core_prepare (self->gomx);
+      prepare (self);
       break;
 
     case GST_STATE_CHANGE_READY_TO_PAUSED:
-      g_omx_core_start (self->gomx);
+      /* upstream might have unloaded us since */
+      prepare (self);
+      if (!self->tunnel_pending)
+        g_omx_core_start (self->gomx);
+      break;
+
+    case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
+      if (self->tunnel_paused) {
+        self->tunnel_paused = FALSE;
+        g_omx_core_set_state_async (self->gomx, OMX_StateExecuting, NULL,
+            NULL);
+      }
       break;
 
     case GST_STATE_CHANGE_PAUSED_TO_READY:
+      self->tunnel_paused = FALSE;
       g_omx_port_finish (self->in_port);
       break;
 
@@ -95,13 +162,23 @@ change_state (GstElement * element, GstStateChange transition)
   switch (transition) {
     case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
       g_omx_port_pause (self->in_port);
+
+      /* nothing else stops a tunneled component from rendering; upstream
+       * stalls on the tunnel meanwhile */
+      if (self->in_port->tunnel) {
+        g_omx_core_set_state_async (self->gomx, OMX_StatePause, NULL, NULL);
+        self->tunnel_paused = TRUE;
+      }
       break;
 
     case GST_STATE_CHANGE_PAUSED_TO_READY:
-      g_omx_core_stop (self->gomx);
+      /* upstream takes a tunneled component down */
+      if (!self->in_port->tunnel)
+        g_omx_core_stop (self->gomx);
       break;
 
     case GST_STATE_CHANGE_READY_TO_NULL:
+      g_omx_core_wait_async (self->gomx);
       g_omx_core_unload (self->gomx);
       break;
 
@@ -122,7 +199,9 @@ finalize (GObject * obj)
 
   self = GST_OMX_BASE_SINK (obj);
 
-  g_omx_core_free (self->gomx);
+  /* the port goes along with the core, in the background */
+  self->in_port = NULL;
+  g_omx_core_free_async (self->gomx);
 
   G_OBJECT_CLASS (parent_class)->finalize (obj);
 }
@@ -146,14 +225,30 @@ render (GstBaseSink * gst_base, GstBuffer * buf)
 
   in_port = self->in_port;
 
+  /* the data comes through the tunnel */
+  if (in_port->tunnel)
+    goto leave;
+
+  if (G_UNLIKELY (self->tunnel_pending)) {
+    self->tunnel_pending = FALSE;
+
+    if (gomx->omx_state == OMX_StateLoaded) {
+      GST_INFO_OBJECT (self, "not tunneled; starting");
+      g_omx_core_prepare (gomx);
+      g_omx_core_start (gomx);
+    }
+  }
+
   if (G_LIKELY (in_port->enabled)) {
     guint buffer_offset = 0;
 
     while (G_LIKELY (buffer_offset < GST_BUFFER_SIZE (buf))) {
       OMX_BUFFERHEADERTYPE *omx_buffer;
+      gboolean timed_out;
 
       GST_LOG_OBJECT (self, "request_buffer");
-      omx_buffer = g_omx_port_request_buffer (in_port);
+      omx_buffer = g_omx_port_request_buffer_until (in_port,
+          g_omx_core_get_deadline (gomx), &timed_out);
 
       if (G_LIKELY (omx_buffer)) {
         GST_DEBUG_OBJECT (self,
@@ -161,25 +256,13 @@ render (GstBaseSink * gst_base, GstBuffer * buf)
             omx_buffer->nAllocLen, omx_buffer->nFilledLen, omx_buffer->nFlags,
             omx_buffer->nOffset, omx_buffer->nTimeStamp);
 
-        if (omx_buffer->nOffset == 0 && share_input_buffer) {
-          {
-            GstBuffer *old_buf;
-            old_buf = omx_buffer->pAppPrivate;
-
-            if (old_buf) {
-              gst_buffer_unref (old_buf);
-            } else if (omx_buffer->pBuffer) {
-              g_free (omx_buffer->pBuffer);
-            }
-          }
-
-          /* We are going to use this. */
-          gst_buffer_ref (buf);
-
-          omx_buffer->pBuffer = GST_BUFFER_DATA (buf);
-          omx_buffer->nAllocLen = GST_BUFFER_SIZE (buf);
-          omx_buffer->nFilledLen = GST_BUFFER_SIZE (buf);
-          omx_buffer->pAppPrivate = buf;
+        if (self->zero_copy_input && !in_port->omx_allocate) {
+          /* each header keeps its own ref until the component is done */
+          g_omx_port_attach_data (in_port, omx_buffer,
+              GST_BUFFER_DATA (buf) + buffer_offset,
+              MIN (GST_BUFFER_SIZE (buf) - buffer_offset,
+                  in_port->buffer_size),
+              (GDestroyNotify) gst_buffer_unref, gst_buffer_ref (buf));
         } else {
           omx_buffer->nFilledLen = MIN (GST_BUFFER_SIZE (buf) - buffer_offset,
               omx_buffer->nAllocLen - omx_buffer->nOffset);
@@ -187,10 +270,16 @@ render (GstBaseSink * gst_base, GstBuffer * buf)
               GST_BUFFER_DATA (buf) + buffer_offset, omx_buffer->nFilledLen);
         }
 
+        /* the header is no longer ours once released */
+        buffer_offset += omx_buffer->nFilledLen;
+
         GST_LOG_OBJECT (self, "release_buffer");
         g_omx_port_release_buffer (in_port, omx_buffer);
-
-        buffer_offset += omx_buffer->nFilledLen;
+      } else if (timed_out) {
+        GST_ELEMENT_ERROR (self, STREAM, FAILED, (NULL),
+            ("timed out waiting for an input buffer"));
+        ret = GST_FLOW_ERROR;
+        break;
       } else {
         GST_WARNING_OBJECT (self, "null buffer");
         ret = GST_FLOW_UNEXPECTED;
@@ -202,6 +291,7 @@ render (GstBaseSink * gst_base, GstBuffer * buf)
     ret = GST_FLOW_UNEXPECTED;
   }
 
+leave:
   GST_LOG_OBJECT (self, "end");
 
   return ret;
@@ -224,8 +314,9 @@ handle_event (GstBaseSink * gst_base, GstEvent * event)
 
   switch (GST_EVENT_TYPE (event)) {
     case GST_EVENT_EOS:
-      /* Close the inpurt port. */
-      g_omx_core_set_done (gomx);
+      /* Close the inpurt port; upstream waits on it when tunneled. */
+      if (!in_port->tunnel)
+        g_omx_core_set_done (gomx);
       break;
 
     case GST_EVENT_FLUSH_START:
@@ -259,7 +350,13 @@ set_property (GObject * obj,
 
   self = GST_OMX_BASE_SINK (obj);
 
+  if (gstomx_set_property_helper (self->gomx, prop_id, value))
+    return;
+
   switch (prop_id) {
+    case ARG_ZERO_COPY_INPUT:
+      self->zero_copy_input = g_value_get_boolean (value);
+      break;
     case ARG_NUM_INPUT_BUFFERS:
     {
       OMX_PARAM_PORTDEFINITIONTYPE param;
@@ -306,6 +403,9 @@ get_property (GObject * obj, guint prop_id, GValue * value, GParamSpec * pspec)
     return;
 
   switch (prop_id) {
+    case ARG_ZERO_COPY_INPUT:
+      g_value_set_boolean (value, self->zero_copy_input);
+      break;
     case ARG_NUM_INPUT_BUFFERS:
     {
       OMX_PARAM_PORTDEFINITIONTYPE param;
@@ -366,6 +466,12 @@ type_class_init (gpointer g_class, gpointer class_data)
         g_param_spec_uint ("input-buffers", "Input buffers",
             "The number of OMX input buffers",
             1, 10, 4, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_ZERO_COPY_INPUT,
+        g_param_spec_boolean ("zero-copy-input", "Zero-copy input",
+            "Hand the data of incoming buffers to the component instead of "
+            "copying; they are kept alive until it's done with them",
+            FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
   }
 }
 
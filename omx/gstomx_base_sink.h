@@ -45,8 +45,11 @@ struct GstOmxBaseSink
   GOmxPort *in_port;
 
   gboolean ready;
+  gboolean zero_copy_input;
   GstPadActivateModeFunction base_activatepush;
   gboolean initialized;
+  gboolean tunnel_pending;   /**< Upstream is expected to drive us. */
+  gboolean tunnel_paused;   /**< We paused the tunneled component. */
 };
 
 struct GstOmxBaseSinkClass
@@ -87,7 +87,9 @@ finalize (GObject * obj)
 
   self = GST_OMX_BASE_SRC (obj);
 
-  g_omx_core_free (self->gomx);
+  /* the port goes along with the core, in the background */
+  self->out_port = NULL;
+  g_omx_core_free_async (self->gomx);
 
   G_OBJECT_CLASS (parent_class)->finalize (obj);
 }
@@ -141,9 +143,11 @@ create (GstBaseSrc * gst_base,
 
     {
       OMX_BUFFERHEADERTYPE *omx_buffer;
+      gboolean timed_out;
 
       GST_LOG_OBJECT (self, "request_buffer");
-      omx_buffer = g_omx_port_request_buffer (out_port);
+      omx_buffer = g_omx_port_request_buffer_until (out_port,
+          g_omx_core_get_deadline (gomx), &timed_out);
 
       if (omx_buffer) {
         GST_DEBUG_OBJECT (self, "omx_buffer: size=%lu, len=%lu, offset=%lu",
@@ -158,19 +162,11 @@ create (GstBaseSrc * gst_base,
         if (omx_buffer->nFilledLen > 0) {
           GstBuffer *buf;
 
-          if (out_port->enabled) {
-            GstCaps *caps = NULL;
-
-            caps = gst_pad_get_negotiated_caps (gst_base->srcpad);
-
-            if (!caps) {
-                            /** @todo We shouldn't be doing this. */
-              GST_WARNING_OBJECT (self, "somebody didn't do his work");
+          /* the caps are fixed once per change of the settings */
+          if (G_UNLIKELY (g_omx_port_settings_changed (out_port))) {
+            GST_INFO_OBJECT (self, "output settings changed");
+            if (gomx->settings_changed_cb)
               gomx->settings_changed_cb (gomx);
-            } else {
-              GST_LOG_OBJECT (self, "caps already fixed");
-              gst_caps_unref (caps);
-            }
           }
 
           buf = omx_buffer->pAppPrivate;
@@ -213,8 +209,9 @@ create (GstBaseSrc * gst_base,
 #endif
 
               omx_buffer->nFilledLen = 0;
-              g_free (omx_buffer->pBuffer);
-              omx_buffer->pBuffer = NULL;
+              /* the port's own memory is freed on unload */
+              if (!omx_buffer->pAppPrivate)
+                omx_buffer->pBuffer = NULL;
 
               *ret_buf = buf;
             } else {
@@ -240,7 +237,9 @@ create (GstBaseSrc * gst_base,
               omx_buffer->nAllocLen = GST_BUFFER_SIZE (new_buf);
             } else {
               GST_WARNING_OBJECT (self, "could not allocate buffer");
-              omx_buffer->pBuffer = g_malloc (omx_buffer->nAllocLen);
+              omx_buffer->pBuffer =
+                  g_omx_port_get_buffer_data (out_port, omx_buffer);
+              omx_buffer->nAllocLen = out_port->buffer_size;
             }
           }
 
@@ -253,6 +252,11 @@ create (GstBaseSrc * gst_base,
           g_omx_port_release_buffer (out_port, omx_buffer);
           continue;
         }
+      } else if (timed_out) {
+        GST_ELEMENT_ERROR (self, STREAM, FAILED, (NULL),
+            ("timed out waiting for an output buffer"));
+        ret = GST_FLOW_ERROR;
+        break;
       } else {
         GST_WARNING_OBJECT (self, "null buffer");
         /* ret = GST_FLOW_ERROR; */
@@ -308,6 +312,9 @@ set_property (GObject * obj,
 
   self = GST_OMX_BASE_SRC (obj);
 
+  if (gstomx_set_property_helper (self->gomx, prop_id, value))
+    return;
+
   switch (prop_id) {
     case ARG_NUM_OUTPUT_BUFFERS:
     {
@@ -426,6 +433,7 @@ type_instance_init (GTypeInstance * instance, gpointer g_class)
 
   self->gomx = gstomx_core_new (self, G_TYPE_FROM_CLASS (g_class));
   self->out_port = g_omx_core_new_port (self->gomx, 1);
+  self->out_port->poll_settings = TRUE;
 
   GST_LOG_OBJECT (self, "end");
 }
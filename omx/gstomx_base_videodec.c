@@ -22,6 +22,16 @@
 #include "gstomx_base_videodec.h"
 #include "gstomx.h"
 
+enum
+{
+  ARG_0,
+  ARG_QOS,
+  ARG_FRAMES_DECODED,
+  ARG_FRAMES_DROPPED,
+};
+
+#define DEFAULT_QOS FALSE
+
 GSTOMX_BOILERPLATE (GstOmxBaseVideoDec, gst_omx_base_videodec, GstOmxBaseFilter,
     GST_OMX_BASE_FILTER_TYPE);
 
@@ -84,9 +94,227 @@ type_base_init (gpointer g_class)
   }
 }
 
+static void
+set_property (GObject * obj,
+    guint prop_id, const GValue * value, GParamSpec * pspec)
+{
+  GstOmxBaseVideoDec *self;
+
+  self = GST_OMX_BASE_VIDEODEC (obj);
+
+  switch (prop_id) {
+    case ARG_QOS:
+      self->qos = g_value_get_boolean (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+get_property (GObject * obj, guint prop_id, GValue * value, GParamSpec * pspec)
+{
+  GstOmxBaseVideoDec *self;
+
+  self = GST_OMX_BASE_VIDEODEC (obj);
+
+  switch (prop_id) {
+    case ARG_QOS:
+      g_value_set_boolean (value, self->qos);
+      break;
+    case ARG_FRAMES_DECODED:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint64 (value, self->frames_decoded);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case ARG_FRAMES_DROPPED:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint64 (value, self->frames_dropped);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+      break;
+  }
+}
+
 static void
 type_class_init (gpointer g_class, gpointer class_data)
 {
+  GObjectClass *gobject_class;
+
+  gobject_class = G_OBJECT_CLASS (g_class);
+
+  /* Properties stuff */
+  {
+    gobject_class->set_property = set_property;
+    gobject_class->get_property = get_property;
+
+    g_object_class_install_property (gobject_class, ARG_QOS,
+        g_param_spec_boolean ("qos", "QoS",
+            "Drop late frames before they are decoded",
+            DEFAULT_QOS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_FRAMES_DECODED,
+        g_param_spec_uint64 ("frames-decoded", "Frames decoded",
+            "Number of frames sent to the component",
+            0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (gobject_class, ARG_FRAMES_DROPPED,
+        g_param_spec_uint64 ("frames-dropped", "Frames dropped",
+            "Number of late frames dropped before decoding",
+            0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  }
+}
+
+static void
+reset_qos (GstOmxBaseVideoDec * self)
+{
+  GST_OBJECT_LOCK (self);
+  self->earliest_time = GST_CLOCK_TIME_NONE;
+  GST_OBJECT_UNLOCK (self);
+  self->waiting_keyframe = FALSE;
+}
+
+/*
+ * Whether @buf would only be decoded to be dropped by the sink. Frames
+ * other frames depend on can't be told apart without parsing, so once a
+ * delta frame is dropped everything up to the next keyframe goes too.
+ */
+static gboolean
+drop_frame (GstOmxBaseVideoDec * self, GstBuffer * buf)
+{
+  GstClockTime earliest_time;
+  GstClockTime running_time;
+  gboolean keyframe;
+
+  keyframe = !GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
+
+  if (self->waiting_keyframe) {
+    if (!keyframe)
+      return TRUE;
+    GST_DEBUG_OBJECT (self, "keyframe, decoding again");
+    self->waiting_keyframe = FALSE;
+  }
+
+  if (!self->qos || keyframe || !GST_BUFFER_TIMESTAMP_IS_VALID (buf))
+    return FALSE;
+
+  GST_OBJECT_LOCK (self);
+  earliest_time = self->earliest_time;
+  GST_OBJECT_UNLOCK (self);
+
+  if (!GST_CLOCK_TIME_IS_VALID (earliest_time))
+    return FALSE;
+
+  running_time = gst_segment_to_running_time (&self->segment, GST_FORMAT_TIME,
+      GST_BUFFER_TIMESTAMP (buf));
+  if (!GST_CLOCK_TIME_IS_VALID (running_time) || running_time > earliest_time)
+    return FALSE;
+
+  GST_DEBUG_OBJECT (self, "late by %" GST_TIME_FORMAT
+      ", dropping until the next keyframe",
+      GST_TIME_ARGS (earliest_time - running_time));
+  self->waiting_keyframe = TRUE;
+
+  return TRUE;
+}
+
+static GstFlowReturn
+pad_chain (GstPad * pad, GstBuffer * buf)
+{
+  GstOmxBaseVideoDec *self;
+  gboolean drop;
+
+  self = GST_OMX_BASE_VIDEODEC (GST_OBJECT_PARENT (pad));
+
+  drop = drop_frame (self, buf);
+
+  GST_OBJECT_LOCK (self);
+  if (drop)
+    self->frames_dropped++;
+  else
+    self->frames_decoded++;
+  GST_OBJECT_UNLOCK (self);
+
+  if (drop) {
+    gst_buffer_unref (buf);
+    return GST_FLOW_OK;
+  }
+
+  return self->base_chain (pad, buf);
+}
+
+static gboolean
+sink_event (GstPad * pad, GstEvent * event)
+{
+  GstOmxBaseVideoDec *self;
+
+  self = GST_OMX_BASE_VIDEODEC (GST_OBJECT_PARENT (pad));
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_NEWSEGMENT:
+    {
+      gboolean update;
+      gdouble rate, applied_rate;
+      GstFormat format;
+      gint64 start, stop, position;
+
+      gst_event_parse_new_segment_full (event, &update, &rate, &applied_rate,
+          &format, &start, &stop, &position);
+
+      if (format == GST_FORMAT_TIME) {
+        gst_segment_set_newsegment_full (&self->segment, update, rate,
+            applied_rate, format, start, stop, position);
+      } else {
+        /* without a time segment the QoS events can't be related */
+        gst_segment_init (&self->segment, GST_FORMAT_UNDEFINED);
+      }
+      break;
+    }
+
+    case GST_EVENT_FLUSH_STOP:
+      gst_segment_init (&self->segment, GST_FORMAT_UNDEFINED);
+      reset_qos (self);
+      break;
+
+    default:
+      break;
+  }
+
+  return self->base_sink_event (pad, event);
+}
+
+static gboolean
+src_event (GstPad * pad, GstEvent * event)
+{
+  GstOmxBaseVideoDec *self;
+  GstOmxBaseFilter *omx_base;
+
+  self = GST_OMX_BASE_VIDEODEC (GST_OBJECT_PARENT (pad));
+  omx_base = GST_OMX_BASE_FILTER (self);
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_QOS) {
+    GstClockTimeDiff diff;
+    GstClockTime timestamp;
+
+    gst_event_parse_qos (event, NULL, &diff, &timestamp);
+
+    GST_OBJECT_LOCK (self);
+    /* frames before this one would be late too */
+    if (diff > 0)
+      self->earliest_time = timestamp + diff;
+    else
+      self->earliest_time = GST_CLOCK_TIME_NONE;
+    GST_OBJECT_UNLOCK (self);
+
+    GST_LOG_OBJECT (self, "qos: diff %" G_GINT64_FORMAT, diff);
+
+    return gst_pad_push_event (omx_base->sinkpad, event);
+  }
+
+  return gst_pad_event_default (pad, event);
 }
 
 static void
@@ -248,12 +476,26 @@ static void
 type_instance_init (GTypeInstance * instance, gpointer g_class)
 {
   GstOmxBaseFilter *omx_base;
+  GstOmxBaseVideoDec *self;
 
   omx_base = GST_OMX_BASE_FILTER (instance);
+  self = GST_OMX_BASE_VIDEODEC (instance);
 
   omx_base->omx_setup = omx_setup;
 
   omx_base->gomx->settings_changed_cb = settings_changed_cb;
 
   gst_pad_set_setcaps_function (omx_base->sinkpad, sink_setcaps);
+
+  self->base_chain = GST_PAD_CHAINFUNC (omx_base->sinkpad);
+  gst_pad_set_chain_function (omx_base->sinkpad, pad_chain);
+
+  self->base_sink_event = GST_PAD_EVENTFUNC (omx_base->sinkpad);
+  gst_pad_set_event_function (omx_base->sinkpad, sink_event);
+
+  gst_pad_set_event_function (omx_base->srcpad, src_event);
+
+  self->qos = DEFAULT_QOS;
+  gst_segment_init (&self->segment, GST_FORMAT_UNDEFINED);
+  self->earliest_time = GST_CLOCK_TIME_NONE;
 }
@@ -40,6 +40,15 @@ struct GstOmxBaseVideoDec
   OMX_VIDEO_CODINGTYPE compression_format;
   gint framerate_num;
   gint framerate_denom;
+
+  GstPadChainFunction base_chain;
+  GstPadEventFunction base_sink_event;
+  gboolean qos;
+  GstSegment segment;
+  GstClockTime earliest_time;   /**< Running time; set from QoS events. */
+  gboolean waiting_keyframe;   /**< Frames were dropped; the next must be a keyframe. */
+  guint64 frames_decoded;
+  guint64 frames_dropped;
 };
 
 struct GstOmxBaseVideoDecClass
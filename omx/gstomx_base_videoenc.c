@@ -226,6 +226,115 @@ sink_setcaps (GstPad * pad, GstCaps * caps)
   return gst_pad_set_caps (pad, caps);
 }
 
+/* Waits for the component to take all the queued input, so a config
+ * change applies from the next frame on. */
+static void
+drain_input (GstOmxBaseFilter * omx_base)
+{
+  GOmxPort *in_port;
+  OMX_BUFFERHEADERTYPE **omx_buffers;
+  guint count = 0;
+  guint total;
+  guint i;
+
+  in_port = omx_base->in_port;
+  total = in_port->num_buffers - (omx_base->pending_buffer ? 1 : 0);
+  omx_buffers = g_newa (OMX_BUFFERHEADERTYPE *, total);
+
+  while (count < total) {
+    gboolean timed_out = FALSE;
+    guint n;
+
+    n = g_omx_port_request_buffers_until (in_port, omx_buffers + count,
+        total - count, g_omx_core_get_deadline (omx_base->gomx), &timed_out);
+
+    if (!n) {
+      GST_WARNING_OBJECT (omx_base, "input not drained");
+      break;
+    }
+
+    count += n;
+  }
+
+  for (i = 0; i < count; i++)
+    g_omx_port_push_buffer (in_port, omx_buffers[i]);
+}
+
+/* Makes the next frame one the stream can start at. For AVC that's an
+ * IDR, which there is no standard request for; with an IDR period of one
+ * every intra frame is one, the forced one included. Returns FALSE if the
+ * component refused. */
+static gboolean
+force_keyframe (GstOmxBaseVideoEnc * self)
+{
+  GstOmxBaseFilter *omx_base;
+  GOmxCore *gomx;
+  OMX_CONFIG_INTRAREFRESHVOPTYPE config;
+
+  omx_base = GST_OMX_BASE_FILTER (self);
+  gomx = (GOmxCore *) omx_base->gomx;
+
+  if (self->compression_format == OMX_VIDEO_CodingAVC) {
+    OMX_VIDEO_CONFIG_AVCINTRAPERIOD period;
+
+    G_OMX_INIT_PARAM (period);
+    period.nPortIndex = omx_base->out_port->port_index;
+
+    if (OMX_GetConfig (gomx->omx_handle, OMX_IndexConfigVideoAVCIntraPeriod,
+            &period) != OMX_ErrorNone)
+      return FALSE;
+
+    if (period.nIDRPeriod != 1) {
+      period.nIDRPeriod = 1;
+      if (OMX_SetConfig (gomx->omx_handle,
+              OMX_IndexConfigVideoAVCIntraPeriod, &period) != OMX_ErrorNone)
+        return FALSE;
+    }
+  }
+
+  G_OMX_INIT_PARAM (config);
+  config.nPortIndex = omx_base->out_port->port_index;
+  config.IntraRefreshVOP = OMX_TRUE;
+
+  return OMX_SetConfig (gomx->omx_handle, OMX_IndexConfigVideoIntraVOPRefresh,
+      &config) == OMX_ErrorNone;
+}
+
+static gboolean
+sink_event (GstPad * pad, GstEvent * event)
+{
+  GstOmxBaseVideoEnc *self;
+  GstOmxBaseFilter *omx_base;
+  GOmxCore *gomx;
+
+  self = GST_OMX_BASE_VIDEOENC (GST_OBJECT_PARENT (pad));
+  omx_base = GST_OMX_BASE_FILTER (self);
+  gomx = (GOmxCore *) omx_base->gomx;
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_CUSTOM_DOWNSTREAM &&
+      gst_structure_has_name (gst_event_get_structure (event),
+          "GstForceKeyUnit")) {
+    gboolean all_headers = FALSE;
+
+    gst_structure_get_boolean (gst_event_get_structure (event),
+        "all-headers", &all_headers);
+
+    /* before the first frame there's nothing to do */
+    if (gomx->omx_state == OMX_StateExecuting) {
+      drain_input (omx_base);
+
+      GST_DEBUG_OBJECT (self, "forcing keyframe");
+      if (!force_keyframe (self))
+        GST_WARNING_OBJECT (self, "could not force a keyframe");
+
+      if (all_headers)
+        g_atomic_int_set (&omx_base->headers_pending, TRUE);
+    }
+  }
+
+  return self->base_sink_event (pad, event);
+}
+
 static void
 omx_setup (GstOmxBaseFilter * omx_base)
 {
@@ -269,8 +378,12 @@ type_instance_init (GTypeInstance * instance, gpointer g_class)
   self = GST_OMX_BASE_VIDEOENC (instance);
 
   omx_base->omx_setup = omx_setup;
+  omx_base->keyframe_flags = TRUE;
 
   gst_pad_set_setcaps_function (omx_base->sinkpad, sink_setcaps);
 
+  self->base_sink_event = GST_PAD_EVENTFUNC (omx_base->sinkpad);
+  gst_pad_set_event_function (omx_base->sinkpad, sink_event);
+
   self->bitrate = DEFAULT_BITRATE;
 }
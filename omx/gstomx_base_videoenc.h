@@ -40,6 +40,8 @@ struct GstOmxBaseVideoEnc
   guint bitrate;
   gint framerate_num;
   gint framerate_denom;
+
+  GstPadEventFunction base_sink_event;
 };
 
 struct GstOmxBaseVideoEncClass
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * Author: Felipe Contreras <felipe.contreras@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "gstomx_buffer.h"
+#include "gstomx.h"
+
+GSTOMX_BOILERPLATE (GstOmxBuffer, gst_omx_buffer, GstBuffer, GST_TYPE_BUFFER);
+
+static void
+finalize (GstMiniObject * obj)
+{
+  GstOmxBuffer *self;
+
+  self = GST_OMX_BUFFER (obj);
+
+  GST_LOG ("returning omx_buffer=%p", self->omx_buffer);
+
+  /* the data belongs to the header, not to us */
+  GST_BUFFER_DATA (obj) = NULL;
+  GST_BUFFER_SIZE (obj) = 0;
+
+  /* the core might be gone, and the header freed; the port knows */
+  g_omx_port_return_buffer (self->port, self->omx_buffer, self->generation);
+  g_omx_port_unref (self->port);
+
+  GST_MINI_OBJECT_CLASS (parent_class)->finalize (obj);
+}
+
+static void
+type_base_init (gpointer g_class)
+{
+}
+
+static void
+type_class_init (gpointer g_class, gpointer class_data)
+{
+  GstMiniObjectClass *mini_object_class;
+
+  mini_object_class = GST_MINI_OBJECT_CLASS (g_class);
+
+  mini_object_class->finalize = finalize;
+}
+
+static void
+type_instance_init (GTypeInstance * instance, gpointer g_class)
+{
+}
+
+/**
+ * Wraps the filled part of @omx_buffer, which must have been taken from
+ * @port, in a new GstBuffer. The header is given back to the port with
+ * g_omx_port_return_buffer() once the buffer is finalized, so the caller
+ * must not touch it after pushing.
+ */
+GstBuffer *
+gst_omx_buffer_new (GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer)
+{
+  GstOmxBuffer *self;
+  GstBuffer *buf;
+
+  self = (GstOmxBuffer *) gst_mini_object_new (GST_OMX_BUFFER_TYPE);
+  buf = GST_BUFFER (self);
+
+  self->port = g_omx_port_ref (port);
+  self->omx_buffer = omx_buffer;
+
+  GST_BUFFER_DATA (buf) = omx_buffer->pBuffer + omx_buffer->nOffset;
+  GST_BUFFER_SIZE (buf) = omx_buffer->nFilledLen;
+
+  self->generation = g_omx_port_lend_buffer (port, omx_buffer, buf);
+
+  return buf;
+}
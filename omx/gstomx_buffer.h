@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * Author: Felipe Contreras <felipe.contreras@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef GSTOMX_BUFFER_H
+#define GSTOMX_BUFFER_H
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+#define GST_OMX_BUFFER(obj) (GstOmxBuffer *) (obj)
+#define GST_OMX_BUFFER_TYPE (gst_omx_buffer_get_type ())
+#define GST_IS_OMX_BUFFER(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_OMX_BUFFER_TYPE))
+typedef struct GstOmxBuffer GstOmxBuffer;
+typedef struct GstOmxBufferClass GstOmxBufferClass;
+
+#include "gstomx_util.h"
+
+/**
+ * A GstBuffer pointing straight into the data of an OpenMAX buffer header;
+ * the header goes back to the port when the last reference is dropped.
+ */
+struct GstOmxBuffer
+{
+  GstBuffer buffer;
+
+  GOmxPort *port;
+  OMX_BUFFERHEADERTYPE *omx_buffer;
+  guint generation;
+};
+
+struct GstOmxBufferClass
+{
+  GstBufferClass parent_class;
+};
+
+GType gst_omx_buffer_get_type (void);
+GstBuffer *gst_omx_buffer_new (GOmxPort * port,
+    OMX_BUFFERHEADERTYPE * omx_buffer);
+
+G_END_DECLS
+#endif /* GSTOMX_BUFFER_H */
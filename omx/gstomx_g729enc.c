@@ -24,6 +24,7 @@
 #include "gstomx.h"
 
 #define DEFAULT_DTX TRUE
+#define FRAME_SIZE 160          /* 10 ms of 8 kHz, 16-bit mono */
 
 enum
 {
@@ -229,5 +230,7 @@ type_instance_init (GTypeInstance * instance, gpointer g_class)
 
   gst_pad_set_setcaps_function (omx_base->sinkpad, sink_setcaps);
 
+  omx_base->input_frame_size = FRAME_SIZE;
+
   self->dtx = DEFAULT_DTX;
 }
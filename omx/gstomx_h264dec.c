@@ -70,12 +70,98 @@ type_class_init (gpointer g_class, gpointer class_data)
 {
 }
 
+/* MaxDpbMbs of table A-1, by level_idc */
+static guint
+max_dpb_mbs (guint level)
+{
+  switch (level) {
+    case 9:
+    case 10:
+      return 396;
+    case 11:
+      return 900;
+    case 12:
+    case 13:
+    case 20:
+      return 2376;
+    case 21:
+      return 4752;
+    case 22:
+    case 30:
+      return 8100;
+    case 31:
+      return 18000;
+    case 32:
+      return 20480;
+    case 40:
+    case 41:
+      return 32768;
+    case 42:
+      return 34816;
+    case 50:
+      return 110400;
+    case 51:
+    case 52:
+      return 184320;
+    default:
+      return 0;
+  }
+}
+
+/* The decoder holds on to as many frames as the DPB of the level takes at
+ * this size; one more is being decoded, and one is shown downstream. */
+static gboolean
+sink_setcaps (GstPad * pad, GstCaps * caps)
+{
+  GstOmxH264Dec *self;
+  GstOmxBaseFilter *omx_base;
+  GstStructure *structure;
+  const GValue *codec_data;
+  gint width = 0, height = 0;
+
+  self = GST_OMX_H264DEC (GST_PAD_PARENT (pad));
+  omx_base = GST_OMX_BASE_FILTER (self);
+
+  structure = gst_caps_get_structure (caps, 0);
+
+  gst_structure_get_int (structure, "width", &width);
+  gst_structure_get_int (structure, "height", &height);
+  codec_data = gst_structure_get_value (structure, "codec_data");
+
+  if (codec_data && width > 0 && height > 0) {
+    GstBuffer *buffer;
+
+    buffer = gst_value_get_buffer (codec_data);
+
+    /* avcC: version, profile, compatibility, level */
+    if (GST_BUFFER_SIZE (buffer) >= 4 && GST_BUFFER_DATA (buffer)[0] == 1) {
+      guint level, mbs, dpb;
+
+      level = GST_BUFFER_DATA (buffer)[3];
+      mbs = ((width + 15) / 16) * ((height + 15) / 16);
+      dpb = MIN (max_dpb_mbs (level) / mbs, 16);
+
+      if (dpb > 0) {
+        GST_INFO_OBJECT (self, "level %u, dpb %u frames", level, dpb);
+        omx_base->wanted_output_buffers = dpb + 2;
+      }
+    }
+  }
+
+  return self->base_setcaps (pad, caps);
+}
+
 static void
 type_instance_init (GTypeInstance * instance, gpointer g_class)
 {
   GstOmxBaseVideoDec *omx_base;
+  GstOmxH264Dec *self;
 
   omx_base = GST_OMX_BASE_VIDEODEC (instance);
+  self = GST_OMX_H264DEC (instance);
 
   omx_base->compression_format = OMX_VIDEO_CodingAVC;
+
+  self->base_setcaps = GST_PAD_SETCAPSFUNC (omx_base->omx_base.sinkpad);
+  gst_pad_set_setcaps_function (omx_base->omx_base.sinkpad, sink_setcaps);
 }
@@ -35,6 +35,8 @@ typedef struct GstOmxH264DecClass GstOmxH264DecClass;
 struct GstOmxH264Dec
 {
   GstOmxBaseVideoDec omx_base;
+
+  GstPadSetCapsFunction base_setcaps;
 };
 
 struct GstOmxH264DecClass
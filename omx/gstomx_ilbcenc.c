@@ -133,8 +133,15 @@ sink_setcaps (GstPad * pad, GstCaps * caps)
     gst_pad_fixate_caps (omx_base->srcpad, tmp_caps);
 
     if (gst_caps_is_fixed (tmp_caps)) {
+      gint mode;
+
       GST_INFO_OBJECT (omx_base, "fixated to: %" GST_PTR_FORMAT, tmp_caps);
       gst_pad_set_caps (omx_base->srcpad, tmp_caps);
+
+      /* frames of 20 or 30 ms, of 8 kHz 16-bit mono */
+      if (gst_structure_get_int (gst_caps_get_structure (tmp_caps, 0),
+              "mode", &mode))
+        omx_base->input_frame_size = mode * 16;
     }
 
     gst_caps_unref (tmp_caps);
@@ -0,0 +1,654 @@
+/*
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * Author: Felipe Contreras <felipe.contreras@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "gstomx_shard.h"
+#include "gstomx.h"
+#include "gstomx_util.h"
+
+#define DEFAULT_SHARDS 2
+
+enum
+{
+  ARG_0,
+  ARG_SHARD_ELEMENT,
+  ARG_SHARDS,
+  ARG_SHARD_SEGMENT,
+};
+
+GSTOMX_BOILERPLATE (GstOmxShard, gst_omx_shard, GstBin, GST_TYPE_BIN);
+
+static void
+buffers_free (gpointer data)
+{
+  g_list_foreach (data, (GFunc) gst_buffer_unref, NULL);
+  g_list_free (data);
+}
+
+static void
+frame_free (gpointer data, gpointer user_data)
+{
+  g_slice_free (GstOmxShardFrame, data);
+}
+
+static void
+reset (GstOmxShard * self)
+{
+  guint i;
+
+  /* whatever is being pushed is done first */
+  g_mutex_lock (self->push_lock);
+  g_mutex_lock (self->lock);
+
+  for (i = 0; i < self->num_instances; i++) {
+    GstOmxShardInstance *instance = &self->instances[i];
+
+    g_queue_foreach (instance->pending, frame_free, NULL);
+    g_queue_clear (instance->pending);
+    buffers_free (instance->headers);
+    instance->headers = NULL;
+  }
+
+  g_hash_table_remove_all (self->done);
+
+  self->next_instance = 0;
+  self->in_seq = self->out_seq = 0;
+  self->eos_count = 0;
+  self->last_return = GST_FLOW_OK;
+
+  g_mutex_unlock (self->lock);
+  g_mutex_unlock (self->push_lock);
+}
+
+/* Finds the frame @instance gave output for: the one with the same
+ * timestamp, the ones before it having been skipped by the encoder, or
+ * the oldest one if the timestamps don't tell. Called locked. */
+static GstOmxShardFrame *
+take_frame (GstOmxShard * self, GstOmxShardInstance * instance,
+    GstClockTime timestamp)
+{
+  GList *l = NULL;
+
+  if (GST_CLOCK_TIME_IS_VALID (timestamp)) {
+    for (l = instance->pending->head; l; l = l->next) {
+      GstOmxShardFrame *frame = l->data;
+
+      if (frame->timestamp == timestamp)
+        break;
+    }
+  }
+
+  while (l && instance->pending->head != l) {
+    GstOmxShardFrame *frame;
+
+    frame = g_queue_pop_head (instance->pending);
+    GST_DEBUG_OBJECT (self, "frame %u skipped by %s", frame->seq,
+        GST_ELEMENT_NAME (instance->element));
+    g_hash_table_insert (self->done, GUINT_TO_POINTER (frame->seq), NULL);
+    frame_free (frame, NULL);
+  }
+
+  return g_queue_pop_head (instance->pending);
+}
+
+/* Pushes the output that is next in line; with @drain, frames that never
+ * came out are skipped. The buffers are taken under the lock and pushed
+ * without it, in order thanks to push_lock. */
+static GstFlowReturn
+push_ready (GstOmxShard * self, gboolean drain)
+{
+  GstFlowReturn ret;
+  GList *ready = NULL;
+
+  g_mutex_lock (self->push_lock);
+  g_mutex_lock (self->lock);
+
+  while (g_hash_table_size (self->done)) {
+    gpointer key = GUINT_TO_POINTER (self->out_seq);
+    GList *buffers;
+
+    if (!g_hash_table_lookup_extended (self->done, key, NULL,
+            (gpointer *) & buffers)) {
+      if (!drain)
+        break;
+      GST_WARNING_OBJECT (self, "frame %u lost", self->out_seq);
+      self->out_seq++;
+      continue;
+    }
+
+    g_hash_table_steal (self->done, key);
+    self->out_seq++;
+
+    ready = g_list_concat (ready, buffers);
+  }
+
+  ret = self->last_return;
+
+  g_mutex_unlock (self->lock);
+
+  while (ready) {
+    GstBuffer *buf = ready->data;
+
+    ready = g_list_delete_link (ready, ready);
+
+    if (ret == GST_FLOW_OK)
+      ret = gst_pad_push (self->srcpad, buf);
+    else
+      gst_buffer_unref (buf);
+  }
+
+  if (ret != GST_FLOW_OK) {
+    g_mutex_lock (self->lock);
+    self->last_return = ret;
+    g_mutex_unlock (self->lock);
+  }
+
+  g_mutex_unlock (self->push_lock);
+
+  return ret;
+}
+
+static GstFlowReturn
+pad_chain (GstPad * pad, GstBuffer * buf)
+{
+  GstOmxShard *self;
+  GstOmxShardInstance *instance;
+  GstOmxShardFrame *frame;
+  GstFlowReturn ret;
+  gboolean keyframe = FALSE;
+  guint seq;
+
+  self = GST_OMX_SHARD (GST_OBJECT_PARENT (pad));
+
+  if (G_UNLIKELY (!self->num_instances)) {
+    GST_ELEMENT_ERROR (self, CORE, MISSING_PLUGIN, (NULL),
+        ("no '%s' instances", self->element_name));
+    gst_buffer_unref (buf);
+    return GST_FLOW_ERROR;
+  }
+
+  g_mutex_lock (self->lock);
+  ret = self->last_return;
+  seq = self->in_seq++;
+
+  if (self->segment_length) {
+    instance = &self->instances[(seq / self->segment_length) %
+        self->num_instances];
+    keyframe = seq % self->segment_length == 0;
+  } else {
+    instance = &self->instances[self->next_instance];
+    self->next_instance = (self->next_instance + 1) % self->num_instances;
+  }
+
+  frame = g_slice_new (GstOmxShardFrame);
+  frame->seq = seq;
+  frame->timestamp = GST_BUFFER_TIMESTAMP (buf);
+  g_queue_push_tail (instance->pending, frame);
+  g_mutex_unlock (self->lock);
+
+  if (G_UNLIKELY (ret != GST_FLOW_OK)) {
+    gst_buffer_unref (buf);
+    return ret;
+  }
+
+  /* so the segment can be spliced after the one of another instance */
+  if (keyframe) {
+    GST_LOG_OBJECT (self, "segment starting at frame %u", seq);
+    gst_pad_push_event (instance->srcpad,
+        gst_event_new_custom (GST_EVENT_CUSTOM_DOWNSTREAM,
+            gst_structure_new ("GstForceKeyUnit",
+                "all-headers", G_TYPE_BOOLEAN, TRUE, NULL)));
+  }
+
+  GST_LOG_OBJECT (self, "frame %u to %s", seq,
+      GST_ELEMENT_NAME (instance->element));
+
+  ret = gst_pad_push (instance->srcpad, buf);
+
+  if (G_UNLIKELY (ret != GST_FLOW_OK)) {
+    /* don't let the others wait for it */
+    g_mutex_lock (self->lock);
+    frame_free (g_queue_pop_tail (instance->pending), NULL);
+    g_hash_table_insert (self->done, GUINT_TO_POINTER (seq), NULL);
+    g_mutex_unlock (self->lock);
+
+    push_ready (self, FALSE);
+  }
+
+  return ret;
+}
+
+static gboolean
+pad_event (GstPad * pad, GstEvent * event)
+{
+  GstOmxShard *self;
+  gboolean ret = TRUE;
+  guint i;
+
+  self = GST_OMX_SHARD (GST_OBJECT_PARENT (pad));
+
+  GST_LOG_OBJECT (self, "event: %s", GST_EVENT_TYPE_NAME (event));
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP)
+    reset (self);
+
+  for (i = 0; i < self->num_instances; i++) {
+    gst_event_ref (event);
+    ret &= gst_pad_push_event (self->instances[i].srcpad, event);
+  }
+
+  gst_event_unref (event);
+
+  return ret;
+}
+
+static GstFlowReturn
+output_chain (GstPad * pad, GstBuffer * buf)
+{
+  GstOmxShard *self;
+  GstOmxShardInstance *instance;
+  GstOmxShardFrame *frame;
+  GstFlowReturn ret;
+
+  instance = gst_pad_get_element_private (pad);
+  self = instance->shard;
+
+  g_mutex_lock (self->lock);
+
+  /* not a frame of its own; it goes out before the next one */
+  if (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_IN_CAPS)) {
+    instance->headers = g_list_append (instance->headers, buf);
+    ret = self->last_return;
+    g_mutex_unlock (self->lock);
+    return ret;
+  }
+
+  frame = take_frame (self, instance, GST_BUFFER_TIMESTAMP (buf));
+  if (G_UNLIKELY (!frame)) {
+    GST_WARNING_OBJECT (self, "unexpected output from %s",
+        GST_ELEMENT_NAME (instance->element));
+    gst_buffer_unref (buf);
+    ret = self->last_return;
+    g_mutex_unlock (self->lock);
+    return ret;
+  }
+
+  /* a segment the decoder can't start at can't be spliced either */
+  if (G_UNLIKELY (self->segment_length &&
+          frame->seq % self->segment_length == 0 &&
+          GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT))) {
+    guint seq = frame->seq;
+
+    frame_free (frame, NULL);
+    g_mutex_unlock (self->lock);
+    GST_ELEMENT_ERROR (self, STREAM, ENCODE, (NULL),
+        ("%s didn't start segment %u with a keyframe; "
+            "segments need an intra-only or IDR-capable encoder",
+            GST_ELEMENT_NAME (instance->element),
+            seq / self->segment_length));
+    gst_buffer_unref (buf);
+    return GST_FLOW_ERROR;
+  }
+
+  instance->headers = g_list_append (instance->headers, buf);
+  g_hash_table_insert (self->done, GUINT_TO_POINTER (frame->seq),
+      instance->headers);
+  instance->headers = NULL;
+  frame_free (frame, NULL);
+
+  g_mutex_unlock (self->lock);
+
+  return push_ready (self, FALSE);
+}
+
+static gboolean
+output_event (GstPad * pad, GstEvent * event)
+{
+  GstOmxShard *self;
+  GstOmxShardInstance *instance;
+  gboolean ret = TRUE;
+
+  instance = gst_pad_get_element_private (pad);
+  self = instance->shard;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_EOS:
+      g_mutex_lock (self->lock);
+      if (++self->eos_count == self->num_instances) {
+        g_mutex_unlock (self->lock);
+        push_ready (self, TRUE);
+        return gst_pad_push_event (self->srcpad, event);
+      }
+      g_mutex_unlock (self->lock);
+      break;
+    default:
+      /* the instances all see the same events */
+      if (instance == &self->instances[0])
+        return gst_pad_push_event (self->srcpad, event);
+      break;
+  }
+
+  gst_event_unref (event);
+
+  return ret;
+}
+
+static GstCaps *
+sink_getcaps (GstPad * pad)
+{
+  GstOmxShard *self;
+  GstCaps *caps = NULL;
+
+  self = GST_OMX_SHARD (GST_OBJECT_PARENT (pad));
+
+  if (self->num_instances)
+    caps = gst_pad_peer_get_caps (self->instances[0].srcpad);
+
+  return caps ? caps : gst_caps_copy (gst_pad_get_pad_template_caps (pad));
+}
+
+static GstCaps *
+src_getcaps (GstPad * pad)
+{
+  GstOmxShard *self;
+  GstCaps *caps = NULL;
+
+  self = GST_OMX_SHARD (GST_OBJECT_PARENT (pad));
+
+  if (self->num_instances)
+    caps = gst_pad_peer_get_caps (self->instances[0].sinkpad);
+
+  return caps ? caps : gst_caps_copy (gst_pad_get_pad_template_caps (pad));
+}
+
+static void
+set_instances_active (GstOmxShard * self, gboolean active)
+{
+  guint i;
+
+  for (i = 0; i < self->num_instances; i++) {
+    gst_pad_set_active (self->instances[i].srcpad, active);
+    gst_pad_set_active (self->instances[i].sinkpad, active);
+  }
+}
+
+static GstStateChangeReturn
+change_state (GstElement * element, GstStateChange transition)
+{
+  GstOmxShard *self;
+  GstStateChangeReturn ret;
+
+  self = GST_OMX_SHARD (element);
+
+  switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      reset (self);
+      set_instances_active (self, TRUE);
+      break;
+    default:
+      break;
+  }
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+
+  if (ret == GST_STATE_CHANGE_FAILURE)
+    return ret;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      set_instances_active (self, FALSE);
+      reset (self);
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
+static void
+finalize (GObject * obj)
+{
+  GstOmxShard *self;
+  guint i;
+
+  self = GST_OMX_SHARD (obj);
+
+  for (i = 0; i < self->num_instances; i++) {
+    gst_object_unref (self->instances[i].srcpad);
+    gst_object_unref (self->instances[i].sinkpad);
+    g_queue_foreach (self->instances[i].pending, frame_free, NULL);
+    g_queue_free (self->instances[i].pending);
+    buffers_free (self->instances[i].headers);
+  }
+
+  g_free (self->instances);
+  g_hash_table_destroy (self->done);
+  g_mutex_free (self->push_lock);
+  g_mutex_free (self->lock);
+  g_free (self->element_name);
+
+  G_OBJECT_CLASS (parent_class)->finalize (obj);
+}
+
+static void
+get_property (GObject * obj, guint prop_id, GValue * value, GParamSpec * pspec)
+{
+  GstOmxShard *self;
+
+  self = GST_OMX_SHARD (obj);
+
+  switch (prop_id) {
+    case ARG_SHARD_ELEMENT:
+      g_value_set_string (value, self->element_name);
+      break;
+    case ARG_SHARDS:
+      g_value_set_uint (value, self->num_instances);
+      break;
+    case ARG_SHARD_SEGMENT:
+      g_value_set_uint (value, self->segment_length);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+type_base_init (gpointer g_class)
+{
+  GstElementClass *element_class;
+
+  element_class = GST_ELEMENT_CLASS (g_class);
+
+  gst_element_class_set_details_simple (element_class,
+      "OpenMAX IL sharded element", "Codec",
+      "Spreads frames over several instances of an OpenMAX IL element",
+      "Felipe Contreras");
+
+  {
+    GstPadTemplate *template;
+
+    template = gst_pad_template_new ("src", GST_PAD_SRC,
+        GST_PAD_ALWAYS, gst_caps_new_any ());
+
+    gst_element_class_add_pad_template (element_class, template);
+  }
+
+  {
+    GstPadTemplate *template;
+
+    template = gst_pad_template_new ("sink", GST_PAD_SINK,
+        GST_PAD_ALWAYS, gst_caps_new_any ());
+
+    gst_element_class_add_pad_template (element_class, template);
+  }
+}
+
+static void
+type_class_init (gpointer g_class, gpointer class_data)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+
+  gobject_class = G_OBJECT_CLASS (g_class);
+  gstelement_class = GST_ELEMENT_CLASS (g_class);
+
+  gobject_class->finalize = finalize;
+  gobject_class->get_property = get_property;
+  gstelement_class->change_state = change_state;
+
+  g_object_class_install_property (gobject_class, ARG_SHARD_ELEMENT,
+      g_param_spec_string ("shard-element", "Shard element",
+          "Name of the element that is instantiated several times",
+          NULL, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, ARG_SHARDS,
+      g_param_spec_uint ("shards", "Shards",
+          "Number of instances the frames are spread over",
+          0, G_MAXUINT, DEFAULT_SHARDS,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, ARG_SHARD_SEGMENT,
+      g_param_spec_uint ("shard-segment", "Shard segment",
+          "Number of frames sent in a row to one instance, the first one "
+          "forced to be a keyframe (0 = alternate every frame)",
+          0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+}
+
+static void
+instance_setup (GstOmxShard * self, GstOmxShardInstance * instance)
+{
+  GstPad *pad;
+
+  instance->shard = self;
+  instance->pending = g_queue_new ();
+
+  instance->srcpad = gst_pad_new ("shard_src", GST_PAD_SRC);
+  gst_object_ref (instance->srcpad);
+  gst_object_sink (instance->srcpad);
+
+  instance->sinkpad = gst_pad_new ("shard_sink", GST_PAD_SINK);
+  gst_object_ref (instance->sinkpad);
+  gst_object_sink (instance->sinkpad);
+  gst_pad_set_element_private (instance->sinkpad, instance);
+  gst_pad_set_chain_function (instance->sinkpad, output_chain);
+  gst_pad_set_event_function (instance->sinkpad, output_event);
+
+  /* otherwise the instances would only run one after the other, in the
+   * thread of our sink pad; a whole segment fits in, so the next one can
+   * go to the next instance right away */
+  instance->queue = gst_element_factory_make ("queue", NULL);
+  if (instance->queue) {
+    g_object_set (instance->queue,
+        "max-size-buffers", MAX (self->segment_length, 1) + 1,
+        "max-size-bytes", 0, "max-size-time", (guint64) 0, NULL);
+    gst_bin_add (GST_BIN (self), instance->queue);
+    gst_element_link (instance->queue, instance->element);
+    pad = gst_element_get_static_pad (instance->queue, "sink");
+  } else {
+    GST_WARNING_OBJECT (self, "no queue; the instances won't run in parallel");
+    pad = gst_element_get_static_pad (instance->element, "sink");
+  }
+
+  gst_pad_link (instance->srcpad, pad);
+  gst_object_unref (pad);
+
+  pad = gst_element_get_static_pad (instance->element, "src");
+  gst_pad_link (pad, instance->sinkpad);
+  gst_object_unref (pad);
+}
+
+static void
+type_instance_init (GTypeInstance * instance, gpointer g_class)
+{
+  GstOmxShard *self;
+  GstElementClass *element_class;
+  GstStructure *config;
+  gint shards = DEFAULT_SHARDS;
+  gint segment_length = 0;
+  guint i;
+
+  element_class = GST_ELEMENT_CLASS (g_class);
+
+  self = GST_OMX_SHARD (instance);
+
+  GST_LOG_OBJECT (self, "begin");
+
+  self->lock = g_mutex_new ();
+  self->push_lock = g_mutex_new ();
+  self->done = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+      buffers_free);
+  self->last_return = GST_FLOW_OK;
+
+  config = gstomx_get_element_config (G_TYPE_FROM_CLASS (g_class));
+  if (config) {
+    self->element_name =
+        g_strdup (gst_structure_get_string (config, "shard-element"));
+    gst_structure_get_int (config, "shards", &shards);
+    gst_structure_get_int (config, "shard-segment", &segment_length);
+    gst_structure_free (config);
+  }
+
+  self->segment_length = MAX (segment_length, 0);
+
+  if (self->element_name && shards > 0)
+    self->instances = g_new0 (GstOmxShardInstance, shards);
+
+  for (i = 0; self->instances && i < (guint) shards; i++) {
+    GstElement *element;
+
+    element = gst_element_factory_make (self->element_name, NULL);
+    if (!element) {
+      GST_ERROR_OBJECT (self, "could not create '%s'", self->element_name);
+      break;
+    }
+
+    /* a dropped frame would never come out, and the output of the others
+     * would wait for it */
+    if (g_object_class_find_property (G_OBJECT_GET_CLASS (element), "qos"))
+      g_object_set (element, "qos", FALSE, NULL);
+
+    gst_bin_add (GST_BIN (self), element);
+
+    self->instances[i].element = element;
+    instance_setup (self, &self->instances[i]);
+    self->num_instances++;
+  }
+
+  self->sinkpad =
+      gst_pad_new_from_template (gst_element_class_get_pad_template
+      (element_class, "sink"), "sink");
+
+  gst_pad_set_chain_function (self->sinkpad, pad_chain);
+  gst_pad_set_event_function (self->sinkpad, pad_event);
+  gst_pad_set_getcaps_function (self->sinkpad, sink_getcaps);
+
+  self->srcpad =
+      gst_pad_new_from_template (gst_element_class_get_pad_template
+      (element_class, "src"), "src");
+
+  gst_pad_set_getcaps_function (self->srcpad, src_getcaps);
+
+  gst_element_add_pad (GST_ELEMENT (self), self->sinkpad);
+  gst_element_add_pad (GST_ELEMENT (self), self->srcpad);
+
+  GST_LOG_OBJECT (self, "end");
+}
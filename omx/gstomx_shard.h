@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * Author: Felipe Contreras <felipe.contreras@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef GSTOMX_SHARD_H
+#define GSTOMX_SHARD_H
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+#define GST_OMX_SHARD(obj) (GstOmxShard *) (obj)
+#define GST_OMX_SHARD_TYPE (gst_omx_shard_get_type ())
+typedef struct GstOmxShard GstOmxShard;
+typedef struct GstOmxShardClass GstOmxShardClass;
+typedef struct GstOmxShardInstance GstOmxShardInstance;
+typedef struct GstOmxShardFrame GstOmxShardFrame;
+
+/**
+ * One of the elements the frames are spread over.
+ */
+struct GstOmxShardInstance
+{
+  GstOmxShard *shard;
+  GstElement *element;
+  GstElement *queue;   /**< Gives the element a streaming thread of its own. */
+  GstPad *srcpad;   /**< Feeds the element, through the queue. */
+  GstPad *sinkpad;   /**< Collects its output. */
+  GQueue *pending;   /**< GstOmxShardFrame of the frames in it, oldest first. */
+  GList *headers;   /**< Output waiting for the frame it comes with. */
+};
+
+/**
+ * A frame sent to an instance, waiting for its output.
+ */
+struct GstOmxShardFrame
+{
+  guint seq;
+  GstClockTime timestamp;
+};
+
+/**
+ * Runs several instances of an OpenMAX IL element, sends each input frame
+ * (or each segment of frames) to the next one in turn, and pushes their
+ * output in input order. Meant for encoders giving their output in input
+ * order: intra-only ones, or any video encoder when segments start with a
+ * forced keyframe (an IDR with its headers for AVC); a segment that starts
+ * with a delta unit is an error. The output is matched to its frame by timestamp, so
+ * frames the encoder skips don't hold the others back; headers go out
+ * with the frame after them.
+ */
+struct GstOmxShard
+{
+  GstBin bin;
+
+  GstPad *sinkpad;
+  GstPad *srcpad;
+
+  gchar *element_name;
+  guint num_instances;
+  GstOmxShardInstance *instances;
+  guint next_instance;
+  guint segment_length;   /**< Frames sent in a row to one instance, starting
+                               with a keyframe; 0 to alternate every frame. */
+
+  GMutex *lock;
+  GMutex *push_lock;   /**< Keeps the output in order, pushed unlocked. */
+  guint in_seq;
+  guint out_seq;
+  GHashTable *done;   /**< Buffers of a frame waiting for its turn, by
+                           sequence number; NULL if there are none. */
+  guint eos_count;
+  GstFlowReturn last_return;
+};
+
+struct GstOmxShardClass
+{
+  GstBinClass parent_class;
+};
+
+GType gst_omx_shard_get_type (void);
+
+G_END_DECLS
+#endif /* GSTOMX_SHARD_H */
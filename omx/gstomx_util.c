@@ -27,6 +27,12 @@
 
 GST_DEBUG_CATEGORY (gstomx_util_debug);
 
+/* How long to wait for lent buffers when freeing a port without timeout. */
+#define LENT_TIMEOUT G_USEC_PER_SEC
+
+/* How long a state change may take when no timeout is configured. */
+#define STATE_TIMEOUT (15 * G_USEC_PER_SEC)
+
 /*
  * Forward declarations
  */
@@ -68,30 +74,105 @@ static void core_deinit (GOmxCore * core);
 
 static inline void port_free_buffers (GOmxPort * port);
 
-static inline void port_allocate_buffers (GOmxPort * port);
+static inline gboolean port_allocate_buffers (GOmxPort * port);
+
+static void port_free_headers (GOmxPort * port);
 
 static inline void port_start_buffers (GOmxPort * port);
 
+static void port_start_buffers_from (GOmxPort * port, guint first);
+
+static gboolean port_enable (GOmxPort * port, GQueue * carried);
+
+static gboolean port_disable (GOmxPort * port, GQueue * carried);
+
+static void port_teardown_tunnel (GOmxPort * port);
+
+static void port_orphan_lent (GOmxPort * port);
+
+static void port_unlink_peer (GOmxPort * port);
+
 static OMX_CALLBACKTYPE callbacks =
     { EventHandler, EmptyBufferDone, FillBufferDone };
 
+typedef struct HandlePool HandlePool;
+typedef struct HandleParam HandleParam;
+typedef struct StateRequest StateRequest;
+typedef struct PortOrphan PortOrphan;
+
+/* Handles of a component kept in the Loaded state; each one holds a
+ * client reference on the implementation. Protected by the imp mutex. */
+struct HandlePool
+{
+  GOmxImp *imp;
+  gchar *component_name;
+  GQueue idle;
+  guint size;
+  gboolean filling;
+  GThread *filler;   /**< Joined before the next one, or the pool, goes. */
+};
+
+/* A param of a handle as first loaded, see handle_reset(). */
+struct HandleParam
+{
+  OMX_INDEXTYPE index;
+  gboolean config;
+  gpointer data;
+};
+
+struct StateRequest
+{
+  OMX_STATETYPE state;
+  GOmxStateCb cb;   /* only set on the last step */
+  gpointer user_data;
+};
+
+/* The memory of a header that was freed while lent; it goes once the
+ * GstBuffer wrapping it does. The header itself is only used as a key. */
+struct PortOrphan
+{
+  OMX_BUFFERHEADERTYPE *omx_buffer;
+  guint generation;
+  GOmxBufferMem mem;
+};
+
 /* protect implementations hash_table */
 static GMutex *imp_mutex;
 static GHashTable *implementations;
 static gboolean initialized;
 
+/* cores left behind by their elements, see g_omx_core_free_async() */
+static GThreadPool *teardown_pool;
+
+#define TEARDOWN_THREADS 4
+
+/* ports looked at when saving the defaults of a handle */
+#define MAX_PORTS 16
+
+/* What the elements configure, so a pooled handle can be given back as
+ * it was loaded; anything else stays as the last user left it. The port
+ * definition goes first, the rest depends on it. */
+static const struct
+{
+  OMX_INDEXTYPE index;
+  gsize size;
+  gboolean config;
+} reset_params[] = {
+  {OMX_IndexParamPortDefinition, sizeof (OMX_PARAM_PORTDEFINITIONTYPE)},
+  {OMX_IndexParamAudioPcm, sizeof (OMX_AUDIO_PARAM_PCMMODETYPE)},
+  {OMX_IndexParamAudioAac, sizeof (OMX_AUDIO_PARAM_AACPROFILETYPE)},
+  {OMX_IndexParamAudioAmr, sizeof (OMX_AUDIO_PARAM_AMRTYPE)},
+  {OMX_IndexParamAudioAdpcm, sizeof (OMX_AUDIO_PARAM_ADPCMTYPE)},
+  {OMX_IndexParamAudioG729, sizeof (OMX_AUDIO_PARAM_G729TYPE)},
+  {OMX_IndexParamQFactor, sizeof (OMX_IMAGE_PARAM_QFACTORTYPE)},
+  {OMX_IndexConfigCommonScale, sizeof (OMX_CONFIG_SCALEFACTORTYPE), TRUE},
+  {OMX_IndexConfigCommonRotate, sizeof (OMX_CONFIG_ROTATIONTYPE), TRUE},
+};
+
 /*
  * Util
  */
 
-static void
-g_ptr_array_clear (GPtrArray * array)
-{
-  guint index;
-  for (index = 0; index < array->len; index++)
-    array->pdata[index] = NULL;
-}
-
 static void
 g_ptr_array_insert (GPtrArray * array, guint index, gpointer data)
 {
@@ -125,6 +206,8 @@ core_for_each_port (GOmxCore * core, GOmxPortFunc func)
 
 static GOmxImp *imp_new (const gchar * name);
 static void imp_free (GOmxImp * imp);
+static OMX_ERRORTYPE handle_free (GOmxImp * imp, GOmxHandle * handle);
+static void handle_save (GOmxHandle * handle);
 
 static GOmxImp *
 imp_new (const gchar * name)
@@ -150,10 +233,13 @@ imp_new (const gchar * name)
     }
 
     imp->mutex = g_mutex_new ();
+    imp->pool = mem_pool_new ();
+    imp->handle_pools = g_hash_table_new (g_str_hash, g_str_equal);
     imp->sym_table.init = dlsym (handle, "OMX_Init");
     imp->sym_table.deinit = dlsym (handle, "OMX_Deinit");
     imp->sym_table.get_handle = dlsym (handle, "OMX_GetHandle");
     imp->sym_table.free_handle = dlsym (handle, "OMX_FreeHandle");
+    imp->sym_table.setup_tunnel = dlsym (handle, "OMX_SetupTunnel");
   }
 
   return imp;
@@ -162,9 +248,36 @@ imp_new (const gchar * name)
 static void
 imp_free (GOmxImp * imp)
 {
+  GHashTableIter iter;
+  HandlePool *pool;
+
+  /* a filler still running would add to the pool, and release the imp */
+  g_hash_table_iter_init (&iter, imp->handle_pools);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) & pool)) {
+    if (pool->filler)
+      g_thread_join (pool->filler);
+    pool->filler = NULL;
+  }
+
+  g_hash_table_iter_init (&iter, imp->handle_pools);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) & pool)) {
+    GOmxHandle *handle;
+
+    while ((handle = g_queue_pop_head (&pool->idle))) {
+      handle_free (imp, handle);
+      if (--imp->client_count == 0)
+        imp->sym_table.deinit ();
+    }
+
+    g_free (pool->component_name);
+    g_slice_free (HandlePool, pool);
+  }
+  g_hash_table_destroy (imp->handle_pools);
+
   if (imp->dl_handle) {
     dlclose (imp->dl_handle);
   }
+  mem_pool_free (imp->pool);
   g_mutex_free (imp->mutex);
   g_free (imp);
 }
@@ -212,6 +325,294 @@ release_imp (GOmxImp * imp)
   g_mutex_unlock (imp->mutex);
 }
 
+/*
+ * Handles
+ */
+
+static GOmxHandle *
+handle_new (GOmxImp * imp, const gchar * name, gboolean pooled,
+    OMX_ERRORTYPE * omx_error)
+{
+  GOmxHandle *handle;
+
+  handle = g_slice_new0 (GOmxHandle);
+  handle->lock = g_mutex_new ();
+  handle->cond = g_cond_new ();
+
+  *omx_error = imp->sym_table.get_handle (&handle->omx_handle,
+      (char *) name, handle, &callbacks);
+
+  GST_DEBUG ("OMX_GetHandle(&%p) -> %d", handle->omx_handle, *omx_error);
+
+  if (*omx_error) {
+    g_cond_free (handle->cond);
+    g_mutex_free (handle->lock);
+    g_slice_free (GOmxHandle, handle);
+    return NULL;
+  }
+
+  /* so whoever gets it next doesn't inherit the settings of the last
+   * user, see handle_reset() */
+  if (pooled)
+    handle_save (handle);
+
+  return handle;
+}
+
+/* Saves every param of the table that the component has, per port. */
+static void
+handle_save (GOmxHandle * handle)
+{
+  guint i, j;
+
+  for (i = 0; i < MAX_PORTS; i++) {
+    for (j = 0; j < G_N_ELEMENTS (reset_params); j++) {
+      HandleParam *saved;
+      OMX_PARAM_U32TYPE *header;
+      OMX_ERRORTYPE omx_error;
+
+      saved = g_slice_new (HandleParam);
+      saved->index = reset_params[j].index;
+      saved->config = reset_params[j].config;
+      saved->data = g_malloc0 (reset_params[j].size);
+
+      header = saved->data;
+      header->nSize = reset_params[j].size;
+      header->nVersion.s.nVersionMajor = 1;
+      header->nVersion.s.nVersionMinor = 1;
+      header->nPortIndex = i;
+
+      if (saved->config)
+        omx_error = OMX_GetConfig (handle->omx_handle, saved->index,
+            saved->data);
+      else
+        omx_error = OMX_GetParameter (handle->omx_handle, saved->index,
+            saved->data);
+
+      if (omx_error != OMX_ErrorNone) {
+        g_free (saved->data);
+        g_slice_free (HandleParam, saved);
+
+        /* the port definition tells whether there's such a port */
+        if (j == 0)
+          goto done;
+        continue;
+      }
+
+      handle->defaults = g_slist_prepend (handle->defaults, saved);
+    }
+  }
+
+done:
+  handle->defaults = g_slist_reverse (handle->defaults);
+}
+
+/* Gives a reused handle its settings back, as they were when it was
+ * loaded. */
+static void
+handle_reset (GOmxHandle * handle)
+{
+  GSList *l;
+
+  for (l = handle->defaults; l; l = l->next) {
+    HandleParam *saved = l->data;
+
+    if (saved->config)
+      OMX_SetConfig (handle->omx_handle, saved->index, saved->data);
+    else
+      OMX_SetParameter (handle->omx_handle, saved->index, saved->data);
+  }
+}
+
+/* Returns the core a callback on @handle is for, or NULL if the handle is
+ * idle. It stays valid until handle_unref_core(). */
+static inline GOmxCore *
+handle_ref_core (GOmxHandle * handle)
+{
+  GOmxCore *core;
+
+  g_mutex_lock (handle->lock);
+  core = handle->core;
+  if (core)
+    handle->calls++;
+  g_mutex_unlock (handle->lock);
+
+  return core;
+}
+
+static inline void
+handle_unref_core (GOmxHandle * handle)
+{
+  g_mutex_lock (handle->lock);
+  if (--handle->calls == 0)
+    g_cond_broadcast (handle->cond);
+  g_mutex_unlock (handle->lock);
+}
+
+/* Hands @handle to @core, or takes it back with NULL once no callback
+ * uses the previous one anymore. */
+static void
+handle_set_core (GOmxHandle * handle, GOmxCore * core)
+{
+  g_mutex_lock (handle->lock);
+  handle->core = core;
+  while (handle->calls)
+    g_cond_wait (handle->cond, handle->lock);
+  g_mutex_unlock (handle->lock);
+}
+
+static OMX_ERRORTYPE
+handle_free (GOmxImp * imp, GOmxHandle * handle)
+{
+  OMX_ERRORTYPE omx_error;
+
+  omx_error = imp->sym_table.free_handle (handle->omx_handle);
+
+  while (handle->defaults) {
+    HandleParam *saved = handle->defaults->data;
+
+    g_free (saved->data);
+    g_slice_free (HandleParam, saved);
+    handle->defaults = g_slist_delete_link (handle->defaults,
+        handle->defaults);
+  }
+
+  g_cond_free (handle->cond);
+  g_mutex_free (handle->lock);
+  g_slice_free (GOmxHandle, handle);
+
+  return omx_error;
+}
+
+static gpointer
+fill_handle_pool (gpointer data)
+{
+  HandlePool *pool = data;
+  GOmxImp *imp = pool->imp;
+
+  while (TRUE) {
+    GOmxHandle *handle;
+    OMX_ERRORTYPE omx_error;
+
+    g_mutex_lock (imp->mutex);
+    if (pool->idle.length >= pool->size) {
+      pool->filling = FALSE;
+      g_mutex_unlock (imp->mutex);
+      break;
+    }
+    g_mutex_unlock (imp->mutex);
+
+    handle = handle_new (imp, pool->component_name, TRUE, &omx_error);
+
+    g_mutex_lock (imp->mutex);
+    if (!handle) {
+      pool->filling = FALSE;
+      g_mutex_unlock (imp->mutex);
+      break;
+    }
+    g_queue_push_tail (&pool->idle, handle);
+    imp->client_count++;
+    g_mutex_unlock (imp->mutex);
+  }
+
+  /* the reference taken for filling */
+  release_imp (imp);
+
+  return NULL;
+}
+
+/**
+ * Takes an idle handle of @name, or returns NULL if there's none. A pool of
+ * @size handles is kept for @name from now on, and refilled in the
+ * background.
+ */
+static GOmxHandle *
+take_handle (GOmxImp * imp, const gchar * name, guint size)
+{
+  HandlePool *pool;
+  GOmxHandle *handle = NULL;
+  GThread *filler = NULL;
+  gboolean fill = FALSE;
+
+  g_mutex_lock (imp->mutex);
+
+  pool = g_hash_table_lookup (imp->handle_pools, name);
+  if (!pool && size) {
+    pool = g_slice_new0 (HandlePool);
+    pool->imp = imp;
+    pool->component_name = g_strdup (name);
+    g_queue_init (&pool->idle);
+    g_hash_table_insert (imp->handle_pools, pool->component_name, pool);
+  }
+
+  if (pool) {
+    pool->size = MAX (pool->size, size);
+
+    handle = g_queue_pop_head (&pool->idle);
+    if (handle) {
+      /* the caller holds its own reference */
+      imp->client_count--;
+    }
+
+    if (pool->idle.length < pool->size && !pool->filling) {
+      pool->filling = TRUE;
+      imp->client_count++;
+      filler = pool->filler;
+      pool->filler = NULL;
+      fill = TRUE;
+    }
+  }
+
+  g_mutex_unlock (imp->mutex);
+
+  if (fill) {
+    /* the previous one is done, or about to be */
+    if (filler)
+      g_thread_join (filler);
+
+    filler = g_thread_create (fill_handle_pool, pool, TRUE, NULL);
+
+    g_mutex_lock (imp->mutex);
+    pool->filler = filler;
+    if (!filler)
+      pool->filling = FALSE;
+    g_mutex_unlock (imp->mutex);
+
+    if (!filler)
+      release_imp (imp);
+  }
+
+  return handle;
+}
+
+/**
+ * Keeps @handle, which must be in the Loaded state, for later use if the
+ * pool of @name has room. Returns FALSE if the caller has to free it.
+ */
+static gboolean
+put_handle (GOmxImp * imp, const gchar * name, GOmxHandle * handle)
+{
+  HandlePool *pool;
+  gboolean ret = FALSE;
+
+  /* not under the lock; a callback still running may need it */
+  handle_set_core (handle, NULL);
+
+  g_mutex_lock (imp->mutex);
+
+  /* without its defaults it can't be reset for the next user */
+  pool = g_hash_table_lookup (imp->handle_pools, name);
+  if (pool && pool->idle.length < pool->size && handle->defaults) {
+    g_queue_push_head (&pool->idle, handle);
+    imp->client_count++;
+    ret = TRUE;
+  }
+
+  g_mutex_unlock (imp->mutex);
+
+  return ret;
+}
+
 void
 g_omx_init (void)
 {
@@ -220,6 +621,8 @@ g_omx_init (void)
     imp_mutex = g_mutex_new ();
     implementations = g_hash_table_new_full (g_str_hash,
         g_str_equal, g_free, (GDestroyNotify) imp_free);
+    teardown_pool = g_thread_pool_new ((GFunc) g_omx_core_free, NULL,
+        TEARDOWN_THREADS, FALSE, NULL);
     initialized = TRUE;
   }
 }
@@ -228,6 +631,8 @@ void
 g_omx_deinit (void)
 {
   if (initialized) {
+    /* the handles have to go before the libraries */
+    g_thread_pool_free (teardown_pool, FALSE, TRUE);
     g_hash_table_destroy (implementations);
     g_mutex_free (imp_mutex);
     initialized = FALSE;
@@ -250,12 +655,13 @@ g_omx_core_new (void *object)
 
   core->omx_state_condition = g_cond_new ();
   core->omx_state_mutex = g_mutex_new ();
+  core->async_cond = g_cond_new ();
 
   core->done_sem = g_sem_new ();
   core->flush_sem = g_sem_new ();
-  core->port_sem = g_sem_new ();
 
   core->omx_state = OMX_StateInvalid;
+  core->parallel_allocation = FALSE;
 
   return core;
 }
@@ -263,12 +669,21 @@ g_omx_core_new (void *object)
 void
 g_omx_core_free (GOmxCore * core)
 {
+  if (core->state_pool) {
+    g_omx_core_wait_async (core);
+    g_thread_pool_free (core->state_pool, FALSE, TRUE);
+  }
+
   core_deinit (core);
 
-  g_sem_free (core->port_sem);
+  /* whatever is still downstream must not find the core anymore */
+  core_for_each_port (core, port_orphan_lent);
+  core_for_each_port (core, g_omx_port_unref);
+
   g_sem_free (core->flush_sem);
   g_sem_free (core->done_sem);
 
+  g_cond_free (core->async_cond);
   g_mutex_free (core->omx_state_mutex);
   g_cond_free (core->omx_state_condition);
 
@@ -277,6 +692,26 @@ g_omx_core_free (GOmxCore * core)
   g_free (core);
 }
 
+/**
+ * Like g_omx_core_free(), but the pending transitions and the release of
+ * the handle (or its return to the handle pool) happen in the background.
+ * The core no longer refers to its object afterwards; a transition that is
+ * running is waited for, as it might use it, and the callbacks of the
+ * pending ones aren't called.
+ */
+void
+g_omx_core_free_async (GOmxCore * core)
+{
+  g_mutex_lock (core->omx_state_mutex);
+  while (core->busy)
+    g_cond_wait (core->async_cond, core->omx_state_mutex);
+  core->object = NULL;
+  core->settings_changed_cb = NULL;
+  g_mutex_unlock (core->omx_state_mutex);
+
+  g_thread_pool_push (teardown_pool, core, NULL);
+}
+
 void
 g_omx_core_init (GOmxCore * core)
 {
@@ -289,11 +724,33 @@ g_omx_core_init (GOmxCore * core)
   if (!core->imp)
     return;
 
-  core->omx_error = core->imp->sym_table.get_handle (&core->omx_handle,
-      (char *) core->component_name, core, &callbacks);
+  /* The pool is shared, so the most generous configuration wins. */
+  if (core->pool_size) {
+    MemPool *pool = core->imp->pool;
+
+    g_mutex_lock (core->imp->mutex);
+    mem_pool_set_limits (pool,
+        MAX (pool->max_size, (gsize) core->pool_size * 1024),
+        MAX (pool->max_idle, (gint64) core->pool_idle * 1000));
+    g_mutex_unlock (core->imp->mutex);
+  }
+
+  core->handle = take_handle (core->imp, core->component_name,
+      core->handle_pool);
+
+  if (core->handle) {
+    GST_DEBUG_OBJECT (core->object, "reusing handle %p",
+        core->handle->omx_handle);
+    handle_reset (core->handle);
+  } else {
+    core->handle = handle_new (core->imp, core->component_name,
+        core->handle_pool != 0, &core->omx_error);
+  }
 
-  GST_DEBUG_OBJECT (core->object, "OMX_GetHandle(&%p) -> %d",
-      core->omx_handle, core->omx_error);
+  if (core->handle) {
+    handle_set_core (core->handle, core);
+    core->omx_handle = core->handle->omx_handle;
+  }
 
   if (!core->omx_error) {
     core->omx_state = OMX_StateLoaded;
@@ -322,10 +779,18 @@ core_deinit (GOmxCore * core)
     return;
 
   if (core->omx_state == OMX_StateLoaded || core->omx_state == OMX_StateInvalid) {
-    if (core->omx_handle) {
-      core->omx_error = core->imp->sym_table.free_handle (core->omx_handle);
-      GST_DEBUG_OBJECT (core->object, "OMX_FreeHandle(%p) -> %d",
-          core->omx_handle, core->omx_error);
+    if (core->handle) {
+      if (core->omx_state == OMX_StateLoaded &&
+          put_handle (core->imp, core->component_name, core->handle)) {
+        GST_DEBUG_OBJECT (core->object, "keeping handle %p",
+            core->omx_handle);
+      } else {
+        core->omx_error = handle_free (core->imp, core->handle);
+        GST_DEBUG_OBJECT (core->object, "OMX_FreeHandle(%p) -> %d",
+            core->omx_handle, core->omx_error);
+      }
+      core->handle = NULL;
+      core->omx_handle = NULL;
     }
   } else {
     GST_WARNING_OBJECT (core->object, "Incorrect state: %s",
@@ -340,13 +805,68 @@ core_deinit (GOmxCore * core)
   core->imp = NULL;
 }
 
+static gpointer
+allocate_buffers_thread (gpointer data)
+{
+  return GINT_TO_POINTER (port_allocate_buffers (data));
+}
+
 void
 g_omx_core_prepare (GOmxCore * core)
 {
+  gboolean populated = TRUE;
+
   change_state (core, OMX_StateIdle);
 
   /* Allocate buffers. */
-  core_for_each_port (core, port_allocate_buffers);
+  if (core->parallel_allocation && core->ports->len > 1) {
+    GThread **threads;
+    guint index;
+
+    /* every port but the last from its own thread */
+    threads = g_newa (GThread *, core->ports->len);
+
+    for (index = 0; index < core->ports->len; index++) {
+      GOmxPort *port;
+
+      threads[index] = NULL;
+      port = get_port (core, index);
+
+      /* a disabled port gets its buffers once enabled */
+      if (!port || !port->enabled)
+        continue;
+
+      if (index + 1 < core->ports->len)
+        threads[index] = g_thread_create (allocate_buffers_thread, port,
+            TRUE, NULL);
+
+      if (!threads[index] && !port_allocate_buffers (port))
+        populated = FALSE;
+    }
+
+    for (index = 0; index < core->ports->len; index++) {
+      if (threads[index] && !g_thread_join (threads[index]))
+        populated = FALSE;
+    }
+  } else {
+    guint index;
+
+    for (index = 0; index < core->ports->len; index++) {
+      GOmxPort *port;
+
+      port = get_port (core, index);
+      if (port && port->enabled && !port_allocate_buffers (port)) {
+        populated = FALSE;
+        break;
+      }
+    }
+  }
+
+  if (G_UNLIKELY (!populated)) {
+    /* it's never going to be Idle; don't leave anything behind */
+    core->omx_error = OMX_ErrorInsufficientResources;
+    core_for_each_port (core, port_free_headers);
+  }
 
   wait_for_state (core, OMX_StateIdle);
 }
@@ -393,64 +913,264 @@ g_omx_core_unload (GOmxCore * core)
       wait_for_state (core, OMX_StateLoaded);
   }
 
-  core_for_each_port (core, g_omx_port_free);
-  g_ptr_array_clear (core->ports);
+  /* the handle might be reused by someone else */
+  if (core->omx_state == OMX_StateLoaded)
+    core_for_each_port (core, port_teardown_tunnel);
+
+  /* the ports stay, so they can be set up again */
+  core_for_each_port (core, port_unlink_peer);
 }
 
-static inline GOmxPort *
-get_port (GOmxCore * core, guint index)
+static void
+port_unlink_peer (GOmxPort * port)
 {
-  if (G_LIKELY (index < core->ports->len)) {
-    return g_ptr_array_index (core->ports, index);
-  }
+  if (!port->peer)
+    return;
 
-  return NULL;
+  g_omx_port_unref (port->peer);
+  port->peer = NULL;
+  port->allocator = NULL;
 }
 
-GOmxPort *
-g_omx_core_new_port (GOmxCore * core, guint index)
+static void
+port_teardown_tunnel (GOmxPort * port)
 {
-  GOmxPort *port = get_port (core, index);
+  GOmxSymbolTable *sym_table;
 
-  if (port) {
-    GST_WARNING_OBJECT (core->object, "port %d already exists", index);
-    return port;
-  }
+  if (!port->tunnel)
+    return;
 
-  port = g_omx_port_new (core, index);
-  g_ptr_array_insert (core->ports, index, port);
+  sym_table = &port->core->imp->sym_table;
 
-  return port;
+  if (port->type == GOMX_PORT_OUTPUT)
+    sym_table->setup_tunnel (port->core->omx_handle, port->port_index, NULL, 0);
+  else
+    sym_table->setup_tunnel (NULL, 0, port->core->omx_handle, port->port_index);
+
+  port->tunnel = NULL;
 }
 
-void
-g_omx_core_set_done (GOmxCore * core)
+/* The state to go through first on the way from @from to @to. */
+static inline OMX_STATETYPE
+next_state (OMX_STATETYPE from, OMX_STATETYPE to)
 {
-  g_sem_up (core->done_sem);
+  switch (from) {
+    case OMX_StateLoaded:
+      return to == OMX_StateLoaded ? to : OMX_StateIdle;
+    case OMX_StateExecuting:
+      return to == OMX_StateExecuting || to == OMX_StatePause ?
+          to : OMX_StateIdle;
+    case OMX_StatePause:
+      return to == OMX_StatePause || to == OMX_StateExecuting ?
+          to : OMX_StateIdle;
+    default:
+      return to;
+  }
 }
 
-void
-g_omx_core_wait_for_done (GOmxCore * core)
+/* Whether going from @from to @to gives resources back. */
+static inline gboolean
+is_teardown (OMX_STATETYPE from, OMX_STATETYPE to)
 {
-  g_sem_down (core->done_sem);
+  return to == OMX_StateLoaded ||
+      (to == OMX_StateIdle && from != OMX_StateLoaded);
 }
 
-void
-g_omx_core_flush_start (GOmxCore * core)
+static void
+do_transition (GOmxCore * core, OMX_STATETYPE state)
 {
-  core_for_each_port (core, g_omx_port_pause);
+  if (core->omx_state == state)
+    return;
+
+  switch (state) {
+    case OMX_StateIdle:
+      if (core->omx_state == OMX_StateLoaded)
+        g_omx_core_prepare (core);
+      else
+        g_omx_core_stop (core);
+      break;
+    case OMX_StateExecuting:
+      if (core->omx_state == OMX_StatePause) {
+        /* the buffers are already out */
+        change_state (core, OMX_StateExecuting);
+        wait_for_state (core, OMX_StateExecuting);
+      } else {
+        g_omx_core_start (core);
+      }
+      break;
+    case OMX_StatePause:
+      g_omx_core_pause (core);
+      break;
+    case OMX_StateLoaded:
+      g_omx_core_unload (core);
+      break;
+    default:
+      break;
+  }
 }
 
-void
-g_omx_core_flush_stop (GOmxCore * core)
+static void
+state_worker (gpointer data, gpointer user_data)
 {
-  core_for_each_port (core, g_omx_port_flush);
-  core_for_each_port (core, g_omx_port_resume);
-}
+  StateRequest *request = data;
+  GOmxCore *core = user_data;
+  gboolean orphaned;
 
-/*
- * Port
- */
+  /* the object is kept until we're done, see g_omx_core_free_async() */
+  g_mutex_lock (core->omx_state_mutex);
+  orphaned = core->object == NULL;
+  core->busy = !orphaned;
+  g_mutex_unlock (core->omx_state_mutex);
+
+  /* once something failed, only tear down, so the buffers still go */
+  if (core->omx_error == OMX_ErrorNone ||
+      is_teardown (core->omx_state, request->state))
+    do_transition (core, request->state);
+
+  /* nobody is left to report to */
+  if (request->cb && !orphaned)
+    request->cb (core, core->omx_state, request->user_data);
+
+  g_slice_free (StateRequest, request);
+
+  g_mutex_lock (core->omx_state_mutex);
+  core->busy = FALSE;
+  if (--core->pending_transitions == 0 || !orphaned)
+    g_cond_broadcast (core->async_cond);
+  g_mutex_unlock (core->omx_state_mutex);
+}
+
+/**
+ * Moves the component to @state, through the intermediate states, from a
+ * worker thread, and calls @cb from it once done or failed; check
+ * core->omx_error. Requests queue up behind the ones still pending, so
+ * several transitions can be issued at once; after a failure only the
+ * ones back to Idle or Loaded still run. The synchronous state functions
+ * must not be used while any is pending.
+ */
+void
+g_omx_core_set_state_async (GOmxCore * core, OMX_STATETYPE state,
+    GOmxStateCb cb, gpointer user_data)
+{
+  OMX_STATETYPE from;
+
+  g_mutex_lock (core->omx_state_mutex);
+
+  if (!core->state_pool)
+    core->state_pool = g_thread_pool_new (state_worker, core, 1, FALSE, NULL);
+
+  from = core->pending_transitions ? core->target_state : core->omx_state;
+
+  do {
+    StateRequest *request;
+
+    request = g_slice_new0 (StateRequest);
+    from = request->state = next_state (from, state);
+
+    if (from == state) {
+      request->cb = cb;
+      request->user_data = user_data;
+    }
+
+    core->pending_transitions++;
+    g_thread_pool_push (core->state_pool, request, NULL);
+  } while (from != state);
+
+  core->target_state = state;
+
+  g_mutex_unlock (core->omx_state_mutex);
+}
+
+/**
+ * Blocks until all the asynchronous transitions are done. Must not be
+ * called from a state callback.
+ */
+void
+g_omx_core_wait_async (GOmxCore * core)
+{
+  g_mutex_lock (core->omx_state_mutex);
+  while (core->pending_transitions)
+    g_cond_wait (core->async_cond, core->omx_state_mutex);
+  g_mutex_unlock (core->omx_state_mutex);
+}
+
+static inline GOmxPort *
+get_port (GOmxCore * core, guint index)
+{
+  if (G_LIKELY (index < core->ports->len)) {
+    return g_ptr_array_index (core->ports, index);
+  }
+
+  return NULL;
+}
+
+GOmxPort *
+g_omx_core_new_port (GOmxCore * core, guint index)
+{
+  GOmxPort *port = get_port (core, index);
+
+  if (port) {
+    GST_WARNING_OBJECT (core->object, "port %d already exists", index);
+    return port;
+  }
+
+  port = g_omx_port_new (core, index);
+  g_ptr_array_insert (core->ports, index, port);
+
+  return port;
+}
+
+void
+g_omx_core_set_done (GOmxCore * core)
+{
+  g_sem_up (core->done_sem);
+}
+
+/**
+ * Waits for g_omx_core_set_done(), within the timeout of @core. Returns
+ * FALSE if it didn't come in time.
+ */
+gboolean
+g_omx_core_wait_for_done (GOmxCore * core)
+{
+  if (!g_sem_down_until (core->done_sem, g_omx_core_get_deadline (core))) {
+    GST_WARNING_OBJECT (core->object, "timed out waiting for the end of "
+        "the stream");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+void
+g_omx_core_flush_start (GOmxCore * core)
+{
+  core_for_each_port (core, g_omx_port_pause);
+}
+
+void
+g_omx_core_flush_stop (GOmxCore * core)
+{
+  core_for_each_port (core, g_omx_port_flush);
+  core_for_each_port (core, g_omx_port_resume);
+}
+
+/**
+ * Returns the monotonic time at which a wait on the component started now
+ * should give up, or -1 if there's no timeout configured.
+ */
+gint64
+g_omx_core_get_deadline (GOmxCore * core)
+{
+  if (core->timeout == 0)
+    return -1;
+
+  return g_get_monotonic_time () + (gint64) core->timeout * 1000;
+}
+
+/*
+ * Port
+ */
 
 /**
  * note: this is not intended to be called directly by elements (which should
@@ -462,29 +1182,58 @@ g_omx_port_new (GOmxCore * core, guint index)
   GOmxPort *port;
   port = g_new0 (GOmxPort, 1);
 
+  port->ref_count = 1;
   port->core = core;
   port->port_index = index;
   port->num_buffers = 0;
   port->buffer_size = 0;
   port->buffers = NULL;
 
+  port->mem_flags = MEM_PREFAULT | core->mem_flags;
+
   port->enabled = TRUE;
   port->queue = async_queue_new ();
   port->mutex = g_mutex_new ();
+  port->lent_cond = g_cond_new ();
+  port->sem = g_sem_new ();
 
   return port;
 }
 
-void
-g_omx_port_free (GOmxPort * port)
+GOmxPort *
+g_omx_port_ref (GOmxPort * port)
+{
+  g_atomic_int_inc (&port->ref_count);
+
+  return port;
+}
+
+static void
+port_free (GOmxPort * port)
 {
+  g_sem_free (port->sem);
+  g_cond_free (port->lent_cond);
   g_mutex_free (port->mutex);
   async_queue_free (port->queue);
 
+  g_free (port->mem);
+  g_free (port->attached);
   g_free (port->buffers);
   g_free (port);
 }
 
+/**
+ * Drops a reference on @port. The core holds one until it's freed, and
+ * every lent header another, so the port outlives the core as long as
+ * some GstBuffer refers to it.
+ */
+void
+g_omx_port_unref (GOmxPort * port)
+{
+  if (g_atomic_int_dec_and_test (&port->ref_count))
+    port_free (port);
+}
+
 void
 g_omx_port_setup (GOmxPort * port)
 {
@@ -509,6 +1258,7 @@ g_omx_port_setup (GOmxPort * port)
   }
 
   port->type = type;
+  port->enabled = TRUE;
     /** @todo should it be nBufferCountMin? */
   port->num_buffers = param.nBufferCountActual;
   port->buffer_size = param.nBufferSize;
@@ -519,35 +1269,474 @@ g_omx_port_setup (GOmxPort * port)
 
   g_free (port->buffers);
   port->buffers = g_new0 (OMX_BUFFERHEADERTYPE *, port->num_buffers);
+  g_free (port->attached);
+  port->attached = g_new0 (GOmxAttachedData, port->num_buffers);
+  g_free (port->mem);
+  port->mem = g_new0 (GOmxBufferMem, port->num_buffers);
+
+  /* Anything still queued refers to the previous headers; the queue never
+   * holds more than num_buffers of the new ones. */
+  async_queue_flush (port->queue);
+  async_queue_reserve (port->queue, port->num_buffers);
+
+  /* whatever was negotiated before no longer counts */
+  g_atomic_int_set (&port->settings_changed, TRUE);
+}
+
+/* Makes sure the tunneled ports agree on which one allocates the buffers,
+ * preferring the output one when the input one has no say. */
+static gboolean
+port_negotiate_supplier (GOmxPort * out_port, GOmxPort * in_port)
+{
+  OMX_PARAM_BUFFERSUPPLIERTYPE param;
+  OMX_BUFFERSUPPLIERTYPE supplier;
+  OMX_HANDLETYPE in_handle, out_handle;
+
+  in_handle = in_port->core->omx_handle;
+  out_handle = out_port->core->omx_handle;
+
+  G_OMX_INIT_PARAM (param);
+  param.nPortIndex = in_port->port_index;
+  if (OMX_GetParameter (in_handle, OMX_IndexParamCompBufferSupplier,
+          &param) != OMX_ErrorNone)
+    return FALSE;
+
+  /* the input port passes it on to the output one */
+  if (param.eBufferSupplier == OMX_BufferSupplyUnspecified) {
+    param.eBufferSupplier = OMX_BufferSupplyOutput;
+    if (OMX_SetParameter (in_handle, OMX_IndexParamCompBufferSupplier,
+            &param) != OMX_ErrorNone)
+      return FALSE;
+  }
+
+  supplier = param.eBufferSupplier;
+
+  G_OMX_INIT_PARAM (param);
+  param.nPortIndex = out_port->port_index;
+  if (OMX_GetParameter (out_handle, OMX_IndexParamCompBufferSupplier,
+          &param) != OMX_ErrorNone || param.eBufferSupplier != supplier)
+    return FALSE;
+
+  GST_DEBUG_OBJECT (out_port->core->object, "buffers supplied by the %s port",
+      supplier == OMX_BufferSupplyOutput ? "output" : "input");
+
+  return TRUE;
+}
+
+/**
+ * Connects @out_port to @in_port so the components pass the buffers between
+ * themselves. Both components must come from the same implementation and be
+ * in the Loaded state, and agree on the buffer supplier; if not, nothing
+ * changes and the ports are used as usual.
+ */
+gboolean
+g_omx_port_setup_tunnel (GOmxPort * out_port, GOmxPort * in_port)
+{
+  GOmxCore *out_core, *in_core;
+  OMX_ERRORTYPE error;
+
+  out_core = out_port->core;
+  in_core = in_port->core;
+
+  if (out_core->imp != in_core->imp || !out_core->imp->sym_table.setup_tunnel)
+    return FALSE;
+
+  if (out_core->omx_state != OMX_StateLoaded ||
+      in_core->omx_state != OMX_StateLoaded)
+    return FALSE;
+
+  error = out_core->imp->sym_table.setup_tunnel (out_core->omx_handle,
+      out_port->port_index, in_core->omx_handle, in_port->port_index);
+
+  if (error != OMX_ErrorNone) {
+    GST_WARNING_OBJECT (out_core->object, "tunnel refused: %s (0x%08x)",
+        omx_error_to_str (error), error);
+    return FALSE;
+  }
+
+  if (!port_negotiate_supplier (out_port, in_port)) {
+    GST_WARNING_OBJECT (out_core->object, "no buffer supplier agreed on");
+    out_core->imp->sym_table.setup_tunnel (out_core->omx_handle,
+        out_port->port_index, NULL, 0);
+    out_core->imp->sym_table.setup_tunnel (NULL, 0, in_core->omx_handle,
+        in_port->port_index);
+    return FALSE;
+  }
+
+  out_port->tunnel = in_port;
+  in_port->tunnel = out_port;
+
+  GST_INFO_OBJECT (out_core->object, "port %u tunneled to %s:%u",
+      out_port->port_index, in_core->component_name, in_port->port_index);
+
+  return TRUE;
+}
+
+/* Memory comes from the pool of the implementation, so it can be reused by
+ * the next instance instead of being mapped again. */
+static gpointer
+default_alloc (GOmxPort * port, gsize size, gpointer * priv)
+{
+  MemBlock *block;
+
+  block = mem_pool_alloc (port->core->imp->pool, size, port->mem_flags);
+  if (!block)
+    return NULL;
+
+  *priv = block;
+
+  return block->data;
 }
 
 static void
+default_free (GOmxPort * port, gpointer data, gpointer priv)
+{
+  mem_pool_release (priv);
+}
+
+static const GOmxAllocator default_allocator = {
+  default_alloc,
+  default_free,
+};
+
+/* The memory of the peer buffers first, then some of our own. */
+static gpointer
+peer_alloc (GOmxPort * port, gsize size, gpointer * priv)
+{
+  guint i, j;
+
+  for (i = 0; i < port->peer->num_buffers; i++) {
+    gpointer data;
+
+    data = port->peer->buffers[i]->pBuffer;
+
+    for (j = 0; j < port->num_buffers; j++) {
+      if (port->mem[j].data == data)
+        break;
+    }
+
+    if (j == port->num_buffers) {
+      *priv = NULL;
+      return data;
+    }
+  }
+
+  return default_alloc (port, size, priv);
+}
+
+static void
+peer_free (GOmxPort * port, gpointer data, gpointer priv)
+{
+  if (priv)
+    default_free (port, data, priv);
+}
+
+static const GOmxAllocator peer_allocator = {
+  peer_alloc,
+  peer_free,
+};
+
+/* Whether the header uses the memory of a peer buffer; those never go
+ * through the queue, they come along with the peer buffer. */
+static inline gboolean
+port_is_peer_buffer (GOmxPort * port, guint i)
+{
+  return port->peer && port->mem[i].data && !port->mem[i].priv;
+}
+
+/**
+ * Makes the input @port use the memory of the buffers of @peer, an output
+ * port that had the component allocate them, so they can be passed on
+ * without copying; see g_omx_port_take_peer_buffer(). One more buffer of
+ * its own is kept for anything else. Must be called while @port is Loaded.
+ */
+gboolean
+g_omx_port_share_peer (GOmxPort * port, GOmxPort * peer)
+{
+  OMX_PARAM_PORTDEFINITIONTYPE param;
+
+  if (port->type != GOMX_PORT_INPUT || peer->type != GOMX_PORT_OUTPUT)
+    return FALSE;
+
+  if (port->core->omx_state != OMX_StateLoaded || port->omx_allocate)
+    return FALSE;
+
+  if (!peer->omx_allocate || !peer->buffers || !peer->buffers[0])
+    return FALSE;
+
+  if (port->buffer_size > peer->buffer_size) {
+    GST_INFO_OBJECT (port->core->object,
+        "peer buffers too small: %lu < %lu", peer->buffer_size,
+        port->buffer_size);
+    return FALSE;
+  }
+
+  G_OMX_INIT_PARAM (param);
+
+  param.nPortIndex = port->port_index;
+  OMX_GetParameter (port->core->omx_handle, OMX_IndexParamPortDefinition,
+      &param);
+
+  param.nBufferCountActual = peer->num_buffers + 1;
+  OMX_SetParameter (port->core->omx_handle, OMX_IndexParamPortDefinition,
+      &param);
+
+  g_omx_port_setup (port);
+
+  if (port->num_buffers != peer->num_buffers + 1) {
+    GST_INFO_OBJECT (port->core->object, "%u buffers refused",
+        peer->num_buffers + 1);
+    return FALSE;
+  }
+
+  port_unlink_peer (port);
+  port->peer = g_omx_port_ref (peer);
+  port->allocator = &peer_allocator;
+  peer->shared = TRUE;
+
+  GST_INFO_OBJECT (port->core->object, "port %u: sharing %u peer buffers",
+      port->port_index, peer->num_buffers);
+
+  return TRUE;
+}
+
+/* Returns FALSE if some buffer couldn't be had; none is left then. */
+static gboolean
 port_allocate_buffers (GOmxPort * port)
 {
   guint i;
   gsize size;
+  gint64 start, mem_time;
+
+  /* the components exchange the buffers on their own */
+  if (port->tunnel)
+    return TRUE;
 
   size = port->buffer_size;
+  start = g_get_monotonic_time ();
+
+  /* Get all the memory first, so the component sees back to back
+   * requests instead of waiting on page faults in between. */
+  if (!port->omx_allocate) {
+    for (i = 0; i < port->num_buffers; i++) {
+      GOmxBufferMem *mem;
+
+      mem = &port->mem[i];
+      mem->allocator = port->allocator ? port->allocator : &default_allocator;
+      mem->data = mem->allocator->alloc (port, size, &mem->priv);
+
+      if (G_UNLIKELY (!mem->data)) {
+        GST_ERROR_OBJECT (port->core->object,
+            "%d: failed to allocate %" G_GSIZE_FORMAT " bytes", i, size);
+        goto fail;
+      }
+    }
+  }
+
+  mem_time = g_get_monotonic_time () - start;
 
   for (i = 0; i < port->num_buffers; i++) {
+    OMX_ERRORTYPE error;
+
     if (port->omx_allocate) {
       GST_DEBUG_OBJECT (port->core->object,
           "%d: OMX_AllocateBuffer(), size=%" G_GSIZE_FORMAT, i, size);
-      OMX_AllocateBuffer (port->core->omx_handle, &port->buffers[i],
+      error = OMX_AllocateBuffer (port->core->omx_handle, &port->buffers[i],
           port->port_index, NULL, size);
     } else {
-      gpointer buffer_data;
-      buffer_data = g_malloc (size);
       GST_DEBUG_OBJECT (port->core->object,
           "%d: OMX_UseBuffer(), size=%" G_GSIZE_FORMAT, i, size);
-      OMX_UseBuffer (port->core->omx_handle, &port->buffers[i],
-          port->port_index, NULL, size, buffer_data);
+      error = OMX_UseBuffer (port->core->omx_handle, &port->buffers[i],
+          port->port_index, NULL, size, port->mem[i].data);
+    }
+
+    if (G_UNLIKELY (error != OMX_ErrorNone || !port->buffers[i])) {
+      GST_ERROR_OBJECT (port->core->object,
+          "%d: failed to populate port %u: %s (0x%08x)", i, port->port_index,
+          omx_error_to_str (error), error);
+      port->buffers[i] = NULL;
+      goto fail;
+    }
+  }
+
+  port->populate_time = g_get_monotonic_time () - start;
+
+  GST_INFO_OBJECT (port->core->object,
+      "port %u: %u buffers populated in %" G_GINT64_FORMAT " us "
+      "(memory: %" G_GINT64_FORMAT " us)", port->port_index,
+      port->num_buffers, port->populate_time, mem_time);
+
+  return TRUE;
+
+fail:
+  port_free_headers (port);
+
+  return FALSE;
+}
+
+static inline gint
+port_get_index (GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer)
+{
+  guint i;
+
+  for (i = 0; i < port->num_buffers; i++) {
+    if (port->buffers[i] == omx_buffer)
+      return i;
+  }
+
+  return -1;
+}
+
+static inline GOmxAttachedData *
+port_get_attached (GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer)
+{
+  gint i;
+
+  i = port_get_index (port, omx_buffer);
+
+  return i >= 0 ? &port->attached[i] : NULL;
+}
+
+/* Gives the header its own memory back, once the component is done. */
+static inline void
+port_detach_data (GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer)
+{
+  GOmxAttachedData *attached;
+  GDestroyNotify notify;
+
+  attached = port_get_attached (port, omx_buffer);
+  if (!attached || !attached->notify)
+    return;
+
+  omx_buffer->pBuffer = attached->data;
+  omx_buffer->nAllocLen = attached->alloc_len;
+  omx_buffer->nOffset = attached->offset;
+
+  notify = attached->notify;
+  attached->notify = NULL;
+  notify (attached->user_data);
+}
+
+/**
+ * Gets the header of @port that shares its memory with @peer_buffer, a
+ * buffer of its peer that was handed out along with @user_data; @notify
+ * is called on that once the component is done with it. Returns NULL if
+ * the memory isn't shared; the data is left as is, so the caller has to
+ * set the offset and length.
+ */
+OMX_BUFFERHEADERTYPE *
+g_omx_port_take_peer_buffer (GOmxPort * port,
+    OMX_BUFFERHEADERTYPE * peer_buffer, GDestroyNotify notify,
+    gpointer user_data)
+{
+  OMX_BUFFERHEADERTYPE *omx_buffer;
+  GOmxAttachedData *attached;
+  guint i;
+
+  if (!port->peer)
+    return NULL;
+
+  for (i = 0; i < port->num_buffers; i++) {
+    if (port_is_peer_buffer (port, i) &&
+        port->mem[i].data == peer_buffer->pBuffer)
+      break;
+  }
+
+  if (i == port->num_buffers || !port->buffers[i])
+    return NULL;
+
+  /* the peer might have reallocated, and got the same address */
+  if (peer_buffer->nAllocLen > port->buffers[i]->nAllocLen)
+    return NULL;
+
+  omx_buffer = port->buffers[i];
+  port_detach_data (port, omx_buffer);
+
+  attached = &port->attached[i];
+  attached->data = omx_buffer->pBuffer;
+  attached->alloc_len = omx_buffer->nAllocLen;
+  attached->offset = omx_buffer->nOffset;
+  attached->notify = notify;
+  attached->user_data = user_data;
+
+  omx_buffer->nFlags = 0;
+
+  return omx_buffer;
+}
+
+/* Waits until no header of @port is downstream; returns FALSE if some
+ * still are at @end_time. */
+static gboolean
+port_wait_lent (GOmxPort * port, gint64 end_time)
+{
+  gboolean ret = TRUE;
+
+  g_mutex_lock (port->mutex);
+  while (port->lent > 0) {
+    if (!g_sem_cond_wait_until (port->lent_cond, port->mutex, end_time) &&
+        port->lent > 0) {
+      ret = FALSE;
+      break;
+    }
+  }
+  g_mutex_unlock (port->mutex);
+
+  return ret;
+}
+
+/* Waits until the component has given back all the headers of @port;
+ * returns FALSE if it still has some at @end_time. */
+static gboolean
+port_wait_held (GOmxPort * port, gint64 end_time)
+{
+  gboolean ret = TRUE;
+
+  g_mutex_lock (port->mutex);
+  while (g_atomic_int_get (&port->held) > 0) {
+    if (!g_sem_cond_wait_until (port->lent_cond, port->mutex, end_time) &&
+        g_atomic_int_get (&port->held) > 0) {
+      ret = FALSE;
+      break;
     }
   }
+  g_mutex_unlock (port->mutex);
+
+  return ret;
 }
 
 static void
 port_free_buffers (GOmxPort * port)
+{
+  gint64 end_time;
+
+  if (port->tunnel)
+    return;
+
+  /* the headers must not go away under buffers that are still downstream,
+   * but don't hang forever on a sink that keeps its last buffer */
+  end_time = g_omx_core_get_deadline (port->core);
+  if (end_time < 0)
+    end_time = g_get_monotonic_time () + LENT_TIMEOUT;
+
+  if (!port_wait_lent (port, end_time))
+    GST_WARNING_OBJECT (port->core->object,
+        "port %d: %u buffers still in use", port->port_index, port->lent);
+
+  /* the buffers still downstream keep our memory, or get a copy */
+  port_orphan_lent (port);
+
+  /* whatever came back is about to be freed */
+  async_queue_flush (port->queue);
+
+  port_free_headers (port);
+
+  /* whatever the component didn't give back is gone anyway */
+  g_atomic_int_set (&port->held, 0);
+}
+
+/* Frees the headers, and the memory we allocated for them. */
+static void
+port_free_headers (GOmxPort * port)
 {
   guint i;
 
@@ -557,34 +1746,49 @@ port_free_buffers (GOmxPort * port)
     omx_buffer = port->buffers[i];
 
     if (omx_buffer) {
-#if 0
-            /** @todo how shall we free that buffer? */
-      if (!port->omx_allocate) {
-        g_free (omx_buffer->pBuffer);
-        omx_buffer->pBuffer = NULL;
-      }
-#endif
+      port_detach_data (port, omx_buffer);
 
       OMX_FreeBuffer (port->core->omx_handle, port->port_index, omx_buffer);
       port->buffers[i] = NULL;
     }
+
+    /* pBuffer might have been swapped, so free what we allocated */
+    if (port->mem[i].data) {
+      GOmxBufferMem *mem = &port->mem[i];
+
+      mem->allocator->free (port, mem->data, mem->priv);
+      mem->data = NULL;
+    }
   }
 }
 
 static void
 port_start_buffers (GOmxPort * port)
+{
+  port_start_buffers_from (port, 0);
+}
+
+/* Like port_start_buffers(), leaving out the headers before @first. */
+static void
+port_start_buffers_from (GOmxPort * port, guint first)
 {
   guint i;
 
-  for (i = 0; i < port->num_buffers; i++) {
+  if (port->tunnel)
+    return;
+
+  for (i = first; i < port->num_buffers; i++) {
     OMX_BUFFERHEADERTYPE *omx_buffer;
 
     omx_buffer = port->buffers[i];
 
+    if (G_UNLIKELY (!omx_buffer) || port_is_peer_buffer (port, i))
+      continue;
+
     /* If it's an input port we will need to fill the buffer, so put it in
      * the queue, otherwise send to omx for processing (fill it up). */
     if (port->type == GOMX_PORT_INPUT)
-      got_buffer (port->core, port, omx_buffer);
+      g_omx_port_push_buffer (port, omx_buffer);
     else
       g_omx_port_release_buffer (port, omx_buffer);
   }
@@ -602,9 +1806,48 @@ g_omx_port_request_buffer (GOmxPort * port)
   return async_queue_pop (port->queue);
 }
 
+OMX_BUFFERHEADERTYPE *
+g_omx_port_request_buffer_until (GOmxPort * port,
+    gint64 end_time, gboolean * timed_out)
+{
+  return async_queue_pop_until (port->queue, end_time, timed_out);
+}
+
+/**
+ * Returns a file descriptor that polls readable when the port might have
+ * buffers ready, see async_queue_get_fd().
+ */
+gint
+g_omx_port_get_fd (GOmxPort * port)
+{
+  return async_queue_get_fd (port->queue);
+}
+
+/**
+ * Like g_omx_port_request_buffer(), but returns every ready buffer (up to
+ * @max) at once.
+ */
+guint
+g_omx_port_request_buffers (GOmxPort * port,
+    OMX_BUFFERHEADERTYPE ** omx_buffers, guint max)
+{
+  return async_queue_pop_many (port->queue, (gpointer *) omx_buffers, max);
+}
+
+guint
+g_omx_port_request_buffers_until (GOmxPort * port,
+    OMX_BUFFERHEADERTYPE ** omx_buffers, guint max,
+    gint64 end_time, gboolean * timed_out)
+{
+  return async_queue_pop_many_until (port->queue, (gpointer *) omx_buffers,
+      max, end_time, timed_out);
+}
+
 void
 g_omx_port_release_buffer (GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer)
 {
+  g_atomic_int_inc (&port->held);
+
   switch (port->type) {
     case GOMX_PORT_INPUT:
       OMX_EmptyThisBuffer (port->core->omx_handle, omx_buffer);
@@ -617,6 +1860,208 @@ g_omx_port_release_buffer (GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer)
   }
 }
 
+/**
+ * Returns the memory allocated for @omx_buffer by the port, whatever
+ * pBuffer currently points to, or NULL if the component allocated it.
+ */
+gpointer
+g_omx_port_get_buffer_data (GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer)
+{
+  gint i;
+
+  i = port_get_index (port, omx_buffer);
+
+  return i >= 0 ? port->mem[i].data : NULL;
+}
+
+/**
+ * Points @omx_buffer at @size bytes of @data instead of copying them in.
+ * Once the component has emptied it, the header gets its own memory back
+ * and @notify is called with @user_data. Only valid for ports set up with
+ * OMX_UseBuffer, and @size must fit port->buffer_size.
+ */
+void
+g_omx_port_attach_data (GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer,
+    gpointer data, guint size, GDestroyNotify notify, gpointer user_data)
+{
+  GOmxAttachedData *attached;
+
+  attached = port_get_attached (port, omx_buffer);
+  g_return_if_fail (attached != NULL);
+
+  /* not sent yet; drop whatever was attached before */
+  port_detach_data (port, omx_buffer);
+
+  attached->data = omx_buffer->pBuffer;
+  attached->alloc_len = omx_buffer->nAllocLen;
+  attached->offset = omx_buffer->nOffset;
+  attached->notify = notify;
+  attached->user_data = user_data;
+
+  omx_buffer->pBuffer = data;
+  omx_buffer->nAllocLen = size;
+  omx_buffer->nOffset = 0;
+  omx_buffer->nFilledLen = size;
+}
+
+/**
+ * Accounts for @omx_buffer being handed out wrapped in the GstBuffer
+ * @buffer, see g_omx_port_return_buffer(). Returns the generation of the
+ * buffers of @port, to be handed back along with the header.
+ */
+guint
+g_omx_port_lend_buffer (GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer,
+    gpointer buffer)
+{
+  guint generation;
+  gint i;
+
+  g_mutex_lock (port->mutex);
+  i = port_get_index (port, omx_buffer);
+  if (i >= 0) {
+    port->mem[i].lent = TRUE;
+    port->mem[i].lent_buffer = buffer;
+  }
+  port->lent++;
+  generation = port->generation;
+  g_mutex_unlock (port->mutex);
+
+  return generation;
+}
+
+/* Gives @buf a copy of its data, for memory that goes along with the
+ * header; port->mutex is held, so it isn't being returned meanwhile. */
+static void
+port_copy_lent (GOmxPort * port, GstBuffer * buf)
+{
+  guint8 *copy;
+
+  GST_DEBUG_OBJECT (port->core->object, "port %d: copying out %u bytes",
+      port->port_index, GST_BUFFER_SIZE (buf));
+
+  copy = g_memdup (GST_BUFFER_DATA (buf), GST_BUFFER_SIZE (buf));
+  GST_BUFFER_MALLOCDATA (buf) = copy;
+  GST_BUFFER_DATA (buf) = copy;
+}
+
+/* Detaches the lent headers from the memory of the port, so it isn't freed
+ * along with them; it goes when the buffers wrapping it do. Memory the
+ * component allocated can't stay, so the buffers get a copy instead. Waits
+ * for the ones that are being returned right now. */
+static void
+port_orphan_lent (GOmxPort * port)
+{
+  guint i;
+
+  g_mutex_lock (port->mutex);
+
+  while (port->returning > 0)
+    g_cond_wait (port->lent_cond, port->mutex);
+
+  if (port->lent > 0) {
+    for (i = 0; i < port->num_buffers; i++) {
+      PortOrphan *orphan;
+
+      if (!port->mem[i].lent)
+        continue;
+
+      if (port->omx_allocate && port->mem[i].lent_buffer)
+        port_copy_lent (port, port->mem[i].lent_buffer);
+
+      orphan = g_slice_new (PortOrphan);
+      orphan->omx_buffer = port->buffers[i];
+      orphan->generation = port->generation;
+      orphan->mem = port->mem[i];
+      port->orphans = g_slist_prepend (port->orphans, orphan);
+
+      port->mem[i].data = NULL;
+      port->mem[i].lent = FALSE;
+      port->mem[i].lent_buffer = NULL;
+    }
+
+    port->lent = 0;
+  }
+
+  port->generation++;
+
+  g_mutex_unlock (port->mutex);
+}
+
+/* Takes the memory left behind by @omx_buffer of an older generation. */
+static PortOrphan *
+port_take_orphan (GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer,
+    guint generation)
+{
+  GSList *l;
+
+  for (l = port->orphans; l; l = l->next) {
+    PortOrphan *orphan = l->data;
+
+    if (orphan->omx_buffer == omx_buffer &&
+        orphan->generation == generation) {
+      port->orphans = g_slist_delete_link (port->orphans, l);
+      return orphan;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Gives back a header lent with g_omx_port_lend_buffer(). It goes straight
+ * to the component while the port is running; otherwise it's queued, so
+ * that a flush sends it back, or the port can free it. If the buffers were
+ * freed since @generation, the header is gone, and only the memory it left
+ * behind is released; the core isn't touched, it might be gone as well.
+ */
+void
+g_omx_port_return_buffer (GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer,
+    guint generation)
+{
+  OMX_STATETYPE state;
+  gint i;
+
+  g_mutex_lock (port->mutex);
+
+  if (G_UNLIKELY (generation != port->generation)) {
+    PortOrphan *orphan;
+
+    orphan = port_take_orphan (port, omx_buffer, generation);
+    g_mutex_unlock (port->mutex);
+
+    if (orphan) {
+      if (orphan->mem.data)
+        orphan->mem.allocator->free (port, orphan->mem.data, orphan->mem.priv);
+      g_slice_free (PortOrphan, orphan);
+    }
+    return;
+  }
+
+  port->returning++;
+  g_mutex_unlock (port->mutex);
+
+  omx_buffer->nFilledLen = 0;
+
+  state = port->core->omx_state;
+
+  if (port->enabled && g_atomic_int_get (&port->queue->enabled) &&
+      (state == OMX_StateExecuting || state == OMX_StatePause))
+    g_omx_port_release_buffer (port, omx_buffer);
+  else
+    g_omx_port_push_buffer (port, omx_buffer);
+
+  g_mutex_lock (port->mutex);
+  i = port_get_index (port, omx_buffer);
+  if (i >= 0) {
+    port->mem[i].lent = FALSE;
+    port->mem[i].lent_buffer = NULL;
+  }
+  port->returning--;
+  if (--port->lent == 0 || port->returning == 0)
+    g_cond_broadcast (port->lent_cond);
+  g_mutex_unlock (port->mutex);
+}
+
 void
 g_omx_port_resume (GOmxPort * port)
 {
@@ -641,41 +2086,177 @@ g_omx_port_flush (GOmxPort * port)
   } else {
     OMX_SendCommand (port->core->omx_handle, OMX_CommandFlush, port->port_index,
         NULL);
-    g_sem_down (port->core->flush_sem);
+    if (!g_sem_down_until (port->core->flush_sem,
+            g_omx_core_get_deadline (port->core)))
+      GST_WARNING_OBJECT (port->core->object, "timed out flushing port %d",
+          port->port_index);
   }
 }
 
-void
+/**
+ * Populates the disabled @port again, and once the component is done,
+ * hands the buffers out as g_omx_core_start() does; in Loaded the port is
+ * only enabled, and g_omx_core_prepare() populates it. Returns FALSE if
+ * the component didn't complete in time.
+ */
+gboolean
 g_omx_port_enable (GOmxPort * port)
+{
+  return port_enable (port, NULL);
+}
+
+/* Copies the output the component gave back before the port got disabled,
+ * to hand it out again once there are headers for it. */
+static void
+port_take_output (GOmxPort * port, GQueue * carried)
+{
+  OMX_BUFFERHEADERTYPE *omx_buffer;
+
+  if (port->type != GOMX_PORT_OUTPUT)
+    return;
+
+  while ((omx_buffer = async_queue_pop_forced (port->queue))) {
+    OMX_BUFFERHEADERTYPE *copy;
+
+    if (omx_buffer->nFilledLen == 0 &&
+        !(omx_buffer->nFlags & OMX_BUFFERFLAG_EOS))
+      continue;
+
+    copy = g_memdup (omx_buffer, sizeof (*omx_buffer));
+    copy->pBuffer = g_memdup (omx_buffer->pBuffer + omx_buffer->nOffset,
+        omx_buffer->nFilledLen);
+    copy->nOffset = 0;
+    g_queue_push_tail (carried, copy);
+  }
+}
+
+static void
+port_free_carried (gpointer data, gpointer user_data)
+{
+  OMX_BUFFERHEADERTYPE *copy = data;
+
+  g_free (copy->pBuffer);
+  g_free (copy);
+}
+
+/* Puts the output taken by port_take_output() into the first headers and
+ * queues them, as if the component had just returned them; returns how
+ * many headers were used. */
+static guint
+port_restore_output (GOmxPort * port, GQueue * carried)
+{
+  OMX_BUFFERHEADERTYPE *copy;
+  guint i = 0;
+
+  while ((copy = g_queue_pop_head (carried))) {
+    OMX_BUFFERHEADERTYPE *omx_buffer = NULL;
+
+    if (i < port->num_buffers)
+      omx_buffer = port->buffers[i];
+
+    if (omx_buffer && !port_is_peer_buffer (port, i) &&
+        copy->nFilledLen <= omx_buffer->nAllocLen) {
+      memcpy (omx_buffer->pBuffer, copy->pBuffer, copy->nFilledLen);
+      omx_buffer->nOffset = 0;
+      omx_buffer->nFilledLen = copy->nFilledLen;
+      omx_buffer->nFlags = copy->nFlags;
+      omx_buffer->nTimeStamp = copy->nTimeStamp;
+      omx_buffer->nTickCount = copy->nTickCount;
+      g_omx_port_push_buffer (port, omx_buffer);
+      i++;
+    } else {
+      GST_WARNING_OBJECT (port->core->object,
+          "port %d: no room for output of %lu bytes, dropping",
+          port->port_index, (gulong) copy->nFilledLen);
+    }
+
+    port_free_carried (copy, NULL);
+  }
+
+  return i;
+}
+
+static gboolean
+port_enable (GOmxPort * port, GQueue * carried)
 {
   GOmxCore *core;
+  guint first = 0;
 
   core = port->core;
 
   OMX_SendCommand (core->omx_handle, OMX_CommandPortEnable, port->port_index,
       NULL);
-  port_allocate_buffers (port);
-  if (core->omx_state != OMX_StateLoaded)
-    port_start_buffers (port);
+
+  /* in Loaded the buffers come with the move to Idle */
+  if (core->omx_state != OMX_StateLoaded && !port_allocate_buffers (port)) {
+    core->omx_error = OMX_ErrorInsufficientResources;
+    return FALSE;
+  }
+
+  if (!g_sem_down_until (port->sem, g_omx_core_get_deadline (core))) {
+    GST_WARNING_OBJECT (core->object, "timed out enabling port %d",
+        port->port_index);
+    return FALSE;
+  }
+
+  port->enabled = TRUE;
+  if (core->omx_state != OMX_StateLoaded) {
+    if (carried)
+      first = port_restore_output (port, carried);
+    port_start_buffers_from (port, first);
+  }
   g_omx_port_resume (port);
 
-  g_sem_down (core->port_sem);
+  return TRUE;
 }
 
-void
+/**
+ * Takes the buffers of @port away from the component and frees them. None
+ * goes back to the component meanwhile: the ones it returns are dropped,
+ * and the ones the caller or downstream hold must be given back before.
+ * Returns FALSE if the component didn't complete in time.
+ */
+gboolean
 g_omx_port_disable (GOmxPort * port)
+{
+  return port_disable (port, NULL);
+}
+
+static gboolean
+port_disable (GOmxPort * port, GQueue * carried)
 {
   GOmxCore *core;
+  gint64 end_time;
+  gboolean ret = TRUE;
 
   core = port->core;
+  end_time = g_omx_core_get_deadline (core);
+
+  g_omx_port_pause (port);
+  port->enabled = FALSE;
 
   OMX_SendCommand (core->omx_handle, OMX_CommandPortDisable, port->port_index,
       NULL);
-  g_omx_port_pause (port);
-  g_omx_port_flush (port);
+
+  /* it can only complete once all of them are back, and freed */
+  if (!port_wait_held (port, end_time)) {
+    GST_WARNING_OBJECT (core->object, "port %d: %d buffers not returned",
+        port->port_index, g_atomic_int_get (&port->held));
+    ret = FALSE;
+  }
+
+  if (carried)
+    port_take_output (port, carried);
+
   port_free_buffers (port);
 
-  g_sem_down (core->port_sem);
+  if (!g_sem_down_until (port->sem, end_time)) {
+    GST_WARNING_OBJECT (core->object, "timed out disabling port %d",
+        port->port_index);
+    ret = FALSE;
+  }
+
+  return ret;
 }
 
 void
@@ -685,6 +2266,149 @@ g_omx_port_finish (GOmxPort * port)
   async_queue_disable (port->queue);
 }
 
+/**
+ * Asks for @count buffers on @port, or as many as the component needs at
+ * least. Only while the port is disabled or the component Loaded; the
+ * port has to be set up again afterwards. Returns the resulting count.
+ */
+guint
+g_omx_port_set_buffer_count (GOmxPort * port, guint count)
+{
+  OMX_PARAM_PORTDEFINITIONTYPE param;
+  OMX_HANDLETYPE omx_handle;
+
+  omx_handle = port->core->omx_handle;
+
+  G_OMX_INIT_PARAM (param);
+
+  param.nPortIndex = port->port_index;
+  OMX_GetParameter (omx_handle, OMX_IndexParamPortDefinition, &param);
+
+  param.nBufferCountActual = MAX (count, param.nBufferCountMin);
+  OMX_SetParameter (omx_handle, OMX_IndexParamPortDefinition, &param);
+
+  OMX_GetParameter (omx_handle, OMX_IndexParamPortDefinition, &param);
+
+  return param.nBufferCountActual;
+}
+
+/* Whether the new settings of the component don't fit the buffers. */
+static gboolean
+port_needs_realloc (GOmxPort * port)
+{
+  OMX_PARAM_PORTDEFINITIONTYPE param;
+
+  G_OMX_INIT_PARAM (param);
+
+  param.nPortIndex = port->port_index;
+  OMX_GetParameter (port->core->omx_handle, OMX_IndexParamPortDefinition,
+      &param);
+
+  return param.nBufferSize > port->buffer_size ||
+      param.nBufferCountMin > port->num_buffers;
+}
+
+/**
+ * Reallocates the buffers of @port for the settings the component changed
+ * to, through a disable and enable of the port only; the other ports keep
+ * going meanwhile. The owner must have taken whatever was in the queue.
+ * Buffers still downstream are waited for a while, then left with the old
+ * memory, as when the port is freed. Returns FALSE, with omx_error set, if
+ * the component didn't complete.
+ */
+gboolean
+g_omx_port_reconfigure (GOmxPort * port)
+{
+  GOmxCore *core;
+  gulong old_size;
+
+  core = port->core;
+  old_size = port->buffer_size;
+
+  if (!g_omx_port_disable (port)) {
+    GST_ERROR_OBJECT (core->object, "port %u: couldn't be disabled",
+        port->port_index);
+    core->omx_error = OMX_ErrorTimeout;
+    return FALSE;
+  }
+
+  g_omx_port_set_buffer_count (port, port->num_buffers);
+  g_omx_port_setup (port);
+  g_atomic_int_set (&port->reconfigure, FALSE);
+
+  if (!g_omx_port_enable (port)) {
+    GST_ERROR_OBJECT (core->object, "port %u: couldn't be enabled",
+        port->port_index);
+    core->omx_error = OMX_ErrorTimeout;
+    return FALSE;
+  }
+
+  GST_INFO_OBJECT (port->core->object,
+      "port %u reconfigured: %u buffers of %lu bytes (was %lu)",
+      port->port_index, port->num_buffers, port->buffer_size, old_size);
+
+  return TRUE;
+}
+
+/**
+ * Whether the settings of @port changed since the last call, for owners
+ * that set poll_settings; cheap enough to be checked on every buffer. It
+ * starts out TRUE every time the port is set up.
+ */
+gboolean
+g_omx_port_settings_changed (GOmxPort * port)
+{
+  if (G_LIKELY (!g_atomic_int_get (&port->settings_changed)))
+    return FALSE;
+
+  return g_atomic_int_compare_and_exchange (&port->settings_changed, TRUE,
+      FALSE);
+}
+
+/**
+ * Changes the number of buffers of a running port through a disable and
+ * enable of the port; none of its buffers may be held by the caller.
+ * Output the component gave back meanwhile is queued again first.
+ * Ports whose memory is used elsewhere are left alone: the ones with
+ * buffers downstream, sharing memory with a peer, or tunneled.
+ */
+gboolean
+g_omx_port_resize (GOmxPort * port, guint count)
+{
+  GQueue *carried;
+  guint old_count;
+  guint lent;
+
+  g_mutex_lock (port->mutex);
+  lent = port->lent;
+  g_mutex_unlock (port->mutex);
+
+  if (lent > 0 || port->peer || port->shared || port->tunnel) {
+    GST_DEBUG_OBJECT (port->core->object,
+        "port %u: memory in use elsewhere, not resizing", port->port_index);
+    return FALSE;
+  }
+
+  old_count = port->num_buffers;
+  carried = g_queue_new ();
+
+  if (!port_disable (port, carried))
+    port->core->omx_error = OMX_ErrorTimeout;
+  g_omx_port_set_buffer_count (port, count);
+  g_omx_port_setup (port);
+  if (!port_enable (port, carried))
+    port->core->omx_error = OMX_ErrorTimeout;
+
+  /* left over if the port didn't come back */
+  g_queue_foreach (carried, port_free_carried, NULL);
+  g_queue_free (carried);
+
+  GST_INFO_OBJECT (port->core->object, "port %u: %u -> %u buffers",
+      port->port_index, old_count, port->num_buffers);
+
+  return port->num_buffers == count;
+}
+
 /*
  * Helper functions.
  */
@@ -711,26 +2435,20 @@ complete_change_state (GOmxCore * core, OMX_STATETYPE state)
 static inline void
 wait_for_state (GOmxCore * core, OMX_STATETYPE state)
 {
-  GTimeVal tv;
-  gboolean signaled;
-
-  g_mutex_lock (core->omx_state_mutex);
-
-  if (core->omx_error != OMX_ErrorNone)
-    goto leave;
+  gint64 end_time;
 
-  g_get_current_time (&tv);
-  g_time_val_add (&tv, 15 * G_USEC_PER_SEC);
+  end_time = g_omx_core_get_deadline (core);
+  if (end_time < 0)
+    end_time = g_get_monotonic_time () + STATE_TIMEOUT;
 
-  /* try once */
-  if (core->omx_state != state) {
-    signaled =
-        g_cond_timed_wait (core->omx_state_condition, core->omx_state_mutex,
-        &tv);
+  g_mutex_lock (core->omx_state_mutex);
 
-    if (!signaled) {
+  while (core->omx_state != state && core->omx_error == OMX_ErrorNone) {
+    if (!g_sem_cond_wait_until (core->omx_state_condition,
+            core->omx_state_mutex, end_time) && core->omx_state != state) {
       GST_ERROR_OBJECT (core->object, "timed out switching from '%s' to '%s'",
           omx_state_to_str (core->omx_state), omx_state_to_str (state));
+      break;
     }
   }
 
@@ -783,6 +2501,26 @@ got_buffer (GOmxCore * core, GOmxPort * port, OMX_BUFFERHEADERTYPE * omx_buffer)
   }
 
   if (G_LIKELY (port)) {
+    if (g_atomic_int_dec_and_test (&port->held)) {
+      /* a disable might be waiting for it */
+      g_mutex_lock (port->mutex);
+      g_cond_broadcast (port->lent_cond);
+      g_mutex_unlock (port->mutex);
+    }
+
+    if (port->type == GOMX_PORT_INPUT) {
+      port_detach_data (port, omx_buffer);
+
+      /* the memory is back with the peer */
+      if (G_UNLIKELY (port->peer)) {
+        gint i;
+
+        i = port_get_index (port, omx_buffer);
+        if (i >= 0 && port_is_peer_buffer (port, i))
+          return;
+      }
+    }
+
     g_omx_port_push_buffer (port, omx_buffer);
 
     switch (port->type) {
@@ -809,7 +2547,9 @@ EventHandler (OMX_HANDLETYPE omx_handle,
 {
   GOmxCore *core;
 
-  core = (GOmxCore *) app_data;
+  core = handle_ref_core (app_data);
+  if (G_UNLIKELY (!core))
+    return OMX_ErrorNone;
 
   switch (event) {
     case OMX_EventCmdComplete:
@@ -829,7 +2569,14 @@ EventHandler (OMX_HANDLETYPE omx_handle,
           break;
         case OMX_CommandPortDisable:
         case OMX_CommandPortEnable:
-          g_sem_up (core->port_sem);
+        {
+          GOmxPort *port;
+
+          port = get_port (core, data_2);
+          if (port)
+            g_sem_up (port->sem);
+          break;
+        }
         default:
           break;
       }
@@ -845,9 +2592,24 @@ EventHandler (OMX_HANDLETYPE omx_handle,
     }
     case OMX_EventPortSettingsChanged:
     {
+      GOmxPort *port;
+
       GST_DEBUG_OBJECT (core->object, "OMX_EventPortSettingsChanged");
-                /** @todo only on the relevant port. */
-      if (core->settings_changed_cb) {
+
+      port = get_port (core, data_1);
+      if (port && port->reconfigurable && !port->tunnel &&
+          port_needs_realloc (port)) {
+        /* wake the owner up; it's not going to get anything meanwhile */
+        g_atomic_int_set (&port->reconfigure, TRUE);
+        g_omx_port_pause (port);
+        break;
+      }
+
+      if (port && port->poll_settings) {
+        /* the owner picks them up along with the next buffer */
+        g_atomic_int_set (&port->settings_changed, TRUE);
+      } else if ((!port || port->type == GOMX_PORT_OUTPUT) &&
+          core->settings_changed_cb) {
         core->settings_changed_cb (core);
       }
       break;
@@ -869,6 +2631,8 @@ EventHandler (OMX_HANDLETYPE omx_handle,
       break;
   }
 
+  handle_unref_core (app_data);
+
   return OMX_ErrorNone;
 }
 
@@ -879,13 +2643,17 @@ EmptyBufferDone (OMX_HANDLETYPE omx_handle,
   GOmxCore *core;
   GOmxPort *port;
 
-  core = (GOmxCore *) app_data;
+  core = handle_ref_core (app_data);
+  if (G_UNLIKELY (!core))
+    return OMX_ErrorNone;
   port = get_port (core, omx_buffer->nInputPortIndex);
 
   GST_CAT_LOG_OBJECT (gstomx_util_debug, core->object, "omx_buffer=%p",
       omx_buffer);
   got_buffer (core, port, omx_buffer);
 
+  handle_unref_core (app_data);
+
   return OMX_ErrorNone;
 }
 
@@ -896,13 +2664,17 @@ FillBufferDone (OMX_HANDLETYPE omx_handle,
   GOmxCore *core;
   GOmxPort *port;
 
-  core = (GOmxCore *) app_data;
+  core = handle_ref_core (app_data);
+  if (G_UNLIKELY (!core))
+    return OMX_ErrorNone;
   port = get_port (core, omx_buffer->nOutputPortIndex);
 
   GST_CAT_LOG_OBJECT (gstomx_util_debug, core->object, "omx_buffer=%p",
       omx_buffer);
   got_buffer (core, port, omx_buffer);
 
+  handle_unref_core (app_data);
+
   return OMX_ErrorNone;
 }
 
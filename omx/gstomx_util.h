@@ -29,17 +29,24 @@
 
 #include <async_queue.h>
 #include <sem.h>
+#include <mem.h>
 
 /* Typedefs. */
 
 typedef struct GOmxCore GOmxCore;
 typedef struct GOmxPort GOmxPort;
 typedef struct GOmxImp GOmxImp;
+typedef struct GOmxHandle GOmxHandle;
 typedef struct GOmxSymbolTable GOmxSymbolTable;
+typedef struct GOmxAttachedData GOmxAttachedData;
+typedef struct GOmxAllocator GOmxAllocator;
+typedef struct GOmxBufferMem GOmxBufferMem;
 typedef enum GOmxPortType GOmxPortType;
 
 typedef void (*GOmxCb) (GOmxCore * core);
 typedef void (*GOmxPortCb) (GOmxPort * port);
+typedef void (*GOmxStateCb) (GOmxCore * core, OMX_STATETYPE state,
+    gpointer user_data);
 
 /* Enums. */
 
@@ -58,6 +65,8 @@ struct GOmxSymbolTable
   OMX_ERRORTYPE (*get_handle) (OMX_HANDLETYPE * handle,
       OMX_STRING name, OMX_PTR data, OMX_CALLBACKTYPE * callbacks);
   OMX_ERRORTYPE (*free_handle) (OMX_HANDLETYPE handle);
+  OMX_ERRORTYPE (*setup_tunnel) (OMX_HANDLETYPE output, OMX_U32 port_output,
+      OMX_HANDLETYPE input, OMX_U32 port_input);
 };
 
 struct GOmxImp
@@ -66,6 +75,22 @@ struct GOmxImp
   void *dl_handle;
   GOmxSymbolTable sym_table;
   GMutex *mutex;
+  MemPool *pool;   /**< Buffer memory shared by all the clients. */
+  GHashTable *handle_pools;   /**< Idle handles, by component name. */
+};
+
+/**
+ * What the component gets as application data, so a handle can outlive the
+ * core that got it and be reused by another one.
+ */
+struct GOmxHandle
+{
+  OMX_HANDLETYPE omx_handle;
+  GMutex *lock;
+  GCond *cond;
+  GOmxCore *core;   /**< NULL while idle. */
+  guint calls;   /**< Callbacks using the core. */
+  GSList *defaults;   /**< The params as first loaded, if pooled. */
 };
 
 struct GOmxCore
@@ -83,20 +108,61 @@ struct GOmxCore
 
   GSem *done_sem;
   GSem *flush_sem;
-  GSem *port_sem;
 
   GOmxCb settings_changed_cb;
   GOmxImp *imp;
+  GOmxHandle *handle;
+
+  GThreadPool *state_pool;   /**< Runs asynchronous transitions in order. */
+  OMX_STATETYPE target_state;   /**< Where the queued transitions lead. */
+  guint pending_transitions;
+  gboolean busy;   /**< A transition is running; the object is in use. */
+  GCond *async_cond;
 
   gboolean done;
+  guint timeout;   /**< Max time to block on the component, in ms; 0 waits forever. */
+  guint pool_size;   /**< Memory to keep for reuse, in KiB. */
+  guint pool_idle;   /**< Max time memory is kept unused, in ms. */
+  guint handle_pool;   /**< Loaded handles to keep ready. */
+  gboolean parallel_allocation;   /**< Populate the ports concurrently. */
+  MemFlags mem_flags;   /**< Added to the ones of every port. */
 
   gchar *library_name;
   gchar *component_name;
   gchar *component_role;
 };
 
+/**
+ * Provides the memory of ports set up with OMX_UseBuffer; @priv is kept
+ * along with the data and handed back to @free.
+ */
+struct GOmxAllocator
+{
+  gpointer (*alloc) (GOmxPort * port, gsize size, gpointer * priv);
+  void (*free) (GOmxPort * port, gpointer data, gpointer priv);
+};
+
+struct GOmxBufferMem
+{
+  gpointer data;
+  gpointer priv;
+  const GOmxAllocator *allocator;
+  gboolean lent;   /**< The header is wrapped in a GstBuffer. */
+  gpointer lent_buffer;   /**< That GstBuffer, while lent. */
+};
+
+struct GOmxAttachedData
+{
+  OMX_U8 *data;      /**< The header's own buffer, restored when done. */
+  OMX_U32 alloc_len;
+  OMX_U32 offset;
+  GDestroyNotify notify;
+  gpointer user_data;
+};
+
 struct GOmxPort
 {
+  volatile gint ref_count;   /**< The core's, plus one per lent header. */
   GOmxCore *core;
   GOmxPortType type;
 
@@ -104,11 +170,33 @@ struct GOmxPort
   gulong buffer_size;
   guint port_index;
   OMX_BUFFERHEADERTYPE **buffers;
+  GOmxAttachedData *attached;   /**< Indexed like buffers. */
+  GOmxBufferMem *mem;           /**< Indexed like buffers. */
+  const GOmxAllocator *allocator;   /**< NULL for the default one. */
+  MemFlags mem_flags;   /**< Used by the default allocator. */
 
   GMutex *mutex;
   gboolean enabled;
   gboolean omx_allocate;   /**< Setup with OMX_AllocateBuffer rather than OMX_UseBuffer */
   AsyncQueue *queue;
+
+  guint lent;   /**< Headers wrapped in GstBuffers that are still alive. */
+  GCond *lent_cond;   /**< Signalled when lent or held drop to 0. */
+  guint returning;   /**< Lent headers on their way back. */
+  guint generation;   /**< Bumped every time the buffers are freed. */
+  GSList *orphans;   /**< Memory of lent headers freed meanwhile. */
+  volatile gint held;   /**< Headers the component currently has. */
+  GSem *sem;   /**< Completion of PortDisable and PortEnable. */
+
+  gint64 populate_time;   /**< How long allocating the buffers took, in us. */
+  GOmxPort *tunnel;   /**< Peer port; the components exchange the buffers. */
+  GOmxPort *peer;   /**< Output port whose buffers we use the memory of. */
+  gboolean shared;   /**< Some peer uses the memory of our buffers. */
+
+  gboolean reconfigurable;   /**< The owner calls g_omx_port_reconfigure(). */
+  volatile gint reconfigure;   /**< The buffers don't fit the settings. */
+  gboolean poll_settings;   /**< The owner checks settings_changed itself. */
+  volatile gint settings_changed;
 };
 
 /* Functions. */
@@ -118,32 +206,64 @@ void g_omx_deinit (void);
 
 GOmxCore *g_omx_core_new (void *object);
 void g_omx_core_free (GOmxCore * core);
+void g_omx_core_free_async (GOmxCore * core);
 void g_omx_core_init (GOmxCore * core);
 void g_omx_core_prepare (GOmxCore * core);
 void g_omx_core_start (GOmxCore * core);
 void g_omx_core_pause (GOmxCore * core);
 void g_omx_core_stop (GOmxCore * core);
 void g_omx_core_unload (GOmxCore * core);
+void g_omx_core_set_state_async (GOmxCore * core, OMX_STATETYPE state,
+    GOmxStateCb cb, gpointer user_data);
+void g_omx_core_wait_async (GOmxCore * core);
 void g_omx_core_set_done (GOmxCore * core);
-void g_omx_core_wait_for_done (GOmxCore * core);
+gboolean g_omx_core_wait_for_done (GOmxCore * core);
 void g_omx_core_flush_start (GOmxCore * core);
 void g_omx_core_flush_stop (GOmxCore * core);
+gint64 g_omx_core_get_deadline (GOmxCore * core);
 GOmxPort *g_omx_core_new_port (GOmxCore * core, guint index);
 
 GOmxPort *g_omx_port_new (GOmxCore * core, guint index);
-void g_omx_port_free (GOmxPort * port);
+GOmxPort *g_omx_port_ref (GOmxPort * port);
+void g_omx_port_unref (GOmxPort * port);
 void g_omx_port_setup (GOmxPort * port);
+gboolean g_omx_port_setup_tunnel (GOmxPort * out_port, GOmxPort * in_port);
+gboolean g_omx_port_share_peer (GOmxPort * port, GOmxPort * peer);
+OMX_BUFFERHEADERTYPE *g_omx_port_take_peer_buffer (GOmxPort * port,
+    OMX_BUFFERHEADERTYPE * peer_buffer, GDestroyNotify notify,
+    gpointer user_data);
 void g_omx_port_push_buffer (GOmxPort * port,
     OMX_BUFFERHEADERTYPE * omx_buffer);
 OMX_BUFFERHEADERTYPE *g_omx_port_request_buffer (GOmxPort * port);
+OMX_BUFFERHEADERTYPE *g_omx_port_request_buffer_until (GOmxPort * port,
+    gint64 end_time, gboolean * timed_out);
+gint g_omx_port_get_fd (GOmxPort * port);
+guint g_omx_port_request_buffers (GOmxPort * port,
+    OMX_BUFFERHEADERTYPE ** omx_buffers, guint max);
+guint g_omx_port_request_buffers_until (GOmxPort * port,
+    OMX_BUFFERHEADERTYPE ** omx_buffers, guint max,
+    gint64 end_time, gboolean * timed_out);
 void g_omx_port_release_buffer (GOmxPort * port,
     OMX_BUFFERHEADERTYPE * omx_buffer);
+gpointer g_omx_port_get_buffer_data (GOmxPort * port,
+    OMX_BUFFERHEADERTYPE * omx_buffer);
+void g_omx_port_attach_data (GOmxPort * port,
+    OMX_BUFFERHEADERTYPE * omx_buffer, gpointer data, guint size,
+    GDestroyNotify notify, gpointer user_data);
+guint g_omx_port_lend_buffer (GOmxPort * port,
+    OMX_BUFFERHEADERTYPE * omx_buffer, gpointer buffer);
+void g_omx_port_return_buffer (GOmxPort * port,
+    OMX_BUFFERHEADERTYPE * omx_buffer, guint generation);
 void g_omx_port_resume (GOmxPort * port);
 void g_omx_port_pause (GOmxPort * port);
 void g_omx_port_flush (GOmxPort * port);
-void g_omx_port_enable (GOmxPort * port);
-void g_omx_port_disable (GOmxPort * port);
+gboolean g_omx_port_enable (GOmxPort * port);
+gboolean g_omx_port_disable (GOmxPort * port);
 void g_omx_port_finish (GOmxPort * port);
+guint g_omx_port_set_buffer_count (GOmxPort * port, guint count);
+gboolean g_omx_port_resize (GOmxPort * port, guint count);
+gboolean g_omx_port_reconfigure (GOmxPort * port);
+gboolean g_omx_port_settings_changed (GOmxPort * port);
 
 /* Utility Macros */
 
@@ -20,6 +20,7 @@
  */
 
 #include <check.h>
+#include <poll.h>
 #include "async_queue.h"
 #include "sem.h"
 
@@ -350,6 +351,361 @@ START_TEST (test_async_queue_stress)
   custom_data_free (custom_data);
 }
 
+END_TEST
+START_TEST (test_async_queue_bounded_process)
+{
+  AsyncQueue *queue;
+  gpointer foo;
+  guint i;
+
+  queue = async_queue_new_bounded (PROCESS_COUNT);
+  fail_if (!queue, "Construction failed");
+
+  foo = GINT_TO_POINTER (1);
+  for (i = 0; i < PROCESS_COUNT; i++, foo++) {
+    async_queue_push (queue, foo);
+  }
+  foo = GINT_TO_POINTER (1);
+  for (i = 0; i < PROCESS_COUNT; i++, foo++) {
+    gpointer tmp;
+    tmp = async_queue_pop (queue);
+    fail_if (tmp != foo, "Pop failed");
+  }
+
+  fail_if (async_queue_pop_forced (queue) != NULL, "Queue not empty");
+
+  async_queue_free (queue);
+}
+
+END_TEST
+START_TEST (test_async_queue_bounded_wrap)
+{
+  AsyncQueue *queue;
+  gpointer foo;
+  guint i;
+
+  queue = async_queue_new_bounded (4);
+  fail_if (!queue, "Construction failed");
+
+  foo = GINT_TO_POINTER (1);
+  for (i = 0; i < PROCESS_COUNT; i++, foo++) {
+    gpointer tmp;
+    async_queue_push (queue, foo);
+    tmp = async_queue_pop (queue);
+    fail_if (tmp != foo, "Pop failed");
+  }
+
+  async_queue_free (queue);
+}
+
+END_TEST
+START_TEST (test_async_queue_bounded_threads)
+{
+  AsyncQueue *queue;
+  GThread *push_thread;
+  GThread *pop_thread;
+
+  queue = async_queue_new_bounded (PROCESS_COUNT);
+  fail_if (!queue, "Construction failed");
+
+  pop_thread = g_thread_create (pop_func, queue, TRUE, NULL);
+  push_thread = g_thread_create (push_func, queue, TRUE, NULL);
+
+  g_thread_join (pop_thread);
+  g_thread_join (push_thread);
+
+  async_queue_free (queue);
+}
+
+END_TEST
+START_TEST (test_async_queue_bounded_disable)
+{
+  AsyncQueue *queue;
+  GThread *push_thread;
+  GThread *pop_thread;
+  guint count;
+
+  queue = async_queue_new_bounded (PROCESS_COUNT);
+  fail_if (!queue, "Construction failed");
+
+  pop_thread = g_thread_create (pop_with_disable_func, queue, TRUE, NULL);
+  push_thread = g_thread_create (push_and_disable_func, queue, TRUE, NULL);
+
+  count = GPOINTER_TO_INT (g_thread_join (pop_thread));
+  g_thread_join (push_thread);
+
+  fail_if (count > DISABLE_AT, "Disable failed");
+
+  async_queue_flush (queue);
+  fail_if (async_queue_pop_forced (queue) != NULL, "Flush failed");
+
+  async_queue_free (queue);
+}
+
+END_TEST
+START_TEST (test_async_queue_reserve)
+{
+  AsyncQueue *queue;
+  gpointer foo;
+  guint i;
+
+  queue = async_queue_new ();
+  fail_if (!queue, "Construction failed");
+
+  foo = GINT_TO_POINTER (1);
+  for (i = 0; i < 10; i++, foo++) {
+    async_queue_push (queue, foo);
+  }
+
+  async_queue_reserve (queue, 4);
+
+  foo = GINT_TO_POINTER (1);
+  for (i = 0; i < 10; i++, foo++) {
+    gpointer tmp;
+    tmp = async_queue_pop (queue);
+    fail_if (tmp != foo, "Pop failed");
+  }
+
+  async_queue_free (queue);
+}
+
+END_TEST
+START_TEST (test_async_queue_bounded_spill)
+{
+  AsyncQueue *queue;
+  gpointer foo;
+  guint i;
+
+  queue = async_queue_new_bounded (4);
+  fail_if (!queue, "Construction failed");
+
+  /* what doesn't fit in the ring is kept, in order */
+  foo = GINT_TO_POINTER (1);
+  for (i = 0; i < 10; i++, foo++) {
+    async_queue_push (queue, foo);
+  }
+  fail_if (queue->length != 10, "Length broken");
+
+  foo = GINT_TO_POINTER (1);
+  for (i = 0; i < 10; i++, foo++) {
+    gpointer tmp;
+    tmp = async_queue_pop (queue);
+    fail_if (tmp != foo, "Pop failed");
+  }
+  fail_if (queue->length != 0, "Length broken");
+  fail_if (async_queue_pop_forced (queue) != NULL, "Queue not empty");
+
+  async_queue_free (queue);
+}
+
+END_TEST
+START_TEST (test_async_queue_reserve_threads)
+{
+  AsyncQueue *queue;
+  GThread *push_thread;
+  GThread *pop_thread;
+  guint i;
+
+  queue = async_queue_new_bounded (4);
+  fail_if (!queue, "Construction failed");
+
+  pop_thread = g_thread_create (pop_func, queue, TRUE, NULL);
+  push_thread = g_thread_create (push_func, queue, TRUE, NULL);
+
+  /* the ring is swapped under both of them */
+  for (i = 0; i < 0x100; i++)
+    async_queue_reserve (queue, i % 2 ? 4 : 8);
+
+  g_thread_join (pop_thread);
+  g_thread_join (push_thread);
+
+  async_queue_free (queue);
+}
+
+END_TEST
+START_TEST (test_async_queue_pop_many)
+{
+  AsyncQueue *queue;
+  gpointer data[8];
+  gpointer foo;
+  guint i, count;
+
+  queue = async_queue_new ();
+  fail_if (!queue, "Construction failed");
+
+  foo = GINT_TO_POINTER (1);
+  for (i = 0; i < 10; i++, foo++) {
+    async_queue_push (queue, foo);
+  }
+
+  count = async_queue_pop_many (queue, data, 8);
+  fail_if (count != 8, "Pop many failed");
+  count = async_queue_pop_many (queue, data + 0, 8);
+  fail_if (count != 2, "Pop many failed");
+  fail_if (data[1] != GINT_TO_POINTER (10), "Pop many failed");
+
+  async_queue_disable (queue);
+  async_queue_push (queue, foo);
+  count = async_queue_pop_many (queue, data, 8);
+  fail_if (count != 0, "Disable failed");
+
+  async_queue_free (queue);
+}
+
+END_TEST
+START_TEST (test_async_queue_bounded_pop_many)
+{
+  AsyncQueue *queue;
+  gpointer data[8];
+  gpointer foo;
+  guint i, count;
+
+  queue = async_queue_new_bounded (8);
+  fail_if (!queue, "Construction failed");
+
+  foo = GINT_TO_POINTER (1);
+  for (i = 0; i < 5; i++, foo++) {
+    async_queue_push (queue, foo);
+  }
+
+  count = async_queue_pop_many (queue, data, 8);
+  fail_if (count != 5, "Pop many failed");
+
+  foo = GINT_TO_POINTER (1);
+  for (i = 0; i < count; i++, foo++) {
+    fail_if (data[i] != foo, "Pop many failed");
+  }
+
+  async_queue_free (queue);
+}
+
+END_TEST static void
+check_pop_until (AsyncQueue * queue)
+{
+  gpointer foo;
+  gpointer tmp;
+  gboolean timed_out;
+  gint64 end_time;
+
+  foo = GINT_TO_POINTER (1);
+
+  end_time = g_get_monotonic_time () + 10 * 1000;
+  tmp = async_queue_pop_until (queue, end_time, &timed_out);
+  fail_if (tmp || !timed_out, "Timeout failed");
+  fail_if (g_get_monotonic_time () < end_time, "Woke up too early");
+
+  async_queue_push (queue, foo);
+  tmp = async_queue_pop_until (queue, g_get_monotonic_time (), &timed_out);
+  fail_if (tmp != foo || timed_out, "Pop failed");
+
+  async_queue_disable (queue);
+  tmp = async_queue_pop_until (queue, g_get_monotonic_time () + 10 * 1000,
+      &timed_out);
+  fail_if (tmp || timed_out, "Disable failed");
+}
+
+START_TEST (test_async_queue_pop_until)
+{
+  AsyncQueue *queue;
+
+  queue = async_queue_new ();
+  fail_if (!queue, "Construction failed");
+  check_pop_until (queue);
+  async_queue_free (queue);
+
+  queue = async_queue_new_bounded (4);
+  fail_if (!queue, "Construction failed");
+  check_pop_until (queue);
+  async_queue_free (queue);
+}
+
+END_TEST
+START_TEST (test_sem_down_until)
+{
+  GSem *sem;
+
+  sem = g_sem_new ();
+
+  fail_if (g_sem_down_until (sem, g_get_monotonic_time () + 10 * 1000),
+      "Timeout failed");
+
+  g_sem_up (sem);
+  fail_if (!g_sem_down_until (sem, g_get_monotonic_time ()), "Down failed");
+  /* whichever backend, the count must be back to zero */
+  fail_if (g_sem_down_until (sem, g_get_monotonic_time () + 10 * 1000),
+      "Counter broken");
+
+  g_sem_free (sem);
+}
+
+END_TEST static gboolean
+fd_ready (gint fd)
+{
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  return poll (&pfd, 1, 0) == 1;
+}
+
+START_TEST (test_sem_fd)
+{
+  GSem *sem;
+  gint fd;
+
+  sem = g_sem_new ();
+  fd = g_sem_get_fd (sem);
+
+  if (fd >= 0) {
+    fail_if (fd_ready (fd), "Ready too early");
+
+    g_sem_up (sem);
+    g_sem_up (sem);
+    fail_if (!fd_ready (fd), "Not ready");
+
+    fail_if (!g_sem_down_until (sem, 0), "Down failed");
+    fail_if (!fd_ready (fd), "Count lost");
+    fail_if (!g_sem_down_until (sem, 0), "Down failed");
+    fail_if (fd_ready (fd), "Still ready");
+  }
+
+  g_sem_free (sem);
+}
+
+END_TEST
+START_TEST (test_async_queue_fd)
+{
+  AsyncQueue *queue;
+  gpointer foo;
+  gint fd;
+
+  queue = async_queue_new_bounded (4);
+  foo = GINT_TO_POINTER (1);
+
+  async_queue_push (queue, foo);
+  fd = async_queue_get_fd (queue);
+
+  if (fd >= 0) {
+    /* entries queued before the fd was requested are announced */
+    fail_if (!fd_ready (fd), "Not ready");
+    async_queue_clear_fd (queue);
+    fail_if (fd_ready (fd), "Still ready");
+    fail_if (async_queue_pop_until (queue, 0, NULL) != foo, "Pop failed");
+    fail_if (async_queue_pop_until (queue, 0, NULL), "Pop too much");
+
+    async_queue_push (queue, foo);
+    fail_if (!fd_ready (fd), "Push not announced");
+    async_queue_clear_fd (queue);
+    async_queue_pop_forced (queue);
+
+    async_queue_disable (queue);
+    fail_if (!fd_ready (fd), "Disable not announced");
+  }
+
+  async_queue_free (queue);
+}
+
 END_TEST static Suite *
 util_suite (void)
 {
@@ -368,6 +724,19 @@ util_suite (void)
   tcase_add_test (tc_core, test_async_queue_disable);
   tcase_add_test (tc_core, test_async_queue_enable);
   tcase_add_test (tc_core, test_async_queue_stress);
+  tcase_add_test (tc_core, test_async_queue_bounded_process);
+  tcase_add_test (tc_core, test_async_queue_bounded_wrap);
+  tcase_add_test (tc_core, test_async_queue_bounded_threads);
+  tcase_add_test (tc_core, test_async_queue_bounded_disable);
+  tcase_add_test (tc_core, test_async_queue_reserve);
+  tcase_add_test (tc_core, test_async_queue_bounded_spill);
+  tcase_add_test (tc_core, test_async_queue_reserve_threads);
+  tcase_add_test (tc_core, test_async_queue_pop_many);
+  tcase_add_test (tc_core, test_async_queue_bounded_pop_many);
+  tcase_add_test (tc_core, test_async_queue_pop_until);
+  tcase_add_test (tc_core, test_sem_down_until);
+  tcase_add_test (tc_core, test_sem_fd);
+  tcase_add_test (tc_core, test_async_queue_fd);
   suite_add_tcase (s, tc_core);
 
   return s;
@@ -21,9 +21,18 @@
 
 #include <gst/check/gstcheck.h>
 
+#include <string.h>
+#include <dlfcn.h>
+
+#include "dummy.h"
+
 #define BUFFER_SIZE 0x1000
 #define BUFFER_COUNT 0x100
 #define FLUSH_AT 0x10
+#define SMALL_SIZE (BUFFER_SIZE / 0x10)
+#define FRAME_COUNT 0x20
+#define FRAME_SIZE (16 * 16 * 3 / 2)
+#define DURATION (GST_SECOND / 25)
 
 static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
     GST_PAD_SINK,
@@ -58,16 +67,18 @@ test_sink_event (GstPad * pad, GstEvent * event)
   return gst_pad_event_default (pad, event);
 }
 
-static void
-helper (gboolean flush)
+static GstPad *mysrcpad;
+static GstPad *mysinkpad;
+
+/* of the library the plugin uses, see gst-openmax.conf */
+static DummyStats *stats;
+
+static GstElement *
+setup_filter (const gchar * name)
 {
   GstElement *filter;
-  GstBus *bus;
-  GstPad *mysrcpad;
-  GstPad *mysinkpad;
 
-  /* init */
-  filter = gst_check_setup_element ("omx_dummy");
+  filter = gst_check_setup_element (name);
   mysrcpad = gst_check_setup_src_pad (filter, &srctemplate, NULL);
   mysinkpad = gst_check_setup_sink_pad (filter, &sinktemplate, NULL);
 
@@ -82,6 +93,95 @@ helper (gboolean flush)
   eos_cond = g_cond_new ();
   eos_arrived = FALSE;
 
+  return filter;
+}
+
+static void
+teardown_filter (GstElement * filter)
+{
+  gst_check_drop_buffers ();
+
+  gst_element_set_state (filter, GST_STATE_NULL);
+
+  gst_pad_set_active (mysrcpad, FALSE);
+  gst_pad_set_active (mysinkpad, FALSE);
+  gst_check_teardown_src_pad (filter);
+  gst_check_teardown_sink_pad (filter);
+  gst_check_teardown_element (filter);
+
+  g_mutex_free (eos_mutex);
+  g_cond_free (eos_cond);
+}
+
+/* Pushes @count buffers of @size bytes filled with their number, counting
+ * from @first. With a @duration they are timestamped, and all but every
+ * fourth one are delta units. */
+static void
+push_buffers (GstCaps * caps, guint first, guint count, guint size,
+    GstClockTime duration)
+{
+  guint i;
+
+  for (i = first; i < first + count; i++) {
+    GstBuffer *inbuffer;
+
+    inbuffer = gst_buffer_new_and_alloc (size);
+    memset (GST_BUFFER_DATA (inbuffer), i, size);
+    gst_buffer_set_caps (inbuffer, caps);
+
+    if (duration != GST_CLOCK_TIME_NONE) {
+      GST_BUFFER_TIMESTAMP (inbuffer) = i * duration;
+      GST_BUFFER_DURATION (inbuffer) = duration;
+      GST_BUFFER_OFFSET (inbuffer) = i;
+      GST_BUFFER_OFFSET_END (inbuffer) = i + 1;
+      if (i % 4)
+        GST_BUFFER_FLAG_SET (inbuffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    }
+
+    ASSERT_BUFFER_REFCOUNT (inbuffer, "inbuffer", 1);
+
+    fail_unless (gst_pad_push (mysrcpad, inbuffer) == GST_FLOW_OK);
+  }
+}
+
+static void
+push_eos (void)
+{
+  gst_pad_push_event (mysrcpad, gst_event_new_eos ());
+  /* need to wait a bit to make sure src pad task digested all and sent eos */
+  g_mutex_lock (eos_mutex);
+  while (!eos_arrived)
+    g_cond_wait (eos_cond, eos_mutex);
+  g_mutex_unlock (eos_mutex);
+}
+
+/* Checks that @count buffers came out, each one with its number. */
+static void
+check_order (guint count)
+{
+  GList *cur;
+  guint i;
+
+  for (cur = buffers, i = 0; cur; cur = g_list_next (cur), i++) {
+    GstBuffer *buffer;
+    buffer = cur->data;
+    fail_unless (GST_BUFFER_DATA (buffer)[0] == (i & 0xff));
+  }
+  fail_unless (i == count);
+}
+
+static void
+helper (const gchar * name, gboolean flush, gboolean eager)
+{
+  GstElement *filter;
+  GstBus *bus;
+  GstCaps *caps;
+
+  /* init */
+  filter = setup_filter (name);
+  if (eager)
+    g_object_set (filter, "eager-start", TRUE, NULL);
+
   /* start */
 
   fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
@@ -91,16 +191,14 @@ helper (gboolean flush)
 
   gst_element_set_bus (filter, bus);
 
+  /* an eager start kicks in with the caps */
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+
   /* send buffers in order */
   {
     guint i;
     for (i = 0; i < BUFFER_COUNT; i++) {
-      GstBuffer *inbuffer;
-      inbuffer = gst_buffer_new_and_alloc (BUFFER_SIZE);
-      GST_BUFFER_DATA (inbuffer)[0] = i;
-      ASSERT_BUFFER_REFCOUNT (inbuffer, "inbuffer", 1);
-
-      fail_unless (gst_pad_push (mysrcpad, inbuffer) == GST_FLOW_OK);
+      push_buffers (caps, i, 1, BUFFER_SIZE, GST_CLOCK_TIME_NONE);
 
       if (flush && i % FLUSH_AT == 0) {
         gst_pad_push_event (mysrcpad, gst_event_new_flush_start ());
@@ -118,53 +216,864 @@ helper (gboolean flush)
     fail_if (message);
   }
 
-  gst_pad_push_event (mysrcpad, gst_event_new_eos ());
-  /* need to wait a bit to make sure src pad task digested all and sent eos */
-  g_mutex_lock (eos_mutex);
-  while (!eos_arrived)
-    g_cond_wait (eos_cond, eos_mutex);
-  g_mutex_unlock (eos_mutex);
+  push_eos ();
 
   /* check the order of the buffers */
-  if (!flush) {
-    GList *cur;
-    guint i;
-    for (cur = buffers, i = 0; cur; cur = g_list_next (cur), i++) {
-      GstBuffer *buffer;
-      buffer = cur->data;
-      fail_unless (GST_BUFFER_DATA (buffer)[0] == i);
+  if (!flush)
+    check_order (BUFFER_COUNT);
+
+  /* cleanup */
+  gst_caps_unref (caps);
+  gst_bus_set_flushing (bus, TRUE);
+  gst_element_set_bus (filter, NULL);
+  gst_object_unref (GST_OBJECT (bus));
+
+  /* deinit */
+  teardown_filter (filter);
+}
+
+static GstBuffer *last_buffer;
+static guint zero_copy_count;
+static gboolean zero_copy_ok;
+
+/* Keeps only the last buffer, which must stay intact meanwhile; the
+ * others go back to the component. */
+static GstFlowReturn
+zero_copy_chain (GstPad * pad, GstBuffer * buffer)
+{
+  if (strcmp (g_type_name (G_TYPE_FROM_INSTANCE (buffer)), "GstOmxBuffer") ||
+      GST_BUFFER_DATA (buffer)[0] != (zero_copy_count & 0xff))
+    zero_copy_ok = FALSE;
+
+  if (last_buffer) {
+    if (GST_BUFFER_DATA (last_buffer)[0] != ((zero_copy_count - 1) & 0xff))
+      zero_copy_ok = FALSE;
+    gst_buffer_unref (last_buffer);
+  }
+
+  zero_copy_count++;
+  last_buffer = buffer;
+
+  return GST_FLOW_OK;
+}
+
+/* A live source without latency of its own. */
+static gboolean
+live_src_query (GstPad * pad, GstQuery * query)
+{
+  if (GST_QUERY_TYPE (query) != GST_QUERY_LATENCY)
+    return gst_pad_query_default (pad, query);
+
+  gst_query_set_latency (query, TRUE, 0, 0);
+
+  return TRUE;
+}
+
+/* The output port gets bigger buffers while the sink holds one of the
+ * old ones, with the buffers of the port or of the component. */
+static void
+reconfigure_lent (const gchar * strategy)
+{
+  GstElement *filter;
+  GstCaps *caps;
+
+  filter = setup_filter ("omx_dummy_reconfigure");
+  g_object_set (filter, "zero-copy-output", TRUE, NULL);
+  gst_util_set_object_arg (G_OBJECT (filter), "buffer-strategy", strategy);
+  gst_pad_set_chain_function (mysinkpad, zero_copy_chain);
+
+  last_buffer = NULL;
+  zero_copy_count = 0;
+  zero_copy_ok = TRUE;
+
+  /* one header for the sink to keep, one to go on with */
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_READY),
+      GST_STATE_CHANGE_SUCCESS);
+  g_object_set (filter, "output-buffers", 2, NULL);
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  push_buffers (caps, 0, BUFFER_COUNT, BUFFER_SIZE, GST_CLOCK_TIME_NONE);
+  push_eos ();
+  gst_caps_unref (caps);
+
+  fail_unless (zero_copy_ok, "copied, out of order or overwritten");
+  fail_unless_equals_int (zero_copy_count, BUFFER_COUNT);
+
+  fail_unless (last_buffer != NULL);
+  teardown_filter (filter);
+
+  fail_unless (GST_BUFFER_DATA (last_buffer)[0] == BUFFER_COUNT - 1);
+  gst_buffer_unref (last_buffer);
+}
+
+/* Makes an omx_dummy_pooled, retrying for a while if the component has
+ * no room for it, as a handle on its way back to the pool may not be
+ * there yet. */
+static GstElement *
+make_pooled (void)
+{
+  GstElement *element = NULL;
+  gint64 end_time;
+  guint count = 0;
+
+  end_time = g_get_monotonic_time () + G_USEC_PER_SEC;
+  while (!count && g_get_monotonic_time () < end_time) {
+    if (element) {
+      gst_object_unref (element);
+      g_usleep (10 * 1000);
     }
-    fail_unless (i == BUFFER_COUNT);
+
+    /* without a handle there are no buffers */
+    element = gst_element_factory_make ("omx_dummy_pooled", NULL);
+    g_object_get (element, "output-buffers", &count, NULL);
   }
 
-  /* cleanup */
+  fail_unless (count != 0, "no handle");
+
+  return element;
+}
+
+/* Runs @name with a few buffers per port, and returns how many of them
+ * the component was busy with at once. */
+static gint
+populate_helper (const gchar * name)
+{
+  GstElement *filter;
+  GstCaps *caps;
+
+  g_atomic_int_set (&stats->max_populating, 0);
+
+  filter = setup_filter (name);
+
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_READY),
+      GST_STATE_CHANGE_SUCCESS);
+  g_object_set (filter, "input-buffers", 4, "output-buffers", 4, NULL);
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  push_buffers (caps, 0, FRAME_COUNT, BUFFER_SIZE, GST_CLOCK_TIME_NONE);
+  push_eos ();
+  gst_caps_unref (caps);
+
+  check_order (FRAME_COUNT);
+
+  teardown_filter (filter);
+
+  return g_atomic_int_get (&stats->max_populating);
+}
+
+static guint tunnel_buffers;
+static guint tunnel_prerolls;
+
+/* Counts what reaches the sink through its pad rather than a tunnel. */
+static gboolean
+tunnel_probe (GstPad * pad, GstBuffer * buffer, gpointer user_data)
+{
+  tunnel_buffers++;
+  if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_PREROLL) &&
+      GST_BUFFER_TIMESTAMP (buffer) == 0)
+    tunnel_prerolls++;
+
+  return TRUE;
+}
+
+/* Runs omx_dummy asking for a tunnel to the sink @sink_name, and returns
+ * once the sink got EOS. */
+static void
+tunnel_helper (const gchar * sink_name)
+{
+  GstElement *pipeline, *filter, *sink;
+  GstPad *sinkpad;
+  GstBus *bus;
+  GstMessage *message;
+  GstCaps *caps;
+
+  filter = gst_check_setup_element ("omx_dummy");
+  sink = gst_check_setup_element (sink_name);
+  g_object_set (filter, "tunnel", TRUE, NULL);
+  g_object_set (sink, "sync", FALSE, NULL);
+
+  pipeline = gst_pipeline_new (NULL);
+  gst_bin_add_many (GST_BIN (pipeline), filter, sink, NULL);
+  fail_unless (gst_element_link (filter, sink));
+
+  mysrcpad = gst_check_setup_src_pad (filter, &srctemplate, NULL);
+  gst_pad_set_active (mysrcpad, TRUE);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_add_buffer_probe (sinkpad, G_CALLBACK (tunnel_probe), NULL);
+  gst_object_unref (sinkpad);
+
+  tunnel_buffers = tunnel_prerolls = 0;
+
+  fail_if (gst_element_set_state (pipeline, GST_STATE_PLAYING) ==
+      GST_STATE_CHANGE_FAILURE);
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  push_buffers (caps, 0, FRAME_COUNT, SMALL_SIZE, DURATION);
+  gst_pad_push_event (mysrcpad, gst_event_new_eos ());
+  gst_caps_unref (caps);
+
+  /* through a tunnel, only the sink component can tell it's done */
+  bus = gst_element_get_bus (pipeline);
+  message = gst_bus_timed_pop_filtered (bus, 5 * GST_SECOND,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  fail_unless (message != NULL, "no EOS");
+  fail_unless (GST_MESSAGE_TYPE (message) == GST_MESSAGE_EOS, "error");
+  gst_message_unref (message);
+  gst_object_unref (bus);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_pad_set_active (mysrcpad, FALSE);
+  gst_check_teardown_src_pad (filter);
+  gst_object_unref (pipeline);
+}
+
+GST_START_TEST (test_flush)
+{
+  helper ("omx_dummy", TRUE, FALSE);
+}
+
+GST_END_TEST
+GST_START_TEST (test_basic)
+{
+  helper ("omx_dummy", FALSE, FALSE);
+}
+
+GST_END_TEST
+GST_START_TEST (test_eager_start)
+{
+  helper ("omx_dummy", FALSE, TRUE);
+}
+
+GST_END_TEST
+GST_START_TEST (test_shard)
+{
+  helper ("omx_dummy_shard", FALSE, FALSE);
+}
+
+GST_END_TEST
+GST_START_TEST (test_shard_segment)
+{
+  /* whole segments run in parallel, the last one cut short */
+  helper ("omx_dummy_shard_segment", FALSE, FALSE);
+}
+
+GST_END_TEST
+GST_START_TEST (test_zero_copy)
+{
+  GstElement *filter;
+  GstCaps *caps;
+
+  filter = setup_filter ("omx_dummy");
+  g_object_set (filter, "zero-copy-output", TRUE, NULL);
+  gst_pad_set_chain_function (mysinkpad, zero_copy_chain);
+
+  last_buffer = NULL;
+  zero_copy_count = 0;
+  zero_copy_ok = TRUE;
+
+  /* the sink keeps one header, so with just one more each buffer has to
+   * be given back for the next but one to come out */
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_READY),
+      GST_STATE_CHANGE_SUCCESS);
+  g_object_set (filter, "output-buffers", 2, NULL);
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  push_buffers (caps, 0, BUFFER_COUNT, BUFFER_SIZE, GST_CLOCK_TIME_NONE);
+  push_eos ();
+  gst_caps_unref (caps);
+
+  fail_unless (zero_copy_ok, "copied or out of order");
+  fail_unless_equals_int (zero_copy_count, BUFFER_COUNT);
+
+  /* the last one outlives the element, and its port */
+  fail_unless (last_buffer != NULL);
+  teardown_filter (filter);
+
+  fail_unless (GST_BUFFER_DATA (last_buffer)[0] == BUFFER_COUNT - 1);
+  fail_unless (GST_BUFFER_DATA (last_buffer)[BUFFER_SIZE - 1] ==
+      BUFFER_COUNT - 1);
+  gst_buffer_unref (last_buffer);
+}
+
+GST_END_TEST
+GST_START_TEST (test_coalesce)
+{
+  GstElement *filter;
+  GstCaps *caps;
+  GList *cur;
+  guint i, j;
+
+  filter = setup_filter ("omx_dummy");
+  g_object_set (filter, "coalesce-size", BUFFER_SIZE, "coalesce-latency", 0,
+      NULL);
+
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  push_buffers (caps, 0, 0x40, SMALL_SIZE, GST_CLOCK_TIME_NONE);
+  push_eos ();
+  gst_caps_unref (caps);
+
+  /* sixteen small ones fill a header, each one whole and in order */
+  for (cur = buffers, i = 0; cur; cur = g_list_next (cur), i++) {
+    GstBuffer *buffer = cur->data;
+
+    fail_unless_equals_int (GST_BUFFER_SIZE (buffer), BUFFER_SIZE);
+    for (j = 0; j < 0x10; j++) {
+      fail_unless (GST_BUFFER_DATA (buffer)[j * SMALL_SIZE] == i * 0x10 + j);
+      fail_unless (GST_BUFFER_DATA (buffer)[(j + 1) * SMALL_SIZE - 1] ==
+          i * 0x10 + j);
+    }
+  }
+  fail_unless_equals_int (i, 4);
+
+  teardown_filter (filter);
+}
+
+GST_END_TEST
+GST_START_TEST (test_coalesce_latency)
+{
+  GstElement *filter;
+  GstCaps *caps;
+  GstBuffer *buffer;
+
+  filter = setup_filter ("omx_dummy");
+  g_object_set (filter, "coalesce-size", BUFFER_SIZE, "coalesce-latency", 20,
+      NULL);
+
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  push_buffers (caps, 0, 1, SMALL_SIZE, GST_CLOCK_TIME_NONE);
+
+  /* nothing else comes, yet it's not held until EOS */
+  g_mutex_lock (check_mutex);
+  while (!buffers)
+    g_cond_wait (check_cond, check_mutex);
+  g_mutex_unlock (check_mutex);
+
+  fail_if (eos_arrived);
+  buffer = buffers->data;
+  fail_unless_equals_int (GST_BUFFER_SIZE (buffer), SMALL_SIZE);
+
+  push_eos ();
+  gst_caps_unref (caps);
+
+  fail_unless_equals_int (g_list_length (buffers), 1);
+
+  teardown_filter (filter);
+}
+
+GST_END_TEST
+GST_START_TEST (test_reconfigure)
+{
+  /* the output buffers have to grow midway, with nothing lost */
+  helper ("omx_dummy_reconfigure", FALSE, FALSE);
+}
+
+GST_END_TEST
+GST_START_TEST (test_reconfigure_lent)
+{
+  reconfigure_lent ("default");
+}
+
+GST_END_TEST
+GST_START_TEST (test_reconfigure_lent_allocated)
+{
+  /* the memory goes with the old headers, so the sink gets a copy */
+  reconfigure_lent ("allocate");
+}
+
+GST_END_TEST
+GST_START_TEST (test_tunnel)
+{
+  tunnel_helper ("omx_dummy_sink");
+
+  /* the data went through the tunnel; the sink only prerolled on a
+   * stand-in timestamped like the first frame */
+  fail_unless_equals_int (tunnel_buffers, 1);
+  fail_unless_equals_int (tunnel_prerolls, 1);
+}
+
+GST_END_TEST
+GST_START_TEST (test_tunnel_refused)
+{
+  /* a sink that can't agree on the buffer supplier isn't tunneled to;
+   * the frames go through the pads instead */
+  tunnel_helper ("omx_dummy_sink_nosupplier");
+
+  fail_unless_equals_int (tunnel_buffers, FRAME_COUNT);
+  fail_unless_equals_int (tunnel_prerolls, 0);
+}
+
+GST_END_TEST
+GST_START_TEST (test_resize)
+{
+  GstElement *filter;
+  GstCaps *caps;
+  guint count;
+
+  filter = setup_filter ("omx_dummy");
+  g_object_set (filter, "adaptive-buffers", TRUE, NULL);
+
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  /* a single output header starves, so the port grows while running,
+   * with nothing lost */
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  push_buffers (caps, 0, BUFFER_COUNT, BUFFER_SIZE, GST_CLOCK_TIME_NONE);
+  push_eos ();
+  gst_caps_unref (caps);
+
+  check_order (BUFFER_COUNT);
+
+  g_object_get (filter, "output-buffers", &count, NULL);
+  fail_unless (count > 1, "output port didn't grow");
+
+  teardown_filter (filter);
+}
+
+GST_END_TEST
+GST_START_TEST (test_handle_pool)
+{
+  GstElement *first, *second, *third;
+  gint handles;
+  guint count;
+
+  fail_unless (stats != NULL, "dummy library not found");
+  handles = g_atomic_int_get (&stats->handles);
+
+  /* the component has room for two; the pool gets the other one, or
+   * can't get any once that's taken */
+  first = make_pooled ();
+  second = make_pooled ();
+
+  g_object_set (first, "output-buffers", 3, NULL);
+  g_object_get (first, "output-buffers", &count, NULL);
+  fail_unless_equals_int (count, 3);
+
+  /* so the handle of the first one is kept, and it's the only one the
+   * third can get */
+  gst_object_unref (first);
+  third = make_pooled ();
+
+  g_object_get (third, "output-buffers", &count, NULL);
+  fail_unless_equals_int (count, 1);
+  fail_unless_equals_int (g_atomic_int_get (&stats->handles), handles + 2);
+
+  gst_object_unref (second);
+  gst_object_unref (third);
+}
+
+GST_END_TEST
+GST_START_TEST (test_failed_start)
+{
+  GstElement *filter;
+  GstBuffer *buffer;
+  GstCaps *caps;
+  GstBus *bus;
+  GstMessage *message;
+
+  filter = setup_filter ("omx_dummy_nostart");
+  g_object_set (filter, "eager-start", TRUE, NULL);
+
+  bus = gst_bus_new ();
+  gst_element_set_bus (filter, bus);
+
+  /* the component is started in the background, and refuses */
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  buffer = gst_buffer_new_and_alloc (BUFFER_SIZE);
+  gst_buffer_set_caps (buffer, caps);
+  fail_unless_equals_int (gst_pad_push (mysrcpad, buffer), GST_FLOW_ERROR);
+  gst_caps_unref (caps);
+
+  message = gst_bus_poll (bus, GST_MESSAGE_ERROR, 0);
+  fail_unless (message != NULL);
+  gst_message_unref (message);
+
+  /* it goes back to Loaded all the same, or it couldn't be used again */
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_READY),
+      GST_STATE_CHANGE_SUCCESS);
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PAUSED),
+      GST_STATE_CHANGE_SUCCESS);
+
   gst_bus_set_flushing (bus, TRUE);
   gst_element_set_bus (filter, NULL);
   gst_object_unref (GST_OBJECT (bus));
+
+  teardown_filter (filter);
+}
+
+GST_END_TEST
+GST_START_TEST (test_background_teardown)
+{
+  GstElement *filter;
+  GstCaps *caps;
+  gint64 start;
+
+  filter = setup_filter ("omx_dummy_slowstop");
+
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  push_buffers (caps, 0, FRAME_COUNT, BUFFER_SIZE, GST_CLOCK_TIME_NONE);
+  push_eos ();
+  check_order (FRAME_COUNT);
+
+  /* the component takes its time to unload, but not ours */
+  start = g_get_monotonic_time ();
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_READY),
+      GST_STATE_CHANGE_SUCCESS);
+  fail_unless (g_get_monotonic_time () - start < DUMMY_SLOW_STOP / 2,
+      "waited for the component");
+
+  /* it's done by the time it's needed again */
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
   gst_check_drop_buffers ();
+  eos_arrived = FALSE;
 
-  /* deinit */
-  gst_element_set_state (filter, GST_STATE_NULL);
+  push_buffers (caps, 0, FRAME_COUNT, BUFFER_SIZE, GST_CLOCK_TIME_NONE);
+  push_eos ();
+  check_order (FRAME_COUNT);
+  gst_caps_unref (caps);
+
+  teardown_filter (filter);
+}
+
+GST_END_TEST
+GST_START_TEST (test_parallel_allocation)
+{
+  fail_unless (stats != NULL, "dummy library not found");
+
+  /* one buffer after the other, unless configured otherwise */
+  fail_unless_equals_int (populate_helper ("omx_dummy_slowalloc"), 1);
+  fail_unless (populate_helper ("omx_dummy_parallel") > 1,
+      "the ports weren't populated at once");
+}
+
+GST_END_TEST
+GST_START_TEST (test_output_sharing)
+{
+  GstElement *upstream, *downstream;
+  GstPad *srcpad, *sinkpad;
+  GstCaps *caps;
+  gint shared;
+
+  fail_unless (stats != NULL, "dummy library not found");
+  shared = g_atomic_int_get (&stats->shared);
+
+  /* two filters in a row, the first one handing its buffers on */
+  upstream = gst_check_setup_element ("omx_dummy");
+  downstream = gst_check_setup_element ("omx_dummy");
+  g_object_set (upstream, "zero-copy-output", TRUE, NULL);
+
+  mysrcpad = gst_check_setup_src_pad (upstream, &srctemplate, NULL);
+  mysinkpad = gst_check_setup_sink_pad (downstream, &sinktemplate, NULL);
+
+  srcpad = gst_element_get_static_pad (upstream, "src");
+  sinkpad = gst_element_get_static_pad (downstream, "sink");
+  fail_unless_equals_int (gst_pad_link (srcpad, sinkpad), GST_PAD_LINK_OK);
+
+  gst_pad_set_active (mysrcpad, TRUE);
+  gst_pad_set_active (mysinkpad, TRUE);
+  gst_pad_set_event_function (mysinkpad, test_sink_event);
+
+  eos_mutex = g_mutex_new ();
+  eos_cond = g_cond_new ();
+  eos_arrived = FALSE;
+
+  fail_unless_equals_int (gst_element_set_state (downstream,
+          GST_STATE_PLAYING), GST_STATE_CHANGE_SUCCESS);
+  fail_unless_equals_int (gst_element_set_state (upstream, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  push_buffers (caps, 0, FRAME_COUNT, BUFFER_SIZE, GST_CLOCK_TIME_NONE);
+  push_eos ();
+  gst_caps_unref (caps);
+
+  /* nothing lost on the way, and the second one used the memory the
+   * first one's component allocated */
+  check_order (FRAME_COUNT);
+  fail_unless (g_atomic_int_get (&stats->shared) > shared, "not shared");
+
+  /* cleanup */
+  gst_check_drop_buffers ();
+
+  gst_element_set_state (upstream, GST_STATE_NULL);
+  gst_element_set_state (downstream, GST_STATE_NULL);
 
   gst_pad_set_active (mysrcpad, FALSE);
   gst_pad_set_active (mysinkpad, FALSE);
-  gst_check_teardown_src_pad (filter);
-  gst_check_teardown_sink_pad (filter);
-  gst_check_teardown_element (filter);
+  gst_check_teardown_src_pad (upstream);
+  gst_check_teardown_sink_pad (downstream);
+
+  gst_pad_unlink (srcpad, sinkpad);
+  gst_object_unref (srcpad);
+  gst_object_unref (sinkpad);
+
+  gst_check_teardown_element (upstream);
+  gst_check_teardown_element (downstream);
 
   g_mutex_free (eos_mutex);
   g_cond_free (eos_cond);
 }
 
-GST_START_TEST (test_flush)
+GST_END_TEST
+GST_START_TEST (test_buffer_strategy)
 {
-  helper (TRUE);
+  GstElement *filter;
+  GstCaps *caps;
+  gint allocated;
+  gboolean zero_copy;
+
+  fail_unless (stats != NULL, "dummy library not found");
+
+  filter = setup_filter ("omx_dummy");
+  g_object_set (filter, "zero-copy-input", TRUE, NULL);
+  gst_util_set_object_arg (G_OBJECT (filter), "buffer-strategy", "allocate");
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+
+  /* the component allocates, so the input is copied */
+  allocated = g_atomic_int_get (&stats->allocated);
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+  push_buffers (caps, 0, FRAME_COUNT, BUFFER_SIZE, GST_CLOCK_TIME_NONE);
+  push_eos ();
+  check_order (FRAME_COUNT);
+  fail_unless (g_atomic_int_get (&stats->allocated) > allocated,
+      "not allocated by the component");
+
+  /* but only for as long as the strategy says so */
+  g_object_get (filter, "zero-copy-input", &zero_copy, NULL);
+  fail_unless (zero_copy, "zero-copy-input changed");
+
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_READY),
+      GST_STATE_CHANGE_SUCCESS);
+  gst_util_set_object_arg (G_OBJECT (filter), "buffer-strategy", "default");
+
+  gst_check_drop_buffers ();
+  eos_arrived = FALSE;
+
+  allocated = g_atomic_int_get (&stats->allocated);
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+  push_buffers (caps, 0, FRAME_COUNT, BUFFER_SIZE, GST_CLOCK_TIME_NONE);
+  push_eos ();
+  check_order (FRAME_COUNT);
+  fail_unless_equals_int (g_atomic_int_get (&stats->allocated), allocated);
+
+  gst_caps_unref (caps);
+
+  teardown_filter (filter);
 }
 
 GST_END_TEST
-GST_START_TEST (test_basic)
+GST_START_TEST (test_metadata)
 {
-  helper (FALSE);
+  GstElement *filter;
+  GstCaps *caps;
+  GList *cur;
+  guint i;
+
+  filter = setup_filter ("omx_dummy_reorder");
+
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  push_buffers (caps, 0, FRAME_COUNT, BUFFER_SIZE, DURATION);
+  push_eos ();
+  gst_caps_unref (caps);
+
+  /* each pair comes out swapped, and each one keeps its own metadata */
+  for (cur = buffers, i = 0; cur; cur = g_list_next (cur), i++) {
+    GstBuffer *buffer = cur->data;
+    guint frame = GST_BUFFER_DATA (buffer)[0];
+
+    fail_unless_equals_int (frame, i ^ 1);
+    fail_unless_equals_uint64 (GST_BUFFER_TIMESTAMP (buffer),
+        frame * DURATION);
+    fail_unless_equals_uint64 (GST_BUFFER_DURATION (buffer), DURATION);
+    fail_unless_equals_uint64 (GST_BUFFER_OFFSET (buffer), frame);
+    fail_unless_equals_uint64 (GST_BUFFER_OFFSET_END (buffer), frame + 1);
+  }
+  fail_unless_equals_int (i, FRAME_COUNT);
+
+  teardown_filter (filter);
+}
+
+GST_END_TEST
+GST_START_TEST (test_keyframes)
+{
+  GstElement *filter;
+  GstCaps *caps;
+  GList *cur;
+  guint i;
+
+  filter = setup_filter ("omx_dummy_h264enc");
+
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("video/x-raw-yuv",
+      "format", GST_TYPE_FOURCC, GST_MAKE_FOURCC ('I', '4', '2', '0'),
+      "width", G_TYPE_INT, 16, "height", G_TYPE_INT, 16,
+      "framerate", GST_TYPE_FRACTION, 25, 1, NULL);
+  push_buffers (caps, 0, FRAME_COUNT, FRAME_SIZE, DURATION);
+  push_eos ();
+  gst_caps_unref (caps);
+
+  /* the component tells the keyframes, not the input, which has them
+   * every fourth frame */
+  for (cur = buffers, i = 0; cur; cur = g_list_next (cur), i++) {
+    GstBuffer *buffer = cur->data;
+    guint frame = GST_BUFFER_DATA (buffer)[0];
+
+    fail_unless_equals_uint64 (GST_BUFFER_TIMESTAMP (buffer),
+        frame * DURATION);
+    fail_unless_equals_int (GST_BUFFER_FLAG_IS_SET (buffer,
+            GST_BUFFER_FLAG_DELTA_UNIT), frame % 3 != 0);
+    fail_unless (GST_BUFFER_OFFSET (buffer) == GST_BUFFER_OFFSET_NONE);
+  }
+  fail_unless_equals_int (i, FRAME_COUNT);
+
+  teardown_filter (filter);
+}
+
+GST_END_TEST
+GST_START_TEST (test_qos)
+{
+  GstElement *filter;
+  GstCaps *caps;
+  GList *cur;
+  guint64 dropped;
+  guint i;
+
+  filter = setup_filter ("omx_dummy_h263dec");
+  g_object_set (filter, "qos", TRUE, NULL);
+
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  fail_unless (gst_pad_push_event (mysrcpad,
+          gst_event_new_new_segment (FALSE, 1.0, GST_FORMAT_TIME, 0, -1, 0)));
+
+  caps = gst_caps_new_simple ("video/x-h263", "variant", G_TYPE_STRING, "itu",
+      "width", G_TYPE_INT, 16, "height", G_TYPE_INT, 16,
+      "framerate", GST_TYPE_FRACTION, 25, 1, NULL);
+  push_buffers (caps, 0, 8, FRAME_SIZE, DURATION);
+
+  /* anything before 12 is late now; the keyframe at 8 is decoded anyway,
+   * the delta frames after it are dropped up to the keyframe at 12 */
+  gst_pad_push_event (mysinkpad, gst_event_new_qos (0.5, 5 * DURATION,
+          7 * DURATION));
+
+  push_buffers (caps, 8, 16, FRAME_SIZE, DURATION);
+  push_eos ();
+  gst_caps_unref (caps);
+
+  for (cur = buffers, i = 0; cur; cur = g_list_next (cur), i++) {
+    GstBuffer *buffer = cur->data;
+
+    fail_unless_equals_int (GST_BUFFER_DATA (buffer)[0], i < 9 ? i : i + 3);
+  }
+  fail_unless_equals_int (i, 21);
+
+  g_object_get (filter, "frames-dropped", &dropped, NULL);
+  fail_unless_equals_uint64 (dropped, 3);
+
+  teardown_filter (filter);
+}
+
+GST_END_TEST
+GST_START_TEST (test_settings_changed)
+{
+  GstElement *filter;
+  GstCaps *caps;
+  GList *cur;
+  guint i;
+
+  filter = setup_filter ("omx_dummy_h263dec_resize");
+
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("video/x-h263", "variant", G_TYPE_STRING, "itu",
+      "width", G_TYPE_INT, 16, "height", G_TYPE_INT, 16,
+      "framerate", GST_TYPE_FRACTION, 25, 1, NULL);
+  push_buffers (caps, 0, FRAME_COUNT, FRAME_SIZE, DURATION);
+  push_eos ();
+  gst_caps_unref (caps);
+
+  /* the component tells the size, and changes it once; each frame comes
+   * with the caps it was decoded for */
+  for (cur = buffers, i = 0; cur; cur = g_list_next (cur), i++) {
+    GstBuffer *buffer = cur->data;
+    GstStructure *structure;
+    guint frame = GST_BUFFER_DATA (buffer)[0];
+    gint width;
+
+    fail_unless (GST_BUFFER_CAPS (buffer) != NULL);
+    structure = gst_caps_get_structure (GST_BUFFER_CAPS (buffer), 0);
+    fail_unless (gst_structure_get_int (structure, "width", &width));
+    fail_unless_equals_int (width, frame < DUMMY_RESIZE_AT ? 16 : 32);
+  }
+  fail_unless_equals_int (i, FRAME_COUNT);
+
+  teardown_filter (filter);
+}
+
+GST_END_TEST
+GST_START_TEST (test_latency)
+{
+  GstElement *filter;
+  GstCaps *caps;
+  GstQuery *query;
+  gboolean live;
+  GstClockTime min, max;
+
+  filter = setup_filter ("omx_dummy");
+  gst_pad_set_query_function (mysrcpad, live_src_query);
+
+  fail_unless_equals_int (gst_element_set_state (filter, GST_STATE_PLAYING),
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_new_simple ("application/x-test", NULL);
+  push_buffers (caps, 0, FRAME_COUNT, BUFFER_SIZE, DURATION);
+  push_eos ();
+  gst_caps_unref (caps);
+
+  /* upstream adds nothing; at worst a frame sits in each of the two
+   * headers */
+  query = gst_query_new_latency ();
+  fail_unless (gst_pad_peer_query (mysinkpad, query));
+  gst_query_parse_latency (query, &live, &min, &max);
+  gst_query_unref (query);
+
+  fail_unless (live);
+  fail_unless (GST_CLOCK_TIME_IS_VALID (max));
+  fail_unless (max >= 2 * DURATION);
+  fail_unless (min <= max);
+
+  teardown_filter (filter);
 }
 
 GST_END_TEST static Suite *
@@ -173,9 +1082,41 @@ gstomx_suite (void)
   Suite *s = suite_create ("gstomx");
   TCase *tc_chain = tcase_create ("general");
 
+  {
+    void *dl_handle;
+
+    /* the same one, loaded by the plugin later on */
+    dl_handle = dlopen ("libomxil-foo.so", RTLD_LAZY);
+    if (dl_handle)
+      stats = dlsym (dl_handle, "dummy_stats");
+  }
+
   tcase_set_timeout (tc_chain, 10);
   tcase_add_test (tc_chain, test_basic);
   tcase_add_test (tc_chain, test_flush);
+  tcase_add_test (tc_chain, test_eager_start);
+  tcase_add_test (tc_chain, test_shard);
+  tcase_add_test (tc_chain, test_shard_segment);
+  tcase_add_test (tc_chain, test_zero_copy);
+  tcase_add_test (tc_chain, test_coalesce);
+  tcase_add_test (tc_chain, test_coalesce_latency);
+  tcase_add_test (tc_chain, test_reconfigure);
+  tcase_add_test (tc_chain, test_reconfigure_lent);
+  tcase_add_test (tc_chain, test_reconfigure_lent_allocated);
+  tcase_add_test (tc_chain, test_resize);
+  tcase_add_test (tc_chain, test_tunnel);
+  tcase_add_test (tc_chain, test_tunnel_refused);
+  tcase_add_test (tc_chain, test_handle_pool);
+  tcase_add_test (tc_chain, test_failed_start);
+  tcase_add_test (tc_chain, test_background_teardown);
+  tcase_add_test (tc_chain, test_parallel_allocation);
+  tcase_add_test (tc_chain, test_output_sharing);
+  tcase_add_test (tc_chain, test_buffer_strategy);
+  tcase_add_test (tc_chain, test_metadata);
+  tcase_add_test (tc_chain, test_keyframes);
+  tcase_add_test (tc_chain, test_qos);
+  tcase_add_test (tc_chain, test_latency);
+  tcase_add_test (tc_chain, test_settings_changed);
   suite_add_tcase (s, tc_chain);
 
   return s;
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * Author: Felipe Contreras <felipe.contreras@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <check.h>
+#include "mem.h"
+
+#define PAGE_SIZE 4096
+
+/* how long the reaper gets before an idle block counts as kept */
+#define IDLE_TIMEOUT (2 * G_USEC_PER_SEC)
+
+static void
+check_alloc (gsize size, MemFlags flags)
+{
+  guint8 *data;
+  gsize mapped;
+
+  data = mem_alloc (size, flags, &mapped);
+  fail_if (!data, "Allocation of %u bytes failed", (guint) size);
+  fail_if (GPOINTER_TO_SIZE (data) % PAGE_SIZE, "Not aligned");
+  fail_if (mapped < size, "Too small");
+  fail_if (mapped % PAGE_SIZE, "Not whole pages");
+
+  data[0] = data[mapped - 1] = 0xff;
+  mem_free (data, mapped, flags);
+}
+
+START_TEST (test_mem_alloc)
+{
+  /* heap */
+  check_alloc (1, 0);
+  check_alloc (100000, MEM_PREFAULT | MEM_LOCKED);
+
+  /* mapped */
+  check_alloc (1000000, 0);
+  check_alloc (1000000, MEM_PREFAULT | MEM_LOCKED);
+
+  /* an empty block is still a block */
+  check_alloc (0, 0);
+}
+
+END_TEST
+START_TEST (test_mem_alloc_huge)
+{
+  /* huge pages are a hint; without a huge page pool it still works */
+  check_alloc (1, MEM_HUGE_PAGES);
+  check_alloc (3 * 1024 * 1024, MEM_HUGE_PAGES);
+  check_alloc (3 * 1024 * 1024, MEM_HUGE_PAGES | MEM_PREFAULT);
+}
+
+END_TEST
+START_TEST (test_mem_pool)
+{
+  MemPool *pool;
+  MemBlock *a, *b;
+  gpointer data;
+
+  pool = mem_pool_new ();
+
+  /* nothing is kept without a limit */
+  a = mem_pool_alloc (pool, 100000, 0);
+  fail_if (!a, "Allocation failed");
+  mem_pool_release (a);
+  fail_if (pool->size != 0, "Kept without limit");
+
+  mem_pool_set_limits (pool, 1024 * 1024, 0);
+
+  a = mem_pool_alloc (pool, 100000, 0);
+  data = a->data;
+  mem_pool_release (a);
+  fail_if (pool->size == 0, "Not kept");
+
+  /* same size class is reused, other kinds are not */
+  a = mem_pool_alloc (pool, 100001, MEM_LOCKED);
+  fail_if (a->data == data, "Reused other kind");
+  b = mem_pool_alloc (pool, 100001, 0);
+  fail_if (b->data != data, "Not reused");
+  fail_if (pool->size != 0, "Size not updated");
+
+  mem_pool_release (a);
+  mem_pool_release (b);
+  fail_if (g_hash_table_size (pool->classes) != 2, "Not bucketed");
+
+  mem_pool_trim (pool, 0);
+  fail_if (pool->size != 0, "Not trimmed");
+  fail_if (g_hash_table_size (pool->classes) != 0, "Blocks left");
+
+  mem_pool_free (pool);
+}
+
+END_TEST
+START_TEST (test_mem_pool_idle)
+{
+  MemPool *pool;
+  MemBlock *a, *b;
+  gint64 end_time;
+  gsize size;
+
+  pool = mem_pool_new ();
+  mem_pool_set_limits (pool, 1024 * 1024, 50 * 1000);
+
+  a = mem_pool_alloc (pool, 100000, 0);
+  b = mem_pool_alloc (pool, 300000, 0);
+  mem_pool_release (a);
+  mem_pool_release (b);
+
+  /* expired without any further call into the pool */
+  end_time = g_get_monotonic_time () + IDLE_TIMEOUT;
+  do {
+    g_usleep (10 * 1000);
+
+    g_mutex_lock (pool->mutex);
+    size = pool->size;
+    g_mutex_unlock (pool->mutex);
+  } while (size != 0 && g_get_monotonic_time () < end_time);
+
+  fail_if (size != 0, "Idle blocks kept");
+
+  mem_pool_free (pool);
+}
+
+END_TEST static Suite *
+mem_suite (void)
+{
+  Suite *s = suite_create ("mem");
+
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_test (tc_core, test_mem_alloc);
+  tcase_add_test (tc_core, test_mem_alloc_huge);
+  tcase_add_test (tc_core, test_mem_pool);
+  tcase_add_test (tc_core, test_mem_pool_idle);
+  suite_add_tcase (s, tc_core);
+
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s;
+  SRunner *sr;
+
+  s = mem_suite ();
+  sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+
+  return (number_failed == 0) ? 0 : 1;
+}
@@ -24,12 +24,27 @@
 
 #include <glib.h>
 
-#include <stdlib.h>             /* For calloc, free */
+#include <stdlib.h>             /* For calloc, realloc, free */
 #include <string.h>             /* For memcpy */
 
 #include "async_queue.h"
+#include "dummy.h"
+
+/* OMX.dummy.scarce has room for so many instances, like hardware */
+#define SCARCE_HANDLES 2
+
+DummyStats dummy_stats;
+
+static volatile gint scarce_handles;
+
+/* the memory of the buffers we allocated, to tell when it's used again */
+static GStaticMutex own_lock = G_STATIC_MUTEX_INIT;
+static GHashTable *own_memory;
 
 static void *foo_thread (void *cb_data);
+static OMX_ERRORTYPE comp_AllocateBuffer (OMX_HANDLETYPE handle,
+    OMX_BUFFERHEADERTYPE ** buffer_header,
+    OMX_U32 index, OMX_PTR data, OMX_U32 size);
 
 OMX_ERRORTYPE
 OMX_Init (void)
@@ -58,14 +73,106 @@ struct CompPrivate
   CompPrivatePort *ports;
   gboolean done;
   GMutex *flush_mutex;
+  GCond *port_cond;
+  guint processed;
+  guint reconfigure_at;   /* the output buffers grow after so many */
+  gboolean reorder;       /* swaps each pair of outputs, like B-frames */
+  gboolean sink;          /* consumes the input, nothing comes out */
+  gboolean no_supplier;   /* can't tell who supplies tunneled buffers */
+  gboolean scarce;        /* counts in scarce_handles */
+  gboolean no_start;      /* never gets to Executing */
+  gboolean slow_stop;     /* takes DUMMY_SLOW_STOP to unload */
+  gboolean slow_alloc;    /* takes DUMMY_SLOW_ALLOC per buffer */
+  gboolean resize;        /* the output frame size changes twice */
+  guint resized;
+  OMX_BUFFERHEADERTYPE *held;
 };
 
 struct CompPrivatePort
 {
   OMX_PARAM_PORTDEFINITIONTYPE port_def;
   AsyncQueue *queue;
+  gboolean enabled;
+  OMX_COMPONENTTYPE *tunnel;   /* the peer, instead of the client */
+  OMX_BUFFERSUPPLIERTYPE supplier;
 };
 
+/* Hands @buffer of the input port back, to the supplier when tunneled. */
+static void
+empty_done (OMX_COMPONENTTYPE * comp, OMX_BUFFERHEADERTYPE * buffer)
+{
+  CompPrivate *private;
+  OMX_COMPONENTTYPE *tunnel;
+
+  private = comp->pComponentPrivate;
+  tunnel = private->ports[0].tunnel;
+
+  if (tunnel)
+    tunnel->FillThisBuffer (tunnel, buffer);
+  else
+    private->callbacks->EmptyBufferDone (comp, private->app_data, buffer);
+}
+
+/* Hands @buffer of the output port out, to the peer when tunneled. */
+static void
+fill_done (OMX_COMPONENTTYPE * comp, OMX_BUFFERHEADERTYPE * buffer)
+{
+  CompPrivate *private;
+  OMX_COMPONENTTYPE *tunnel;
+
+  private = comp->pComponentPrivate;
+  tunnel = private->ports[1].tunnel;
+
+  if (tunnel)
+    tunnel->EmptyThisBuffer (tunnel, buffer);
+  else
+    private->callbacks->FillBufferDone (comp, private->app_data, buffer);
+}
+
+/* Gives back the output kept for reordering; flush_mutex is held. */
+static void
+return_held (OMX_COMPONENTTYPE * comp)
+{
+  CompPrivate *private;
+
+  private = comp->pComponentPrivate;
+
+  if (private->held) {
+    fill_done (comp, private->held);
+    private->held = NULL;
+  }
+}
+
+/* Hands out @buffer, or keeps it to come out after the next one;
+ * flush_mutex is held. */
+static void
+emit_output (OMX_COMPONENTTYPE * comp, OMX_BUFFERHEADERTYPE * buffer)
+{
+  CompPrivate *private;
+
+  private = comp->pComponentPrivate;
+
+  if (!private->reorder) {
+    fill_done (comp, buffer);
+    return;
+  }
+
+  if (buffer->nFlags & OMX_BUFFERFLAG_EOS) {
+    /* nothing comes after this one */
+    return_held (comp);
+    fill_done (comp, buffer);
+    return;
+  }
+
+  if (!private->held) {
+    private->held = buffer;
+    return;
+  }
+
+  fill_done (comp, buffer);
+  return_held (comp);
+}
+
 static OMX_ERRORTYPE
 comp_GetState (OMX_HANDLETYPE handle, OMX_STATETYPE * state)
 {
@@ -98,10 +205,24 @@ comp_GetParameter (OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR param)
     {
       OMX_PARAM_PORTDEFINITIONTYPE *port_def;
       port_def = param;
+      if (port_def->nPortIndex >= 2)
+        return OMX_ErrorBadPortIndex;
       memcpy (port_def, &private->ports[port_def->nPortIndex].port_def,
           port_def->nSize);
       break;
     }
+    case OMX_IndexParamCompBufferSupplier:
+    {
+      OMX_PARAM_BUFFERSUPPLIERTYPE *supplier;
+      supplier = param;
+      if (private->no_supplier)
+        return OMX_ErrorUnsupportedIndex;
+      if (supplier->nPortIndex >= 2)
+        return OMX_ErrorBadPortIndex;
+      supplier->eBufferSupplier =
+          private->ports[supplier->nPortIndex].supplier;
+      break;
+    }
     default:
       break;
   }
@@ -125,10 +246,31 @@ comp_SetParameter (OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR param)
     {
       OMX_PARAM_PORTDEFINITIONTYPE *port_def;
       port_def = param;
+      if (port_def->nPortIndex >= 2)
+        return OMX_ErrorBadPortIndex;
       memcpy (&private->ports[port_def->nPortIndex].port_def, port_def,
           port_def->nSize);
       break;
     }
+    case OMX_IndexParamCompBufferSupplier:
+    {
+      OMX_PARAM_BUFFERSUPPLIERTYPE *supplier;
+      OMX_COMPONENTTYPE *tunnel;
+      supplier = param;
+      if (private->no_supplier)
+        return OMX_ErrorUnsupportedIndex;
+      if (supplier->nPortIndex >= 2)
+        return OMX_ErrorBadPortIndex;
+      private->ports[supplier->nPortIndex].supplier =
+          supplier->eBufferSupplier;
+      /* the input port tells the output one */
+      tunnel = private->ports[0].tunnel;
+      if (supplier->nPortIndex == 0 && tunnel) {
+        CompPrivate *peer = tunnel->pComponentPrivate;
+        peer->ports[1].supplier = supplier->eBufferSupplier;
+      }
+      break;
+    }
     default:
       break;
   }
@@ -136,6 +278,18 @@ comp_SetParameter (OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR param)
   return OMX_ErrorNone;
 }
 
+static OMX_ERRORTYPE
+comp_GetConfig (OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR config)
+{
+  return OMX_ErrorUnsupportedIndex;
+}
+
+static OMX_ERRORTYPE
+comp_SetConfig (OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR config)
+{
+  return OMX_ErrorUnsupportedIndex;
+}
+
 static OMX_ERRORTYPE
 comp_SendCommand (OMX_HANDLETYPE handle,
     OMX_COMMANDTYPE command, OMX_U32 param_1, OMX_PTR data)
@@ -151,9 +305,32 @@ comp_SendCommand (OMX_HANDLETYPE handle,
   switch (command) {
     case OMX_CommandStateSet:
     {
+      if (private->no_start && param_1 == OMX_StateExecuting) {
+        private->callbacks->EventHandler (handle, private->app_data,
+            OMX_EventError, OMX_ErrorInsufficientResources, 0, NULL);
+        break;
+      }
+
       if (private->state == OMX_StateLoaded && param_1 == OMX_StateIdle) {
+        CompPrivatePort *port = &private->ports[1];
+
+        /* tunneled output we supply starts out with us */
+        if (port->tunnel && port->supplier == OMX_BufferSupplyOutput) {
+          OMX_U32 i;
+
+          for (i = 0; i < port->port_def.nBufferCountActual; i++) {
+            OMX_BUFFERHEADERTYPE *buffer;
+
+            comp_AllocateBuffer (handle, &buffer, 1, NULL,
+                port->port_def.nBufferSize);
+            async_queue_push (port->queue, buffer);
+          }
+        }
+
         g_thread_create (foo_thread, comp, TRUE, NULL);
       }
+      if (private->slow_stop && param_1 == OMX_StateLoaded)
+        g_usleep (DUMMY_SLOW_STOP);
       private->state = param_1;
       private->callbacks->EventHandler (handle,
           private->app_data, OMX_EventCmdComplete,
@@ -167,12 +344,16 @@ comp_SendCommand (OMX_HANDLETYPE handle,
         OMX_BUFFERHEADERTYPE *buffer;
 
         while ((buffer = async_queue_pop_forced (private->ports[0].queue))) {
-          private->callbacks->EmptyBufferDone (comp, private->app_data, buffer);
+          empty_done (comp, buffer);
         }
 
-        while ((buffer = async_queue_pop_forced (private->ports[1].queue))) {
+        /* tunneled output we supply stays with us */
+        while (!private->ports[1].tunnel &&
+            (buffer = async_queue_pop_forced (private->ports[1].queue))) {
           private->callbacks->FillBufferDone (comp, private->app_data, buffer);
         }
+
+        return_held (comp);
       }
       g_mutex_unlock (private->flush_mutex);
 
@@ -181,6 +362,40 @@ comp_SendCommand (OMX_HANDLETYPE handle,
           OMX_CommandFlush, param_1, data);
     }
       break;
+    case OMX_CommandPortDisable:
+    {
+      OMX_BUFFERHEADERTYPE *buffer;
+
+      /* what we hold of the port goes back unprocessed */
+      g_mutex_lock (private->flush_mutex);
+      private->ports[param_1].enabled = FALSE;
+      while ((buffer = async_queue_pop_forced (private->ports[param_1].queue))) {
+        if (param_1 == 0)
+          empty_done (comp, buffer);
+        else
+          fill_done (comp, buffer);
+      }
+      if (param_1 == 1)
+        return_held (comp);
+      g_mutex_unlock (private->flush_mutex);
+
+      private->callbacks->EventHandler (handle,
+          private->app_data, OMX_EventCmdComplete,
+          OMX_CommandPortDisable, param_1, data);
+    }
+      break;
+    case OMX_CommandPortEnable:
+    {
+      g_mutex_lock (private->flush_mutex);
+      private->ports[param_1].enabled = TRUE;
+      g_cond_broadcast (private->port_cond);
+      g_mutex_unlock (private->flush_mutex);
+
+      private->callbacks->EventHandler (handle,
+          private->app_data, OMX_EventCmdComplete,
+          OMX_CommandPortEnable, param_1, data);
+    }
+      break;
     default:
       /* printf ("command: %d\n", command); */
       break;
@@ -189,13 +404,46 @@ comp_SendCommand (OMX_HANDLETYPE handle,
   return OMX_ErrorNone;
 }
 
+/* Does the work of a buffer call, counting the ones going on at once. */
+static void
+populate_slowly (void)
+{
+  gint now, max;
+
+  now = g_atomic_int_exchange_and_add (&dummy_stats.populating, 1) + 1;
+  do {
+    max = g_atomic_int_get (&dummy_stats.max_populating);
+  } while (now > max &&
+      !g_atomic_int_compare_and_exchange (&dummy_stats.max_populating, max,
+          now));
+
+  g_usleep (DUMMY_SLOW_ALLOC);
+
+  g_atomic_int_add (&dummy_stats.populating, -1);
+}
+
 static OMX_ERRORTYPE
 comp_UseBuffer (OMX_HANDLETYPE handle,
     OMX_BUFFERHEADERTYPE ** buffer_header,
     OMX_U32 index, OMX_PTR data, OMX_U32 size, OMX_U8 * buffer)
 {
+  OMX_COMPONENTTYPE *comp;
+  CompPrivate *private;
   OMX_BUFFERHEADERTYPE *new;
 
+  comp = handle;
+  private = comp->pComponentPrivate;
+
+  if (private->slow_alloc)
+    populate_slowly ();
+
+  if (buffer) {
+    g_static_mutex_lock (&own_lock);
+    if (own_memory && g_hash_table_lookup (own_memory, buffer))
+      g_atomic_int_inc (&dummy_stats.shared);
+    g_static_mutex_unlock (&own_lock);
+  }
+
   new = calloc (1, sizeof (OMX_BUFFERHEADERTYPE));
   new->nSize = sizeof (OMX_BUFFERHEADERTYPE);
   new->nVersion.nVersion = 1;
@@ -218,36 +466,155 @@ comp_UseBuffer (OMX_HANDLETYPE handle,
   return OMX_ErrorNone;
 }
 
+/* The data goes right after the header, and along with it. */
+static OMX_ERRORTYPE
+comp_AllocateBuffer (OMX_HANDLETYPE handle,
+    OMX_BUFFERHEADERTYPE ** buffer_header,
+    OMX_U32 index, OMX_PTR data, OMX_U32 size)
+{
+  OMX_ERRORTYPE error;
+  OMX_BUFFERHEADERTYPE *new;
+
+  error = comp_UseBuffer (handle, buffer_header, index, data, size, NULL);
+  if (error != OMX_ErrorNone)
+    return error;
+
+  new = realloc (*buffer_header, sizeof (OMX_BUFFERHEADERTYPE) + size);
+  new->pBuffer = (OMX_U8 *) (new + 1);
+  *buffer_header = new;
+
+  g_static_mutex_lock (&own_lock);
+  if (!own_memory)
+    own_memory = g_hash_table_new (NULL, NULL);
+  g_hash_table_insert (own_memory, new->pBuffer, new);
+  g_static_mutex_unlock (&own_lock);
+
+  g_atomic_int_inc (&dummy_stats.allocated);
+
+  return OMX_ErrorNone;
+}
+
 static OMX_ERRORTYPE
 comp_FreeBuffer (OMX_HANDLETYPE handle,
     OMX_U32 index, OMX_BUFFERHEADERTYPE * buffer_header)
 {
+  /* whatever still points at our memory must notice */
+  if (buffer_header->pBuffer == (OMX_U8 *) (buffer_header + 1)) {
+    memset (buffer_header->pBuffer, 0xa5, buffer_header->nAllocLen);
+
+    g_static_mutex_lock (&own_lock);
+    g_hash_table_remove (own_memory, buffer_header->pBuffer);
+    g_static_mutex_unlock (&own_lock);
+  }
+
   free (buffer_header);
 
   return OMX_ErrorNone;
 }
 
+/* The output needs bigger buffers from now on; nothing comes out until
+ * the port has been disabled and enabled again. */
+static void
+change_settings (OMX_COMPONENTTYPE * comp)
+{
+  CompPrivate *private;
+
+  private = comp->pComponentPrivate;
+
+  g_mutex_lock (private->flush_mutex);
+  private->ports[1].enabled = FALSE;
+  private->ports[1].port_def.nBufferSize *= 2;
+  g_mutex_unlock (private->flush_mutex);
+
+  private->callbacks->EventHandler (comp, private->app_data,
+      OMX_EventPortSettingsChanged, 1, 0, NULL);
+}
+
+/* The output frames are @scale times the size of the input ones from now
+ * on, like a decoder finding out; the buffers are big enough. */
+static void
+change_frame_size (OMX_COMPONENTTYPE * comp, guint scale)
+{
+  CompPrivate *private;
+  OMX_VIDEO_PORTDEFINITIONTYPE *in, *out;
+
+  private = comp->pComponentPrivate;
+  in = &private->ports[0].port_def.format.video;
+  out = &private->ports[1].port_def.format.video;
+
+  out->nFrameWidth = in->nFrameWidth * scale;
+  out->nFrameHeight = in->nFrameHeight * scale;
+  private->resized++;
+
+  private->callbacks->EventHandler (comp, private->app_data,
+      OMX_EventPortSettingsChanged, 1, OMX_IndexParamPortDefinition, NULL);
+}
+
 static gpointer
 foo_thread (gpointer cb_data)
 {
   OMX_COMPONENTTYPE *comp;
   CompPrivate *private;
+  OMX_BUFFERHEADERTYPE *in_buffer = NULL;
 
   comp = cb_data;
   private = comp->pComponentPrivate;
 
   while (!private->done) {
-    OMX_BUFFERHEADERTYPE *in_buffer;
     OMX_BUFFERHEADERTYPE *out_buffer;
 
-    in_buffer = async_queue_pop (private->ports[0].queue);
-    if (!in_buffer)
-      continue;
+    if (!in_buffer) {
+      in_buffer = async_queue_pop (private->ports[0].queue);
+      if (!in_buffer)
+        continue;
+
+      if (private->sink) {
+        /* rendered */
+        if (in_buffer->nFlags & OMX_BUFFERFLAG_EOS)
+          private->callbacks->EventHandler (comp, private->app_data,
+              OMX_EventBufferFlag, 0, in_buffer->nFlags, NULL);
+        empty_done (comp, in_buffer);
+        in_buffer = NULL;
+        private->processed++;
+        continue;
+      }
+
+      if (private->reconfigure_at &&
+          private->processed == private->reconfigure_at)
+        change_settings (comp);
+    }
+
+    g_mutex_lock (private->flush_mutex);
+    while (!private->ports[1].enabled)
+      g_cond_wait (private->port_cond, private->flush_mutex);
+    g_mutex_unlock (private->flush_mutex);
 
     out_buffer = async_queue_pop (private->ports[1].queue);
     if (!out_buffer)
       continue;
 
+    /* with a single buffer, the client is done with the previous output */
+    if (private->resize && private->resized == 0)
+      change_frame_size (comp, 1);
+    else if (private->resize && private->resized == 1 &&
+        private->processed == DUMMY_RESIZE_AT)
+      change_frame_size (comp, 2);
+
+    g_mutex_lock (private->flush_mutex);
+
+    if (!private->ports[1].enabled) {
+      /* disabled meanwhile; the input waits for the port to be back */
+      out_buffer->nFilledLen = 0;
+      fill_done (comp, out_buffer);
+      g_mutex_unlock (private->flush_mutex);
+      continue;
+    }
+
+    if (out_buffer->nAllocLen < private->ports[1].port_def.nBufferSize) {
+      private->callbacks->EventHandler (comp, private->app_data,
+          OMX_EventError, OMX_ErrorBadParameter, 0, NULL);
+    }
+
     /* process buffers */
     {
       unsigned long size;
@@ -257,13 +624,17 @@ foo_thread (gpointer cb_data)
       in_buffer->nFilledLen -= size;
       out_buffer->nTimeStamp = in_buffer->nTimeStamp;
       out_buffer->nFlags = in_buffer->nFlags;
-    }
 
-    g_mutex_lock (private->flush_mutex);
+      /* every third frame is a keyframe, whatever the input said */
+      if (private->reorder && size && out_buffer->pBuffer[0] % 3 == 0)
+        out_buffer->nFlags |= OMX_BUFFERFLAG_SYNCFRAME;
+    }
 
-    private->callbacks->FillBufferDone (comp, private->app_data, out_buffer);
+    emit_output (comp, out_buffer);
     if (in_buffer->nFilledLen == 0) {
-      private->callbacks->EmptyBufferDone (comp, private->app_data, in_buffer);
+      empty_done (comp, in_buffer);
+      in_buffer = NULL;
+      private->processed++;
     }
 
     g_mutex_unlock (private->flush_mutex);
@@ -311,6 +682,16 @@ OMX_GetHandle (OMX_HANDLETYPE * handle,
     OMX_STRING component_name, OMX_PTR data, OMX_CALLBACKTYPE * callbacks)
 {
   OMX_COMPONENTTYPE *comp;
+  gboolean scarce;
+
+  scarce = strcmp (component_name, "OMX.dummy.scarce") == 0;
+  if (scarce &&
+      g_atomic_int_exchange_and_add (&scarce_handles, 1) >= SCARCE_HANDLES) {
+    g_atomic_int_add (&scarce_handles, -1);
+    return OMX_ErrorInsufficientResources;
+  }
+
+  g_atomic_int_inc (&dummy_stats.handles);
 
   comp = calloc (1, sizeof (OMX_COMPONENTTYPE));
   comp->nSize = sizeof (OMX_COMPONENTTYPE);
@@ -319,8 +700,11 @@ OMX_GetHandle (OMX_HANDLETYPE * handle,
   comp->GetState = comp_GetState;
   comp->GetParameter = comp_GetParameter;
   comp->SetParameter = comp_SetParameter;
+  comp->GetConfig = comp_GetConfig;
+  comp->SetConfig = comp_SetConfig;
   comp->SendCommand = comp_SendCommand;
   comp->UseBuffer = comp_UseBuffer;
+  comp->AllocateBuffer = comp_AllocateBuffer;
   comp->FreeBuffer = comp_FreeBuffer;
   comp->EmptyThisBuffer = comp_EmptyThisBuffer;
   comp->FillThisBuffer = comp_FillThisBuffer;
@@ -334,9 +718,30 @@ OMX_GetHandle (OMX_HANDLETYPE * handle,
     private->app_data = data;
     private->ports = calloc (2, sizeof (CompPrivatePort));
     private->flush_mutex = g_mutex_new ();
+    private->port_cond = g_cond_new ();
+    private->scarce = scarce;
 
     private->ports[0].queue = async_queue_new ();
     private->ports[1].queue = async_queue_new ();
+    private->ports[0].enabled = TRUE;
+    private->ports[1].enabled = TRUE;
+
+    if (strcmp (component_name, "OMX.dummy.reconfigure") == 0)
+      private->reconfigure_at = 0x10;
+    else if (strcmp (component_name, "OMX.dummy.reorder") == 0)
+      private->reorder = TRUE;
+    else if (strcmp (component_name, "OMX.dummy.sink") == 0)
+      private->sink = TRUE;
+    else if (strcmp (component_name, "OMX.dummy.sink.nosupplier") == 0)
+      private->sink = private->no_supplier = TRUE;
+    else if (strcmp (component_name, "OMX.dummy.nostart") == 0)
+      private->no_start = TRUE;
+    else if (strcmp (component_name, "OMX.dummy.slowstop") == 0)
+      private->slow_stop = TRUE;
+    else if (strcmp (component_name, "OMX.dummy.slowalloc") == 0)
+      private->slow_alloc = TRUE;
+    else if (strcmp (component_name, "OMX.dummy.resize") == 0)
+      private->resize = TRUE;
 
     {
       OMX_PARAM_PORTDEFINITIONTYPE *port_def;
@@ -361,8 +766,9 @@ OMX_GetHandle (OMX_HANDLETYPE * handle,
       port_def->nVersion.nVersion = 1;
       port_def->nPortIndex = 1;
       port_def->eDir = OMX_DirOutput;
-      port_def->nBufferCountActual = 1;
-      port_def->nBufferCountMin = 1;
+      /* one kept back for reordering, one for the next frame */
+      port_def->nBufferCountActual = private->reorder ? 2 : 1;
+      port_def->nBufferCountMin = port_def->nBufferCountActual;
       port_def->nBufferSize = 0x1000;
       port_def->eDomain = OMX_PortDomainAudio;
     }
@@ -375,9 +781,47 @@ OMX_GetHandle (OMX_HANDLETYPE * handle,
   return OMX_ErrorNone;
 }
 
+/* The peers must both be ours; a NULL one takes the port out of the
+ * tunnel. Who supplies the buffers is left for the client to settle. */
+OMX_ERRORTYPE
+OMX_SetupTunnel (OMX_HANDLETYPE output, OMX_U32 output_port,
+    OMX_HANDLETYPE input, OMX_U32 input_port)
+{
+  OMX_COMPONENTTYPE *out_comp, *in_comp;
+
+  out_comp = output;
+  in_comp = input;
+
+  if ((out_comp && output_port != 1) || (in_comp && input_port != 0))
+    return OMX_ErrorBadPortIndex;
+
+  if (out_comp) {
+    CompPrivate *private = out_comp->pComponentPrivate;
+    private->ports[1].tunnel = in_comp;
+    private->ports[1].supplier = OMX_BufferSupplyUnspecified;
+  }
+
+  if (in_comp) {
+    CompPrivate *private = in_comp->pComponentPrivate;
+    private->ports[0].tunnel = out_comp;
+    private->ports[0].supplier = OMX_BufferSupplyUnspecified;
+  }
+
+  return OMX_ErrorNone;
+}
+
 OMX_ERRORTYPE
 OMX_FreeHandle (OMX_HANDLETYPE handle)
 {
+  OMX_COMPONENTTYPE *comp;
+  CompPrivate *private;
+
+  comp = handle;
+  private = comp->pComponentPrivate;
+
+  if (private->scarce)
+    g_atomic_int_add (&scarce_handles, -1);
+
     /** @todo Free private structure? */
   return OMX_ErrorNone;
 }
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2008-2009 Nokia Corporation.
+ *
+ * Author: Felipe Contreras <felipe.contreras@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef DUMMY_H
+#define DUMMY_H
+
+#include <glib.h>
+
+/* How long OMX.dummy.slowstop takes to go back to Loaded. */
+#define DUMMY_SLOW_STOP (G_USEC_PER_SEC / 2)
+
+/* How long OMX.dummy.slowalloc takes for each buffer. */
+#define DUMMY_SLOW_ALLOC (G_USEC_PER_SEC / 100)
+
+/* The frame OMX.dummy.resize doubles the output size at. */
+#define DUMMY_RESIZE_AT 0x10
+
+typedef struct DummyStats DummyStats;
+
+/* What the components did, for the tests to check; they find it with
+ * dlsym() in the library the plugin has loaded. Only accessed
+ * atomically. */
+struct DummyStats
+{
+  volatile gint handles;        /**< Got so far. */
+  volatile gint populating;     /**< Slow buffer calls going on. */
+  volatile gint max_populating; /**< Of them at once. */
+  volatile gint allocated;      /**< Buffers with memory of our own. */
+  volatile gint shared;         /**< Buffers used on memory we allocated. */
+};
+
+extern DummyStats dummy_stats;
+
+#endif /* DUMMY_H */
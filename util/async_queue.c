@@ -19,9 +19,215 @@
  *
  */
 
+#include "config.h"
+
 #include <glib.h>
 
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #include "async_queue.h"
+#include "sem.h"
+
+/*
+ * Bounded queues use a ring of sequenced slots (as in Vyukov's bounded
+ * MPMC queue), so push and pop don't allocate or take the mutex; the mutex
+ * and condition are only used to park a consumer on an empty ring. Should
+ * the ring ever be full, further entries spill into the list behind it
+ * until it is drained.
+ */
+
+static inline gboolean
+ring_push (AsyncQueue * queue, gpointer data)
+{
+  AsyncQueueSlot *slot;
+  guint pos;
+  gint dif;
+
+  pos = (guint) g_atomic_int_get (&queue->push_pos);
+
+  for (;;) {
+    slot = &queue->ring[pos & queue->mask];
+    dif = (gint) ((guint) g_atomic_int_get (&slot->sequence) - pos);
+
+    if (dif == 0) {
+      if (g_atomic_int_compare_and_exchange (&queue->push_pos, pos, pos + 1))
+        break;
+    } else if (dif < 0) {
+      return FALSE;
+    }
+
+    pos = (guint) g_atomic_int_get (&queue->push_pos);
+  }
+
+  slot->data = data;
+  g_atomic_int_set (&slot->sequence, pos + 1);
+  g_atomic_int_inc (&queue->length);
+
+  return TRUE;
+}
+
+static inline gpointer
+ring_pop (AsyncQueue * queue)
+{
+  AsyncQueueSlot *slot;
+  gpointer data;
+  guint pos;
+  gint dif;
+
+  pos = (guint) g_atomic_int_get (&queue->pop_pos);
+
+  for (;;) {
+    slot = &queue->ring[pos & queue->mask];
+    dif = (gint) ((guint) g_atomic_int_get (&slot->sequence) - (pos + 1));
+
+    if (dif == 0) {
+      if (g_atomic_int_compare_and_exchange (&queue->pop_pos, pos, pos + 1))
+        break;
+    } else if (dif < 0) {
+      return NULL;
+    }
+
+    pos = (guint) g_atomic_int_get (&queue->pop_pos);
+  }
+
+  data = slot->data;
+  g_atomic_int_set (&slot->sequence, pos + queue->mask + 1);
+  g_atomic_int_add (&queue->length, -1);
+
+  return data;
+}
+
+static inline void
+notify (AsyncQueue * queue)
+{
+  gint fd;
+  guint64 value = 1;
+
+  fd = g_atomic_int_get (&queue->fd);
+  if (G_LIKELY (fd < 0))
+    return;
+
+  while (write (fd, &value, sizeof (value)) < 0 && errno == EINTR);
+}
+
+static inline gpointer
+list_pop (AsyncQueue * queue)
+{
+  GList *node;
+  gpointer data;
+
+  node = queue->tail;
+  if (!node)
+    return NULL;
+
+  data = node->data;
+
+  queue->tail = node->prev;
+  if (queue->tail)
+    queue->tail->next = NULL;
+  else
+    queue->head = NULL;
+  g_atomic_int_add (&queue->length, -1);
+  g_list_free_1 (node);
+
+  return data;
+}
+
+static inline void
+list_push (AsyncQueue * queue, gpointer data)
+{
+  queue->head = g_list_prepend (queue->head, data);
+  if (!queue->tail)
+    queue->tail = queue->head;
+  g_atomic_int_inc (&queue->length);
+}
+
+/*
+ * Lock-free accesses to the ring are counted, so async_queue_reserve() can
+ * wait for them to leave before it swaps the ring. While it does, this
+ * returns FALSE with the mutex taken instead, which holds the swap off
+ * until ring_leave().
+ */
+static inline gboolean
+ring_enter (AsyncQueue * queue)
+{
+  g_atomic_int_inc (&queue->users);
+  if (G_LIKELY (!g_atomic_int_get (&queue->resizing)))
+    return TRUE;
+
+  g_atomic_int_add (&queue->users, -1);
+  g_mutex_lock (queue->mutex);
+
+  return FALSE;
+}
+
+static inline void
+ring_leave (AsyncQueue * queue, gboolean entered)
+{
+  if (entered)
+    g_atomic_int_add (&queue->users, -1);
+  else
+    g_mutex_unlock (queue->mutex);
+}
+
+/* Takes the oldest entry of a ring queue; the mutex is held. What spilled
+ * came after everything in the ring. */
+static inline gpointer
+ring_take_locked (AsyncQueue * queue)
+{
+  gpointer data;
+
+  data = ring_pop (queue);
+  if (!data && queue->spilled) {
+    data = list_pop (queue);
+    g_atomic_int_add (&queue->spilled, -1);
+  }
+
+  return data;
+}
+
+/* Pushes to a ring queue with the mutex held; if the ring is full, or
+ * entries spilled already, it goes behind them. */
+static inline void
+ring_push_locked (AsyncQueue * queue, gpointer data)
+{
+  if (queue->spilled || !ring_push (queue, data)) {
+    list_push (queue, data);
+    g_atomic_int_inc (&queue->spilled);
+  }
+}
+
+/* Whether the queue is a ring; set once by async_queue_reserve(), which
+ * wakes up whoever waits on the list meanwhile. */
+static inline gboolean
+is_ring (AsyncQueue * queue)
+{
+  return g_atomic_pointer_get ((volatile gpointer *) &queue->ring) != NULL;
+}
+
+static inline gpointer
+ring_take (AsyncQueue * queue)
+{
+  gpointer data;
+  gboolean entered;
+
+  entered = ring_enter (queue);
+  data = ring_pop (queue);
+  ring_leave (queue, entered);
+
+  if (G_UNLIKELY (!data && g_atomic_int_get (&queue->spilled))) {
+    g_mutex_lock (queue->mutex);
+    data = ring_take_locked (queue);
+    g_mutex_unlock (queue->mutex);
+  }
+
+  return data;
+}
 
 AsyncQueue *
 async_queue_new (void)
@@ -33,16 +239,92 @@ async_queue_new (void)
   queue->condition = g_cond_new ();
   queue->mutex = g_mutex_new ();
   queue->enabled = TRUE;
+  queue->fd = -1;
 
   return queue;
 }
 
+AsyncQueue *
+async_queue_new_bounded (guint capacity)
+{
+  AsyncQueue *queue;
+
+  queue = async_queue_new ();
+  async_queue_reserve (queue, capacity);
+
+  return queue;
+}
+
+/**
+ * Turns the queue into a ring able to hold at least @capacity entries.
+ * Queued entries are kept. Pushes and pops meanwhile wait for the new ring.
+ */
+void
+async_queue_reserve (AsyncQueue * queue, guint capacity)
+{
+  AsyncQueueSlot *ring;
+  GPtrArray *pending;
+  gpointer data;
+  guint size;
+  guint i;
+
+  g_mutex_lock (queue->mutex);
+
+  /* new accesses go for the mutex; wait for the ones already in */
+  g_atomic_int_set (&queue->resizing, TRUE);
+  while (g_atomic_int_get (&queue->users) > 0)
+    g_thread_yield ();
+
+  pending = g_ptr_array_new ();
+
+  if (queue->ring) {
+    while ((data = ring_take_locked (queue)))
+      g_ptr_array_add (pending, data);
+  } else {
+    while ((data = list_pop (queue)))
+      g_ptr_array_add (pending, data);
+  }
+
+  capacity = MAX (capacity, pending->len);
+  size = 1 << g_bit_storage (MAX (capacity, 1) - 1);
+
+  g_free (queue->ring);
+  ring = g_new (AsyncQueueSlot, size);
+  queue->mask = size - 1;
+
+  for (i = 0; i < size; i++) {
+    ring[i].sequence = i;
+    ring[i].data = NULL;
+  }
+
+  g_atomic_pointer_set ((volatile gpointer *) &queue->ring, ring);
+
+  g_atomic_int_set (&queue->push_pos, 0);
+  g_atomic_int_set (&queue->pop_pos, 0);
+
+  for (i = 0; i < pending->len; i++)
+    ring_push (queue, g_ptr_array_index (pending, i));
+
+  g_ptr_array_free (pending, TRUE);
+
+  g_atomic_int_set (&queue->resizing, FALSE);
+
+  /* waiters on the list have to go for the ring */
+  g_cond_broadcast (queue->condition);
+
+  g_mutex_unlock (queue->mutex);
+}
+
 void
 async_queue_free (AsyncQueue * queue)
 {
+  if (queue->fd >= 0)
+    close (queue->fd);
+
   g_cond_free (queue->condition);
   g_mutex_free (queue->mutex);
 
+  g_free (queue->ring);
   g_list_free (queue->head);
   g_slice_free (AsyncQueue, queue);
 }
@@ -50,22 +332,145 @@ async_queue_free (AsyncQueue * queue)
 void
 async_queue_push (AsyncQueue * queue, gpointer data)
 {
+  if (is_ring (queue)) {
+    gboolean entered;
+    gboolean pushed = FALSE;
+
+    entered = ring_enter (queue);
+    if (G_LIKELY (!g_atomic_int_get (&queue->spilled)))
+      pushed = ring_push (queue, data);
+    ring_leave (queue, entered);
+
+    if (G_UNLIKELY (!pushed)) {
+      /* full; keep it behind the ring instead of losing it */
+      g_mutex_lock (queue->mutex);
+      ring_push_locked (queue, data);
+      g_mutex_unlock (queue->mutex);
+    }
+
+    notify (queue);
+
+    /* only wake up when somebody is actually parked */
+    if (g_atomic_int_get (&queue->waiters) > 0) {
+      g_mutex_lock (queue->mutex);
+      g_cond_signal (queue->condition);
+      g_mutex_unlock (queue->mutex);
+    }
+    return;
+  }
+
   g_mutex_lock (queue->mutex);
 
-  queue->head = g_list_prepend (queue->head, data);
-  if (!queue->tail)
-    queue->tail = queue->head;
-  queue->length++;
+  if (G_UNLIKELY (queue->ring))
+    ring_push_locked (queue, data);
+  else
+    list_push (queue, data);
 
   g_cond_signal (queue->condition);
 
   g_mutex_unlock (queue->mutex);
+
+  notify (queue);
+}
+
+static gpointer
+ring_pop_wait (AsyncQueue * queue, gint64 end_time, gboolean * timed_out)
+{
+  gpointer data;
+
+  if (!g_atomic_int_get (&queue->enabled))
+    return NULL;
+
+  data = ring_take (queue);
+  if (data)
+    return data;
+
+  g_mutex_lock (queue->mutex);
+  g_atomic_int_inc (&queue->waiters);
+
+  /* a push might have slipped in before we were registered */
+  data = ring_take_locked (queue);
+
+  /* wakeups can be spurious, and pushes signal only while we are counted */
+  while (!data && queue->enabled) {
+    gboolean signaled;
+
+    signaled = g_sem_cond_wait_until (queue->condition, queue->mutex, end_time);
+    data = ring_take_locked (queue);
+    if (!data && !signaled) {
+      *timed_out = TRUE;
+      break;
+    }
+  }
+
+  g_atomic_int_add (&queue->waiters, -1);
+  g_mutex_unlock (queue->mutex);
+
+  return data;
+}
+
+static guint
+ring_pop_many (AsyncQueue * queue, gpointer * data, guint max,
+    gint64 end_time, gboolean * timed_out)
+{
+  guint count;
+
+  data[0] = ring_pop_wait (queue, end_time, timed_out);
+  if (!data[0])
+    return 0;
+
+  for (count = 1; count < max; count++) {
+    data[count] = ring_take (queue);
+    if (!data[count])
+      break;
+  }
+
+  return count;
+}
+
+/*
+ * Waits with the mutex held for the list to get an entry, the queue to be
+ * disabled, or @end_time. Returns FALSE if the queue turned into a ring
+ * meanwhile, to be waited on as such.
+ */
+static gboolean
+list_wait (AsyncQueue * queue, gint64 end_time, gboolean * timed_out)
+{
+  /* wakeups can be spurious */
+  while (!queue->tail && queue->enabled && !queue->ring) {
+    if (!g_sem_cond_wait_until (queue->condition, queue->mutex, end_time)) {
+      *timed_out = !queue->tail;
+      break;
+    }
+  }
+
+  return !queue->ring;
 }
 
 gpointer
 async_queue_pop (AsyncQueue * queue)
+{
+  return async_queue_pop_until (queue, -1, NULL);
+}
+
+/**
+ * Like async_queue_pop(), but gives up at @end_time (monotonic, see
+ * g_get_monotonic_time()); a negative @end_time waits forever. @timed_out,
+ * if given, tells a timeout apart from a disabled queue.
+ */
+gpointer
+async_queue_pop_until (AsyncQueue * queue, gint64 end_time,
+    gboolean * timed_out)
 {
   gpointer data = NULL;
+  gboolean dummy;
+
+  if (!timed_out)
+    timed_out = &dummy;
+  *timed_out = FALSE;
+
+  if (is_ring (queue))
+    return ring_pop_wait (queue, end_time, timed_out);
 
   g_mutex_lock (queue->mutex);
 
@@ -74,22 +479,12 @@ async_queue_pop (AsyncQueue * queue)
     goto leave;
   }
 
-  if (!queue->tail) {
-    g_cond_wait (queue->condition, queue->mutex);
+  if (!list_wait (queue, end_time, timed_out)) {
+    g_mutex_unlock (queue->mutex);
+    return ring_pop_wait (queue, end_time, timed_out);
   }
 
-  if (queue->tail) {
-    GList *node = queue->tail;
-    data = node->data;
-
-    queue->tail = node->prev;
-    if (queue->tail)
-      queue->tail->next = NULL;
-    else
-      queue->head = NULL;
-    queue->length--;
-    g_list_free_1 (node);
-  }
+  data = list_pop (queue);
 
 leave:
   g_mutex_unlock (queue->mutex);
@@ -97,26 +492,66 @@ leave:
   return data;
 }
 
-gpointer
-async_queue_pop_forced (AsyncQueue * queue)
+guint
+async_queue_pop_many (AsyncQueue * queue, gpointer * data, guint max)
 {
-  gpointer data = NULL;
+  return async_queue_pop_many_until (queue, data, max, -1, NULL);
+}
+
+/**
+ * Waits like async_queue_pop_until() for the first entry, then takes every
+ * other entry that is ready, up to @max. Returns the number of entries
+ * stored in @data.
+ */
+guint
+async_queue_pop_many_until (AsyncQueue * queue, gpointer * data, guint max,
+    gint64 end_time, gboolean * timed_out)
+{
+  guint count = 0;
+  gboolean dummy;
+
+  if (!timed_out)
+    timed_out = &dummy;
+  *timed_out = FALSE;
+
+  if (G_UNLIKELY (max == 0))
+    return 0;
+
+  if (is_ring (queue))
+    return ring_pop_many (queue, data, max, end_time, timed_out);
 
   g_mutex_lock (queue->mutex);
 
-  if (queue->tail) {
-    GList *node = queue->tail;
-    data = node->data;
+  if (!queue->enabled)
+    goto leave;
 
-    queue->tail = node->prev;
-    if (queue->tail)
-      queue->tail->next = NULL;
-    else
-      queue->head = NULL;
-    queue->length--;
-    g_list_free_1 (node);
+  if (!list_wait (queue, end_time, timed_out)) {
+    g_mutex_unlock (queue->mutex);
+    return ring_pop_many (queue, data, max, end_time, timed_out);
   }
 
+  while (count < max && queue->tail)
+    data[count++] = list_pop (queue);
+
+leave:
+  g_mutex_unlock (queue->mutex);
+
+  return count;
+}
+
+gpointer
+async_queue_pop_forced (AsyncQueue * queue)
+{
+  gpointer data = NULL;
+
+  if (is_ring (queue))
+    return ring_take (queue);
+
+  g_mutex_lock (queue->mutex);
+  if (G_UNLIKELY (queue->ring))
+    data = ring_take_locked (queue);
+  else
+    data = list_pop (queue);
   g_mutex_unlock (queue->mutex);
 
   return data;
@@ -126,16 +561,18 @@ void
 async_queue_disable (AsyncQueue * queue)
 {
   g_mutex_lock (queue->mutex);
-  queue->enabled = FALSE;
+  g_atomic_int_set (&queue->enabled, FALSE);
   g_cond_broadcast (queue->condition);
   g_mutex_unlock (queue->mutex);
+
+  notify (queue);
 }
 
 void
 async_queue_enable (AsyncQueue * queue)
 {
   g_mutex_lock (queue->mutex);
-  queue->enabled = TRUE;
+  g_atomic_int_set (&queue->enabled, TRUE);
   g_mutex_unlock (queue->mutex);
 }
 
@@ -143,8 +580,51 @@ void
 async_queue_flush (AsyncQueue * queue)
 {
   g_mutex_lock (queue->mutex);
-  g_list_free (queue->head);
-  queue->head = queue->tail = NULL;
-  queue->length = 0;
+  if (queue->ring) {
+    while (ring_take_locked (queue));
+  } else {
+    g_list_free (queue->head);
+    queue->head = queue->tail = NULL;
+    g_atomic_int_set (&queue->length, 0);
+  }
   g_mutex_unlock (queue->mutex);
 }
+
+/**
+ * Returns a file descriptor that polls readable after something was pushed
+ * or the queue got disabled, so one thread can wait on many queues. Call
+ * async_queue_clear_fd() before draining with async_queue_pop_until
+ * (queue, 0, NULL), so later pushes are not missed. Returns -1 if this
+ * platform has no eventfd.
+ */
+gint
+async_queue_get_fd (AsyncQueue * queue)
+{
+  g_mutex_lock (queue->mutex);
+
+#ifdef HAVE_SYS_EVENTFD_H
+  if (queue->fd < 0) {
+    g_atomic_int_set (&queue->fd, eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC));
+
+    /* entries might be queued already; a spurious wakeup is harmless */
+    notify (queue);
+  }
+#endif
+
+  g_mutex_unlock (queue->mutex);
+
+  return queue->fd;
+}
+
+void
+async_queue_clear_fd (AsyncQueue * queue)
+{
+  guint64 value;
+  gint fd;
+
+  fd = g_atomic_int_get (&queue->fd);
+  if (fd < 0)
+    return;
+
+  while (read (fd, &value, sizeof (value)) < 0 && errno == EINTR);
+}
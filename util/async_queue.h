@@ -24,7 +24,16 @@
 
 #include <glib.h>
 
+#define ASYNC_QUEUE_CACHE_LINE 64
+
 typedef struct AsyncQueue AsyncQueue;
+typedef struct AsyncQueueSlot AsyncQueueSlot;
+
+struct AsyncQueueSlot
+{
+  volatile gint sequence;
+  gpointer data;
+};
 
 struct AsyncQueue
 {
@@ -32,17 +41,43 @@ struct AsyncQueue
   GCond *condition;
   GList *head;
   GList *tail;
-  guint length;
+  volatile gint length;
   gboolean enabled;
+
+  /* Bounded (ring) variant; ring is NULL for unbounded queues. */
+  AsyncQueueSlot *ring;
+  guint mask;
+  volatile gint waiters;
+  volatile gint spilled;        /**< Entries in the list, the ring being full. */
+  volatile gint users;          /**< Lock-free accesses to the ring going on. */
+  volatile gint resizing;
+
+  volatile gint fd;     /**< Notification fd, or -1 until requested. */
+
+  /* Keep producer and consumer positions on separate cache lines. */
+  gchar pad0[ASYNC_QUEUE_CACHE_LINE];
+  volatile gint push_pos;
+  gchar pad1[ASYNC_QUEUE_CACHE_LINE - sizeof (gint)];
+  volatile gint pop_pos;
+  gchar pad2[ASYNC_QUEUE_CACHE_LINE - sizeof (gint)];
 };
 
 AsyncQueue *async_queue_new (void);
+AsyncQueue *async_queue_new_bounded (guint capacity);
+void async_queue_reserve (AsyncQueue * queue, guint capacity);
 void async_queue_free (AsyncQueue * queue);
 void async_queue_push (AsyncQueue * queue, gpointer data);
 gpointer async_queue_pop (AsyncQueue * queue);
+gpointer async_queue_pop_until (AsyncQueue * queue, gint64 end_time,
+    gboolean * timed_out);
+guint async_queue_pop_many (AsyncQueue * queue, gpointer * data, guint max);
+guint async_queue_pop_many_until (AsyncQueue * queue, gpointer * data,
+    guint max, gint64 end_time, gboolean * timed_out);
 gpointer async_queue_pop_forced (AsyncQueue * queue);
 void async_queue_disable (AsyncQueue * queue);
 void async_queue_enable (AsyncQueue * queue);
 void async_queue_flush (AsyncQueue * queue);
+gint async_queue_get_fd (AsyncQueue * queue);
+void async_queue_clear_fd (AsyncQueue * queue);
 
 #endif /* ASYNC_QUEUE_H */
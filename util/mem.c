@@ -0,0 +1,382 @@
+/*
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * Author: Felipe Contreras <felipe.contreras@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mem.h"
+#include "sem.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* below this, rounding up to a whole huge page wastes too much */
+#define HUGE_PAGE_MIN (HUGE_PAGE_SIZE / 2)
+
+/* below this, a mapping per block costs more than it saves; same as
+ * malloc's own threshold */
+#define MAP_MIN (128 * 1024)
+
+static inline gsize
+round_up (gsize size, gsize align)
+{
+  return (size + align - 1) & ~(align - 1);
+}
+
+/**
+ * Allocates @size bytes, aligned at least to a page (so to any cache line
+ * or SIMD requirement). Small blocks come from the heap, bigger ones
+ * straight from the kernel. @mapped is set to the length to pass to
+ * mem_free(). Returns NULL on failure.
+ */
+gpointer
+mem_alloc (gsize size, MemFlags flags, gsize * mapped)
+{
+  gpointer data = MAP_FAILED;
+  gsize page_size;
+  gsize len = 0;
+
+  page_size = sysconf (_SC_PAGESIZE);
+
+  /* an empty mapping is an error */
+  if (size == 0)
+    size = 1;
+
+  if (round_up (size, page_size) < MAP_MIN) {
+    len = round_up (size, page_size);
+    if (posix_memalign (&data, page_size, len) != 0)
+      return NULL;
+  }
+
+#ifdef MAP_HUGETLB
+  if ((flags & MEM_HUGE_PAGES) && size >= HUGE_PAGE_MIN) {
+    len = round_up (size, HUGE_PAGE_SIZE);
+    data = mmap (NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+
+  if (data == MAP_FAILED) {
+    len = round_up (size, page_size);
+    data = mmap (NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+      return NULL;
+
+#ifdef MADV_HUGEPAGE
+    /* no huge page pool; let the kernel collapse it later if it can */
+    if ((flags & MEM_HUGE_PAGES) && len >= HUGE_PAGE_SIZE)
+      madvise (data, len, MADV_HUGEPAGE);
+#endif
+  }
+
+  if (flags & MEM_PREFAULT) {
+    gsize offset;
+
+    for (offset = 0; offset < len; offset += page_size)
+      ((volatile guint8 *) data)[offset] = 0;
+  }
+
+  /* failing is fine, it's usually just RLIMIT_MEMLOCK */
+  if ((flags & MEM_LOCKED) && mlock (data, len) != 0) {
+    static gint warned;
+
+    if (g_atomic_int_compare_and_exchange (&warned, 0, 1))
+      g_warning ("could not lock buffer memory: %s", g_strerror (errno));
+  }
+
+  *mapped = len;
+
+  return data;
+}
+
+void
+mem_free (gpointer data, gsize mapped, MemFlags flags)
+{
+  if (!data)
+    return;
+
+  if (mapped < MAP_MIN) {
+    /* the heap keeps the pages, and so their lock */
+    if (flags & MEM_LOCKED)
+      munlock (data, mapped);
+    free (data);
+  } else
+    munmap (data, mapped);
+}
+
+/*
+ * Pool
+ */
+
+/* flags that change what the memory is, as opposed to how it starts */
+#define MEM_KIND_FLAGS (MEM_HUGE_PAGES | MEM_LOCKED)
+
+/* Four classes per power of two, so at most 25% is wasted. */
+static inline gsize
+size_class (gsize size)
+{
+  gsize page_size;
+  gsize step;
+
+  page_size = sysconf (_SC_PAGESIZE);
+
+  if (size <= page_size)
+    return page_size;
+
+  step = ((gsize) 1 << (g_bit_storage (size) - 1)) / 4;
+
+  return round_up (size, MAX (step, page_size));
+}
+
+static inline void
+block_free (MemBlock * block)
+{
+  mem_free (block->data, block->mapped, block->flags);
+  g_slice_free (MemBlock, block);
+}
+
+/* size classes are page multiples, so the kind fits in the low bits */
+static inline gpointer
+class_key (gsize size, MemFlags flags)
+{
+  return GSIZE_TO_POINTER (size | (flags & MEM_KIND_FLAGS));
+}
+
+/* Returns the least recently released block, and its class in @queue. */
+static MemBlock *
+pool_oldest (MemPool * pool, GQueue ** queue)
+{
+  GHashTableIter iter;
+  gpointer value;
+  MemBlock *oldest = NULL;
+
+  g_hash_table_iter_init (&iter, pool->classes);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    MemBlock *block = g_queue_peek_tail (value);
+
+    if (!oldest || block->released < oldest->released) {
+      oldest = block;
+      *queue = value;
+    }
+  }
+
+  return oldest;
+}
+
+/* Drops the oldest blocks until the limits hold. Called locked. */
+static void
+pool_expire (MemPool * pool, gsize max_size, gint64 max_idle)
+{
+  MemBlock *block;
+  GQueue *queue;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+
+  while ((block = pool_oldest (pool, &queue))) {
+    if (pool->size <= max_size &&
+        (!max_idle || now - block->released <= max_idle))
+      break;
+
+    g_queue_pop_tail (queue);
+    if (g_queue_is_empty (queue)) {
+      g_hash_table_remove (pool->classes,
+          class_key (block->size, block->flags));
+      g_queue_free (queue);
+    }
+
+    pool->size -= block->mapped;
+    block_free (block);
+  }
+}
+
+/* Expires idle blocks as they age, even if nothing is allocated anymore. */
+static gpointer
+pool_reaper (gpointer data)
+{
+  MemPool *pool = data;
+
+  g_mutex_lock (pool->mutex);
+
+  while (!pool->quit) {
+    MemBlock *oldest;
+    GQueue *queue;
+    gint64 end_time = -1;
+
+    oldest = pool_oldest (pool, &queue);
+    if (oldest && pool->max_idle)
+      end_time = oldest->released + pool->max_idle + 1;
+
+    g_sem_cond_wait_until (pool->cond, pool->mutex, end_time);
+    pool_expire (pool, pool->max_size, pool->max_idle);
+  }
+
+  g_mutex_unlock (pool->mutex);
+
+  return NULL;
+}
+
+MemPool *
+mem_pool_new (void)
+{
+  MemPool *pool;
+
+  pool = g_new0 (MemPool, 1);
+  pool->mutex = g_mutex_new ();
+  pool->cond = g_cond_new ();
+  pool->classes = g_hash_table_new (NULL, NULL);
+
+  return pool;
+}
+
+void
+mem_pool_free (MemPool * pool)
+{
+  if (pool->reaper) {
+    g_mutex_lock (pool->mutex);
+    pool->quit = TRUE;
+    g_cond_signal (pool->cond);
+    g_mutex_unlock (pool->mutex);
+
+    g_thread_join (pool->reaper);
+  }
+
+  mem_pool_trim (pool, 0);
+
+  g_hash_table_destroy (pool->classes);
+  g_cond_free (pool->cond);
+  g_mutex_free (pool->mutex);
+  g_free (pool);
+}
+
+void
+mem_pool_set_limits (MemPool * pool, gsize max_size, gint64 max_idle)
+{
+  g_mutex_lock (pool->mutex);
+  pool->max_size = max_size;
+  pool->max_idle = max_idle;
+  pool_expire (pool, pool->max_size, pool->max_idle);
+
+  if (max_idle && !pool->reaper)
+    pool->reaper = g_thread_create (pool_reaper, pool, TRUE, NULL);
+  g_cond_signal (pool->cond);
+
+  g_mutex_unlock (pool->mutex);
+}
+
+/**
+ * Returns a block of at least @size bytes, reusing a released one of the
+ * same size class and kind if there's any. Returns NULL on failure.
+ */
+MemBlock *
+mem_pool_alloc (MemPool * pool, gsize size, MemFlags flags)
+{
+  MemBlock *block = NULL;
+  GQueue *queue;
+
+  size = size_class (size);
+
+  g_mutex_lock (pool->mutex);
+
+  pool_expire (pool, pool->max_size, pool->max_idle);
+
+  queue = g_hash_table_lookup (pool->classes, class_key (size, flags));
+  if (queue) {
+    block = g_queue_pop_head (queue);
+    if (g_queue_is_empty (queue)) {
+      g_hash_table_remove (pool->classes, class_key (size, flags));
+      g_queue_free (queue);
+    }
+    pool->size -= block->mapped;
+  }
+
+  g_mutex_unlock (pool->mutex);
+
+  if (block)
+    return block;
+
+  block = g_slice_new0 (MemBlock);
+  block->data = mem_alloc (size, flags, &block->mapped);
+
+  if (!block->data) {
+    g_slice_free (MemBlock, block);
+    return NULL;
+  }
+
+  block->size = size;
+  block->flags = flags;
+  block->pool = pool;
+
+  return block;
+}
+
+void
+mem_pool_release (MemBlock * block)
+{
+  MemPool *pool;
+  GQueue *queue;
+
+  pool = block->pool;
+
+  g_mutex_lock (pool->mutex);
+
+  if (pool->size + block->mapped > pool->max_size) {
+    g_mutex_unlock (pool->mutex);
+    block_free (block);
+    return;
+  }
+
+  queue = g_hash_table_lookup (pool->classes,
+      class_key (block->size, block->flags));
+  if (!queue) {
+    queue = g_queue_new ();
+    g_hash_table_insert (pool->classes,
+        class_key (block->size, block->flags), queue);
+  }
+
+  block->released = g_get_monotonic_time ();
+  g_queue_push_head (queue, block);
+  pool->size += block->mapped;
+
+  /* the reaper may be waiting for nothing */
+  if (pool->reaper)
+    g_cond_signal (pool->cond);
+
+  g_mutex_unlock (pool->mutex);
+}
+
+/**
+ * Frees released blocks, oldest first, until at most @max_size bytes are
+ * kept.
+ */
+void
+mem_pool_trim (MemPool * pool, gsize max_size)
+{
+  g_mutex_lock (pool->mutex);
+  pool_expire (pool, max_size, pool->max_idle);
+  g_mutex_unlock (pool->mutex);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2009 Nokia Corporation.
+ *
+ * Author: Felipe Contreras <felipe.contreras@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef MEM_H
+#define MEM_H
+
+#include <glib.h>
+
+typedef enum
+{
+  MEM_HUGE_PAGES = 1 << 0,   /**< Try huge pages, then transparent ones. */
+  MEM_LOCKED = 1 << 1,       /**< mlock() it, if allowed. */
+  MEM_PREFAULT = 1 << 2,     /**< Touch every page up front. */
+} MemFlags;
+
+typedef struct MemPool MemPool;
+typedef struct MemBlock MemBlock;
+
+struct MemBlock
+{
+  gpointer data;
+  gsize size;       /**< Size class it was allocated for. */
+  gsize mapped;
+  MemFlags flags;
+  MemPool *pool;
+  gint64 released;
+};
+
+/**
+ * Keeps released blocks around for reuse, bucketed by size class, up to
+ * max_size bytes and for at most max_idle microseconds (0 = no limit).
+ * With an idle limit, a thread frees the blocks as they expire.
+ */
+struct MemPool
+{
+  GMutex *mutex;
+  GCond *cond;
+  GHashTable *classes;   /**< GQueue per size class and kind, most recently released first. */
+  GThread *reaper;
+  gboolean quit;
+  gsize size;
+  gsize max_size;
+  gint64 max_idle;
+};
+
+gpointer mem_alloc (gsize size, MemFlags flags, gsize * mapped);
+void mem_free (gpointer data, gsize mapped, MemFlags flags);
+
+MemPool *mem_pool_new (void);
+void mem_pool_free (MemPool * pool);
+void mem_pool_set_limits (MemPool * pool, gsize max_size, gint64 max_idle);
+MemBlock *mem_pool_alloc (MemPool * pool, gsize size, MemFlags flags);
+void mem_pool_release (MemBlock * block);
+void mem_pool_trim (MemPool * pool, gsize max_size);
+
+#endif /* MEM_H */
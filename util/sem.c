@@ -19,8 +19,18 @@
  *
  */
 
+#include "config.h"
+
 #include <glib.h>
 
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #include "sem.h"
 
 GSem *
@@ -33,34 +43,155 @@ g_sem_new (void)
   sem->mutex = g_mutex_new ();
   sem->counter = 0;
 
+#ifdef HAVE_SYS_EVENTFD_H
+  /* each read takes one unit, and the fd is readable while the count is
+   * positive; on failure we silently fall back to mutex + condition */
+  sem->fd = eventfd (0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+  sem->fd = -1;
+#endif
+
   return sem;
 }
 
 void
 g_sem_free (GSem * sem)
 {
+  if (sem->fd >= 0)
+    close (sem->fd);
   g_cond_free (sem->condition);
   g_mutex_free (sem->mutex);
   g_free (sem);
 }
 
+/**
+ * Returns a file descriptor that polls readable while the semaphore can be
+ * taken, or -1 if this platform has no such backend. Take it with
+ * g_sem_down_until (sem, 0) once poll() says so.
+ */
+gint
+g_sem_get_fd (GSem * sem)
+{
+  return sem->fd;
+}
+
+/**
+ * Waits on @cond until @end_time, in g_get_monotonic_time() units; a
+ * negative @end_time waits forever. Returns FALSE if the deadline passed.
+ */
+gboolean
+g_sem_cond_wait_until (GCond * cond, GMutex * mutex, gint64 end_time)
+{
+  GTimeVal tv;
+  gint64 remaining;
+
+  if (end_time < 0) {
+    g_cond_wait (cond, mutex);
+    return TRUE;
+  }
+
+  remaining = end_time - g_get_monotonic_time ();
+  if (remaining <= 0)
+    return FALSE;
+
+  /* g_cond_timed_wait() wants wall-clock time */
+  g_get_current_time (&tv);
+  g_time_val_add (&tv, remaining);
+
+  return g_cond_timed_wait (cond, mutex, &tv);
+}
+
+/**
+ * Waits for @fd to become readable until @end_time, like
+ * g_sem_cond_wait_until().
+ */
+gboolean
+g_sem_fd_wait_until (gint fd, gint64 end_time)
+{
+  struct pollfd pfd;
+  gint timeout = -1;
+  gint r;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  do {
+    if (end_time >= 0) {
+      gint64 remaining;
+
+      remaining = end_time - g_get_monotonic_time ();
+      if (remaining <= 0)
+        return FALSE;
+
+      /* round up, so we don't spin on the last millisecond */
+      timeout = (gint) MIN ((remaining + 999) / 1000, G_MAXINT);
+    }
+
+    r = poll (&pfd, 1, timeout);
+  } while (r < 0 && errno == EINTR);
+
+  return r > 0;
+}
+
 void
 g_sem_down (GSem * sem)
 {
+  /* without a deadline it only fails if the fd is broken */
+  if (G_UNLIKELY (!g_sem_down_until (sem, -1)))
+    g_error ("waiting on semaphore %d failed: %s", sem->fd,
+        g_strerror (errno));
+}
+
+/**
+ * Returns FALSE, without taking the semaphore, if it could not be taken
+ * before @end_time.
+ */
+gboolean
+g_sem_down_until (GSem * sem, gint64 end_time)
+{
+  gboolean ret = TRUE;
+
+  if (sem->fd >= 0) {
+    guint64 value;
+
+    while (read (sem->fd, &value, sizeof (value)) != sizeof (value)) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN || !g_sem_fd_wait_until (sem->fd, end_time))
+        return FALSE;
+    }
+
+    return TRUE;
+  }
+
   g_mutex_lock (sem->mutex);
 
   while (sem->counter == 0) {
-    g_cond_wait (sem->condition, sem->mutex);
+    if (!g_sem_cond_wait_until (sem->condition, sem->mutex, end_time) &&
+        sem->counter == 0) {
+      ret = FALSE;
+      goto leave;
+    }
   }
 
   sem->counter--;
 
+leave:
   g_mutex_unlock (sem->mutex);
+
+  return ret;
 }
 
 void
 g_sem_up (GSem * sem)
 {
+  if (sem->fd >= 0) {
+    guint64 value = 1;
+
+    while (write (sem->fd, &value, sizeof (value)) < 0 && errno == EINTR);
+    return;
+  }
+
   g_mutex_lock (sem->mutex);
 
   sem->counter++;
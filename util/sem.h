@@ -31,11 +31,17 @@ struct GSem
   GCond *condition;
   GMutex *mutex;
   gint counter;
+  gint fd;      /**< eventfd holding the count, or -1 to use the fields above. */
 };
 
 GSem *g_sem_new (void);
 void g_sem_free (GSem * sem);
+gint g_sem_get_fd (GSem * sem);
 void g_sem_down (GSem * sem);
+gboolean g_sem_down_until (GSem * sem, gint64 end_time);
 void g_sem_up (GSem * sem);
 
+gboolean g_sem_cond_wait_until (GCond * cond, GMutex * mutex, gint64 end_time);
+gboolean g_sem_fd_wait_until (gint fd, gint64 end_time);
+
 #endif /* SEM_H */